@@ -0,0 +1,456 @@
+// Headless solver benchmark. Spawns a fixed scenario from a fixed seed,
+// steps it without opening a window and reports the time spent per substep
+// in each solver pass. With -w the scenario is spawned in that many worlds
+// instead, each from its own seed, which are stepped together and report
+// their throughput. With -x the worlds run in deterministic mode and
+// report the hash of their final state, which must match between builds.
+//
+// usage: VerletBench [balls|ropes|cloth|pegs|volume|bodies|fields|stir|all] [-n objects] [-f frames] [-s seed] [-t threads] [-j]
+//                    [-l snapshot] [-o snapshot] [-r recording] [-a] [-d] [-p trace] [-g] [-w worlds] [-x] [-c]
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raylib.h"
+#include "common.h"
+
+#define WARMUP_FRAMES 60
+#define FRAME_TIME (1.0f/60.0f)
+// fraction of a disc a Poisson disk volume covers with objects
+#define VOLUME_PACKING 0.65f
+// frames the stir scenario waits for its pile to fall asleep
+#define SETTLE_FRAMES 1200
+
+typedef struct Scenario {
+    const char *name;
+    void (*spawn)(VerletWorld *world, int numObjects);
+    bool applyConstraint;
+} Scenario;
+
+static unsigned int rngState = 1;
+static const char *loadPath = NULL;
+static const char *savePath = NULL;
+static const char *recordPath = NULL;
+static bool adaptive = false;
+static const char *tracePath = NULL;
+static LinkSolver linkSolver = LINK_SOLVER_GAUSS_SEIDEL;
+static bool sleeping = true;
+static bool neighbourLists = true;
+static bool deterministic = false;
+static bool sweeping = true;
+
+// xorshift32, so scenarios do not depend on the C library's rand()
+static unsigned int NextRandom(void) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static float RandomRange(float min, float max) {
+    return min + (max - min)*(float)(NextRandom() & 0xFFFFFF)/(float)0xFFFFFF;
+}
+
+static Color RandomColor(void) {
+    return (Color){ NextRandom() & 0xFF, NextRandom() & 0xFF, NextRandom() & 0xFF, 255 };
+}
+
+// fill the constraint circle with balls on a jittered lattice so the
+// scenario starts without deep overlaps
+static void SpawnBalls(VerletWorld *world, int numObjects) {
+    Vector2 center = { (float)g_screenWidth/2, (float)g_screenHeight/2 };
+    float maxRadius = 7;
+    float spacing = 2*maxRadius + 1;
+    int spawned = 0;
+    for (float y = center.y + 390 - maxRadius; y > center.y - 390 && spawned < numObjects; y -= spacing) {
+        for (float x = center.x - 390; x < center.x + 390 && spawned < numObjects; x += spacing) {
+            float dx = x - center.x;
+            float dy = y - center.y;
+            if (dx*dx + dy*dy > (390 - maxRadius)*(390 - maxRadius)) continue;
+            Vector2 pos = { x + RandomRange(-0.5f, 0.5f), y + RandomRange(-0.5f, 0.5f) };
+            SpawnVerletObject(world, pos, RandomRange(4, maxRadius), RandomColor());
+            spawned++;
+        }
+    }
+}
+
+static void SpawnRopes(VerletWorld *world, int numObjects) {
+    int numJoints = 35;
+    for (int i = 0; i < numObjects/numJoints; i++) {
+        Vector2 pos = { 200 + RandomRange(-20, 20), 50 + i*20.0f };
+        SpawnStructureRope(world, pos, numJoints, 25, 8, BOTH, RandomColor());
+    }
+}
+
+static void SpawnCloth(VerletWorld *world, int numObjects) {
+    (void)numObjects;
+    SpawnStructureCloth(world, (Vector2){ 280, 50 }, 60, 12, 0, RandomColor());
+}
+
+// balls raining through a tall board of pegs, thousands of colliders
+static void SpawnPegs(VerletWorld *world, int numObjects) {
+    for (int row = 0; row < 100; row++) {
+        float y = 200 + row*20.0f;
+        for (float x = (row % 2)*10.0f; x <= g_screenWidth; x += 20) {
+            AddColliderCapsule((Vector2){ x, y }, (Vector2){ x, y }, 3);
+        }
+    }
+    AddColliderBox((Vector2){ g_screenWidth/2.0f, 2250 }, (Vector2){ g_screenWidth + 100, 40 }, 0);
+    AddColliderSegment((Vector2){ -20, -4000 }, (Vector2){ -20, 2230 });
+    AddColliderSegment((Vector2){ g_screenWidth + 20, -4000 }, (Vector2){ g_screenWidth + 20, 2230 });
+    int spawned = 0;
+    for (float y = 180; spawned < numObjects; y -= 12) {
+        for (float x = 10; x < g_screenWidth - 10 && spawned < numObjects; x += 12) {
+            SpawnVerletObject(world, (Vector2){ x + RandomRange(-0.5f, 0.5f), y }, 4, RandomColor());
+            spawned++;
+        }
+    }
+}
+
+// A Poisson disk volume filling the constraint circle, the radius picked
+// so that it holds about numObjects objects. Shows what bulk spawning costs
+static void SpawnVolume(VerletWorld *world, int numObjects) {
+    Vector2 center = { (float)g_screenWidth/2, (float)g_screenHeight/2 };
+    float radius = 390*sqrtf(VOLUME_PACKING/(numObjects > 0? numObjects: 1));
+    EmitVerletPoissonDisk(world, center, 390, radius, RandomColor(), NextRandom());
+}
+
+// small pressurised rings of 8 joints packed into the constraint circle
+static void SpawnBodies(VerletWorld *world, int numObjects) {
+    Vector2 center = { (float)g_screenWidth/2, (float)g_screenHeight/2 };
+    int spawned = 0;
+    for (float y = center.y + 380; y > center.y - 380 && spawned + 8 <= numObjects; y -= 15) {
+        for (float x = center.x - 380; x < center.x + 380 && spawned + 8 <= numObjects; x += 15) {
+            float dx = x - center.x;
+            float dy = y - center.y;
+            if (dx*dx + dy*dy > 380*380) continue;
+            SpawnStructureRing(world, (Vector2){ x, y }, 6, 8, 1.5f, 4000, RandomColor());
+            spawned += 8;
+        }
+    }
+}
+
+// The balls stirred by vortices and attractors, with a wind zone across
+// the top and a drag zone at the bottom, all summed into one field grid
+static void SpawnFields(VerletWorld *world, int numObjects) {
+    SpawnBalls(world, numObjects);
+    Vector2 center = { (float)g_screenWidth/2, (float)g_screenHeight/2 };
+    for (int i = 0; i < 6; i++) {
+        float angle = i*2*PI/6;
+        ForceField field = { 0 };
+        field.type = i % 2 == 0? FIELD_VORTEX: FIELD_ATTRACTOR;
+        field.center = (Vector2){ center.x + 220*cosf(angle), center.y + 220*sinf(angle) };
+        field.radius = 160;
+        field.strength = i % 2 == 0? 3000: 1500;
+        AddVerletForceField(world, field);
+    }
+    ForceField wind = { 0 };
+    wind.type = FIELD_WIND;
+    wind.area = (Rectangle){ center.x - 390, center.y - 390, 780, 200 };
+    wind.wind = (Vector2){ 800, 0 };
+    AddVerletForceField(world, wind);
+    ForceField drag = { 0 };
+    drag.type = FIELD_DRAG;
+    drag.area = (Rectangle){ center.x - 390, center.y + 190, 780, 200 };
+    drag.strength = 4;
+    AddVerletForceField(world, drag);
+}
+
+// The balls left to settle until they fall asleep, then stirred by a
+// vortex over the pile. A field has to wake what it lands on, so the
+// run stops here if anything sleeps through the vortex's first frame
+static void SpawnStir(VerletWorld *world, int numObjects) {
+    SpawnBalls(world, numObjects);
+    for (int i = 0; i < SETTLE_FRAMES && GetNumSleeping(world) < GetNumObjects(world); i++) {
+        UpdateVerlet(world, FRAME_TIME, 1);
+    }
+    ForceField vortex = { 0 };
+    vortex.type = FIELD_VORTEX;
+    vortex.center = (Vector2){ (float)g_screenWidth/2, (float)g_screenHeight/2 + 200 };
+    vortex.radius = 250;
+    vortex.strength = 3000;
+    AddVerletForceField(world, vortex);
+    UpdateVerlet(world, FRAME_TIME, 1);
+    if (GetNumSleeping(world) > 0) {
+        fprintf(stderr, "stir: %d objects slept through the vortex\n", GetNumSleeping(world));
+        exit(1);
+    }
+}
+
+// replay a scene saved from the demo with F5 or from an earlier run
+static void SpawnSnapshot(VerletWorld *world, int numObjects) {
+    (void)numObjects;
+    if (!LoadVerletSnapshot(world, loadPath)) {
+        fprintf(stderr, "could not load snapshot '%s'\n", loadPath);
+        exit(1);
+    }
+}
+
+static const Scenario scenarios[] = {
+    { "balls", SpawnBalls, true },
+    { "ropes", SpawnRopes, false },
+    { "cloth", SpawnCloth, false },
+    { "pegs", SpawnPegs, false },
+    { "volume", SpawnVolume, true },
+    { "bodies", SpawnBodies, true },
+    { "fields", SpawnFields, true },
+    { "stir", SpawnStir, true },
+};
+#define NUM_SCENARIOS (int)(sizeof(scenarios)/sizeof(scenarios[0]))
+
+static const char *passNames[NUM_SOLVER_PASSES] = {
+    "ApplyAcceleration",
+    "ApplyConstraintCircle",
+    "ApplyColliders",
+    "SolveCollisions",
+    "ApplyLinks",
+    "UpdatePositions",
+};
+
+// a new world with the run's settings and the scenario spawned from seed,
+// exits if there is no memory for it
+static VerletWorld *CreateScenarioWorld(const Scenario *scenario, int numObjects, unsigned int seed) {
+    VerletWorld *world = CreateVerletWorld();
+    if (world == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    rngState = seed? seed: 1;
+    SetVerletConstraint(world, scenario->applyConstraint);
+    // keep every spawned object alive so runs stay comparable
+    SetVerletWorldBounds(world, (Rectangle){ -1e6f, -1e6f, 2e6f, 2e6f });
+    // every run starts from PHYSICS_SUBSTEPS, adaptive runs move from there
+    SetVerletSubsteps(world, PHYSICS_SUBSTEPS, PHYSICS_SUBSTEPS);
+    SetVerletIterations(world, 1, 1);
+    if (adaptive) {
+        SetVerletSubsteps(world, MIN_SUBSTEPS, MAX_SUBSTEPS);
+        SetVerletIterations(world, 1, MAX_ITERATIONS);
+    }
+    SetVerletStepBudget(world, adaptive? STEP_BUDGET: 0);
+    SetVerletLinkSolver(world, linkSolver);
+    SetVerletSleeping(world, sleeping);
+    if (!neighbourLists) SetVerletNeighbourSkin(world, 0);
+    SetVerletDeterministic(world, deterministic);
+    SetVerletSweeping(world, sweeping);
+    scenario->spawn(world, numObjects);
+    return world;
+}
+
+static void RunScenario(const Scenario *scenario, int numObjects, int numFrames, unsigned int seed) {
+    ClearColliders();
+    double spawnStart = GetHighResTime();
+    VerletWorld *world = CreateScenarioWorld(scenario, numObjects, seed);
+    double spawnTime = (GetHighResTime() - spawnStart)*1000.0;
+    SetVerletProfiled(world, true);
+    SetVerletRecorded(world, true);
+
+    for (int i = 0; i < WARMUP_FRAMES; i++) {
+        UpdateVerlet(world, FRAME_TIME, 1);
+    }
+    ResetVerletPassTimes(world);
+    // close the warmup frames so they don't count towards the first one
+    EndProfileFrame();
+    // recording is timed as part of the frame, it shows up in no pass.
+    // Positions are quantised over the demo's world, not the huge bounds
+    Rectangle recordBounds = {
+        -g_screenWidth, -g_screenHeight, 3*g_screenWidth, 3*g_screenHeight
+    };
+    if (recordPath != NULL && !StartRecording(recordPath, recordBounds)) {
+        fprintf(stderr, "could not record to '%s'\n", recordPath);
+    }
+    if (tracePath != NULL && !StartProfileTrace()) {
+        fprintf(stderr, "could not start a profile trace\n");
+    }
+    double start = GetHighResTime();
+    for (int i = 0; i < numFrames; i++) {
+        UpdateVerlet(world, FRAME_TIME, 1);
+        EndProfileFrame();
+    }
+    double frameTime = (GetHighResTime() - start)*1000.0/numFrames;
+    if (IsProfileTracing() && !StopProfileTrace(tracePath)) {
+        fprintf(stderr, "could not write trace '%s'\n", tracePath);
+    }
+    int dropped = GetDroppedFrames();
+    if (IsRecording() && !StopRecording()) {
+        fprintf(stderr, "recording to '%s' is incomplete\n", recordPath);
+    }
+
+    int substeps = GetVerletSubsteps(world);
+    double total = 0;
+    printf("%s: %d objects (%d asleep), %d colliders, %d bodies, %d frames, %d substeps, %d threads\n",
+            scenario->name, GetNumObjects(world), GetNumSleeping(world), GetNumColliders(), GetNumSoftBodies(world),
+            numFrames, substeps, GetNumThreads());
+    for (int i = 0; i < NUM_SOLVER_PASSES; i++) {
+        double ms = GetVerletPassTime(world, i)*1000.0/substeps;
+        total += ms;
+        printf("  %-24s %10.4f ms/substep\n", passNames[i], ms);
+    }
+    printf("  %-24s %10.4f ms/substep\n", "total", total);
+    printf("  %-24s %10.4f ms/frame\n", "frame", frameTime);
+    printf("  %-24s %10.4f ms\n", "spawn", spawnTime);
+    printf("  last frame: %d substeps x %d iterations, error %.4f\n",
+            GetVerletStepSubsteps(world), GetVerletStepIterations(world), GetVerletStepError(world));
+    printf("  neighbour lists rebuilt in %d of %d collision passes\n",
+            GetVerletNeighbourRebuilds(world), GetVerletCollisionPasses(world));
+    printf("  last frame: %d pair tests, %d contacts, %d links stretched, %d objects swept\n",
+            GetProfileCount(COUNTER_PAIR_TESTS), GetProfileCount(COUNTER_CONTACTS),
+            GetProfileCount(COUNTER_LINKS_STRETCHED), GetProfileCount(COUNTER_SWEPT_OBJECTS));
+    if (recordPath != NULL) {
+        printf("  recorded to %s, %d frames dropped\n", recordPath, dropped);
+    }
+    if (deterministic) {
+        printf("  state hash %016llx\n", (unsigned long long)GetVerletStateHash(world));
+    }
+    printf("\n");
+
+    if (savePath != NULL && !SaveVerletSnapshot(world, savePath)) {
+        fprintf(stderr, "could not save snapshot '%s'\n", savePath);
+    }
+    DestroyVerletWorld(world);
+}
+
+// The scenario in numWorlds worlds of numObjects objects each, world w
+// spawned from seed + w, all stepped together by StepVerletWorlds(). The
+// pass times mean little here, what counts is how many world steps the
+// pool gets through per second
+static void RunWorlds(const Scenario *scenario, int numWorlds, int numObjects, int numFrames,
+        unsigned int seed) {
+    VerletWorld **worlds = malloc(sizeof(VerletWorld *)*numWorlds);
+    if (worlds == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    double spawnStart = GetHighResTime();
+    int totalObjects = 0;
+    for (int w = 0; w < numWorlds; w++) {
+        // scenarios with a level build the same one every time
+        ClearColliders();
+        worlds[w] = CreateScenarioWorld(scenario, numObjects, seed + w);
+        totalObjects += GetNumObjects(worlds[w]);
+    }
+    double spawnTime = (GetHighResTime() - spawnStart)*1000.0;
+
+    for (int i = 0; i < WARMUP_FRAMES; i++) {
+        StepVerletWorlds(worlds, numWorlds, FRAME_TIME, 1);
+    }
+    double start = GetHighResTime();
+    for (int i = 0; i < numFrames; i++) {
+        StepVerletWorlds(worlds, numWorlds, FRAME_TIME, 1);
+    }
+    double elapsed = GetHighResTime() - start;
+
+    int asleep = 0;
+    for (int w = 0; w < numWorlds; w++) {
+        asleep += GetNumSleeping(worlds[w]);
+    }
+    printf("%s: %d worlds, %d objects (%d asleep), %d colliders, %d frames, %d threads\n",
+            scenario->name, numWorlds, totalObjects, asleep, GetNumColliders(), numFrames,
+            GetNumThreads());
+    printf("  %-24s %10.4f ms/frame\n", "frame", elapsed*1000.0/numFrames);
+    printf("  %-24s %10.1f steps/s\n", "world steps", (double)numWorlds*numFrames/elapsed);
+    printf("  %-24s %10.0f objects/s\n", "object steps", (double)totalObjects*numFrames/elapsed);
+    printf("  %-24s %10.4f ms\n", "spawn", spawnTime);
+    if (deterministic) {
+        // one hash over every world, in order
+        unsigned long long hash = 0;
+        for (int w = 0; w < numWorlds; w++) {
+            hash = hash*31 + GetVerletStateHash(worlds[w]);
+        }
+        printf("  state hash %016llx\n", hash);
+    }
+    printf("\n");
+
+    for (int w = 0; w < numWorlds; w++) {
+        DestroyVerletWorld(worlds[w]);
+    }
+    free(worlds);
+}
+
+int main(int argc, char **argv) {
+    const char *which = "all";
+    int numObjects = 3000;
+    int numFrames = 300;
+    unsigned int seed = 12345;
+    int numWorlds = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            numObjects = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            numFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            SetNumThreads(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-j") == 0) {
+            linkSolver = LINK_SOLVER_JACOBI;
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            loadPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-a") == 0) {
+            // keep every object awake
+            sleeping = false;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-g") == 0) {
+            // search the grid every collision pass, no neighbour lists
+            neighbourLists = false;
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            numWorlds = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-x") == 0) {
+            // fixed evaluation order and a hash of the final state
+            deterministic = true;
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            // no swept tests, fast objects may pass through things
+            sweeping = false;
+        }
+        else if (strcmp(argv[i], "-d") == 0) {
+            // let the solver pick substeps and iterations per frame
+            adaptive = true;
+        }
+        else if (argv[i][0] != '-') {
+            which = argv[i];
+        }
+        else {
+            fprintf(stderr, "usage: %s [balls|ropes|cloth|pegs|volume|bodies|fields|stir|all] [-n objects] [-f frames] [-s seed] [-t threads] [-j]"
+                     " [-l snapshot] [-o snapshot] [-r recording] [-a] [-d] [-p trace] [-g] [-w worlds] [-x] [-c]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bool found = false;
+    if (loadPath != NULL) {
+        Scenario snapshot = { "snapshot", SpawnSnapshot, false };
+        RunScenario(&snapshot, numObjects, numFrames, seed);
+        found = true;
+    }
+    for (int i = 0; i < NUM_SCENARIOS && loadPath == NULL; i++) {
+        if (strcmp(which, "all") == 0 || strcmp(which, scenarios[i].name) == 0) {
+            if (numWorlds > 0) RunWorlds(&scenarios[i], numWorlds, numObjects, numFrames, seed);
+            else RunScenario(&scenarios[i], numObjects, numFrames, seed);
+            found = true;
+        }
+    }
+    ShutdownThreads();
+    if (!found) {
+        fprintf(stderr, "unknown scenario '%s'\n", which);
+        return 1;
+    }
+    return 0;
+}
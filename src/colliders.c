@@ -0,0 +1,442 @@
+// Static level geometry: segments, capsules and rotated boxes the objects
+// collide with. The colliders sit in a bounding volume hierarchy that is
+// rebuilt the first time they are queried after a change, so a level costs
+// one build when it is loaded. Every world collides with the same level.
+//
+// Objects are queried in groups of COLLIDER_GROUP_SIZE consecutive objects,
+// which the spatial sort keeps close together in space. A group walks the
+// tree once as a packet, each node only tests the objects whose bounds
+// reached its parent, and every collider an object reaches is tested
+// against the four objects around it in a SIMD kernel.
+//
+// Objects too fast for that are swept along their path instead, see
+// SweepColliders(). A box is swept as its four edges, a disc coming from
+// outside reaches an edge before anything else of the box.
+//
+// level file: one collider per line, lengths in pixels, angles in degrees
+//     segment x1 y1 x2 y2
+//     capsule x1 y1 x2 y2 radius
+//     box centerX centerY width height angle
+// blank lines and lines starting with # are skipped
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raylib.h"
+#include "common.h"
+
+#define MIN_COLLIDERS 64
+#define BVH_LEAF_SIZE 2
+#define BVH_MAX_DEPTH 64
+// a multiple of 4 for the kernels and at most 32 for the traversal masks
+#define COLLIDER_GROUP_SIZE 8
+
+// leaves list count colliders from start, inner nodes have count 0 and
+// their children at the next node and at start
+typedef struct BvhNode {
+    float minX;
+    float minY;
+    float maxX;
+    float maxY;
+    int start;
+    int count;
+} BvhNode;
+
+typedef struct ColliderQuery {
+    float *x;
+    float *y;
+    const float *radius;
+    const uint32_t *frozen;
+    int count;
+} ColliderQuery;
+
+static Collider *colliders = NULL;
+static int numColliders = 0;
+static int colliderCapacity = 0;
+static BvhNode *nodes = NULL;
+static int numNodes = 0;
+static bool bvhDirty = false;
+static unsigned int version = 0;
+static int sortAxis = 0;
+
+static Collider *AddCollider(void) {
+    if (numColliders == colliderCapacity) {
+        int capacity = colliderCapacity > 0? 2*colliderCapacity: MIN_COLLIDERS;
+        Collider *grown = realloc(colliders, sizeof(Collider)*capacity);
+        if (grown == NULL) return NULL;
+        colliders = grown;
+        colliderCapacity = capacity;
+    }
+    bvhDirty = true;
+    version++;
+    return &colliders[numColliders++];
+}
+
+void AddColliderCapsule(Vector2 start, Vector2 end, float radius) {
+    Collider *collider = AddCollider();
+    if (collider == NULL) return;
+    Rectangle bounds = {
+        fminf(start.x, end.x) - radius, fminf(start.y, end.y) - radius,
+        fabsf(end.x - start.x) + 2*radius, fabsf(end.y - start.y) + 2*radius
+    };
+    *collider = (Collider){ COLLIDER_CAPSULE, start, end, radius, { 1, 0 }, bounds };
+}
+
+void AddColliderSegment(Vector2 start, Vector2 end) {
+    AddColliderCapsule(start, end, 0);
+}
+
+// rotation in degrees, like raylib's drawing functions
+void AddColliderBox(Vector2 center, Vector2 size, float rotation) {
+    Collider *collider = AddCollider();
+    if (collider == NULL) return;
+    Vector2 axis = { cosf(rotation*DEG2RAD), sinf(rotation*DEG2RAD) };
+    Vector2 half = { size.x/2, size.y/2 };
+    float extentX = fabsf(axis.x)*half.x + fabsf(axis.y)*half.y;
+    float extentY = fabsf(axis.y)*half.x + fabsf(axis.x)*half.y;
+    Rectangle bounds = { center.x - extentX, center.y - extentY, 2*extentX, 2*extentY };
+    *collider = (Collider){ COLLIDER_BOX, center, half, 0, axis, bounds };
+}
+
+void ClearColliders(void) {
+    numColliders = 0;
+    bvhDirty = true;
+    version++;
+}
+
+int GetNumColliders(void) {
+    return numColliders;
+}
+
+bool LoadColliders(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return false;
+    ClearColliders();
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        char type[16];
+        float v[6];
+        int read = sscanf(line, "%15s %f %f %f %f %f", type, &v[0], &v[1], &v[2], &v[3], &v[4]);
+        if (read <= 0 || type[0] == '#') continue;
+        if (strcmp(type, "segment") == 0 && read >= 5) {
+            AddColliderSegment((Vector2){ v[0], v[1] }, (Vector2){ v[2], v[3] });
+        }
+        else if (strcmp(type, "capsule") == 0 && read == 6) {
+            AddColliderCapsule((Vector2){ v[0], v[1] }, (Vector2){ v[2], v[3] }, v[4]);
+        }
+        else if (strcmp(type, "box") == 0 && read == 6) {
+            AddColliderBox((Vector2){ v[0], v[1] }, (Vector2){ v[2], v[3] }, v[4]);
+        }
+        else {
+            ok = false;
+        }
+    }
+    fclose(file);
+    // half a level is worse than none
+    if (!ok) ClearColliders();
+    return ok;
+}
+
+static int CompareColliderCenters(const void *a, const void *b) {
+    const Rectangle *ra = &((const Collider *)a)->bounds;
+    const Rectangle *rb = &((const Collider *)b)->bounds;
+    float ca = sortAxis == 0? 2*ra->x + ra->width: 2*ra->y + ra->height;
+    float cb = sortAxis == 0? 2*rb->x + rb->width: 2*rb->y + rb->height;
+    return (ca > cb) - (ca < cb);
+}
+
+// Top down build: the colliders are sorted by centre along the longer
+// side of the node and split in half, so the tree is balanced and its
+// depth stays near log2(numColliders/BVH_LEAF_SIZE)
+static void BuildNode(int start, int count) {
+    BvhNode *node = &nodes[numNodes++];
+    node->minX = FLT_MAX;
+    node->minY = FLT_MAX;
+    node->maxX = -FLT_MAX;
+    node->maxY = -FLT_MAX;
+    for (int i = start; i < start + count; i++) {
+        Rectangle r = colliders[i].bounds;
+        node->minX = fminf(node->minX, r.x);
+        node->minY = fminf(node->minY, r.y);
+        node->maxX = fmaxf(node->maxX, r.x + r.width);
+        node->maxY = fmaxf(node->maxY, r.y + r.height);
+    }
+    if (count <= BVH_LEAF_SIZE) {
+        node->start = start;
+        node->count = count;
+        return;
+    }
+    sortAxis = node->maxX - node->minX >= node->maxY - node->minY? 0: 1;
+    qsort(colliders + start, count, sizeof(Collider), CompareColliderCenters);
+    int index = (int)(node - nodes);
+    int half = count/2;
+    BuildNode(start, half);
+    nodes[index].start = numNodes;
+    nodes[index].count = 0;
+    BuildNode(start + half, count - half);
+}
+
+static bool BuildBvh(void) {
+    bvhDirty = false;
+    numNodes = 0;
+    if (numColliders == 0) return true;
+    // a binary tree over n leaves has fewer than 2n nodes
+    BvhNode *grown = realloc(nodes, sizeof(BvhNode)*2*numColliders);
+    if (grown == NULL) {
+        bvhDirty = true;
+        return false;
+    }
+    nodes = grown;
+    BuildNode(0, numColliders);
+    return true;
+}
+
+static void CollideGroup(int task, void *data) {
+    ColliderQuery *query = data;
+    int start = task*COLLIDER_GROUP_SIZE;
+    int end = start + COLLIDER_GROUP_SIZE < query->count? start + COLLIDER_GROUP_SIZE: query->count;
+
+    float minX[COLLIDER_GROUP_SIZE];
+    float minY[COLLIDER_GROUP_SIZE];
+    float maxX[COLLIDER_GROUP_SIZE];
+    float maxY[COLLIDER_GROUP_SIZE];
+    uint32_t active = 0;
+    for (int i = start; i < end; i++) {
+        int k = i - start;
+        float r = query->radius[i];
+        minX[k] = query->x[i] - r;
+        minY[k] = query->y[i] - r;
+        maxX[k] = query->x[i] + r;
+        maxY[k] = query->y[i] + r;
+        if (!TEST_BIT(query->frozen, i)) active |= 1u << k;
+    }
+
+    // packet traversal: every entry carries the objects still inside it
+    int stack[BVH_MAX_DEPTH];
+    uint32_t stackMask[BVH_MAX_DEPTH];
+    int top = 0;
+    if (active != 0) {
+        stack[top] = 0;
+        stackMask[top++] = active;
+    }
+    while (top > 0) {
+        top--;
+        const BvhNode *node = &nodes[stack[top]];
+        uint32_t mask = stackMask[top] & OverlapBoundsKernel(minX, minY, maxX, maxY, end - start,
+                node->minX, node->minY, node->maxX, node->maxY);
+        if (mask == 0) continue;
+        if (node->count == 0) {
+            stack[top] = node->start;
+            stackMask[top++] = mask;
+            stack[top] = (int)(node - nodes) + 1;
+            stackMask[top++] = mask;
+            continue;
+        }
+        for (int c = node->start; c < node->start + node->count; c++) {
+            const Collider *collider = &colliders[c];
+            Rectangle r = collider->bounds;
+            uint32_t hits = mask & OverlapBoundsKernel(minX, minY, maxX, maxY, end - start,
+                    r.x, r.y, r.x + r.width, r.y + r.height);
+            // the kernels work on four objects at a time
+            for (int k = 0; k < end - start; k += 4) {
+                if (((hits >> k) & 0xF) == 0) continue;
+                int from = start + k;
+                int to = from + 4 < end? from + 4: end;
+                if (collider->type == COLLIDER_CAPSULE) {
+                    CollideCapsuleKernel(query->x, query->y, query->radius, query->frozen,
+                            from, to, collider->a, collider->b, collider->radius);
+                }
+                else {
+                    CollideBoxKernel(query->x, query->y, query->radius, query->frozen,
+                            from, to, collider->a, collider->b, collider->axis);
+                }
+            }
+        }
+    }
+}
+
+void UpdateColliderTree(void) {
+    if (bvhDirty) BuildBvh();
+}
+
+// push every object that isn't frozen out of the colliders
+void ApplyColliders(float *x, float *y, const float *radius, const uint32_t *frozen, int count) {
+    if (numColliders == 0 || count == 0) return;
+    // worlds stepped in parallel only read the tree, see UpdateColliderTree()
+    if (bvhDirty && (IsInsideTask() || !BuildBvh())) return;
+    ColliderQuery query = { x, y, radius, frozen, count };
+    RunTasks(CollideGroup, (count + COLLIDER_GROUP_SIZE - 1)/COLLIDER_GROUP_SIZE, &query);
+}
+
+// If a point moving from offset by move comes within reach of the origin
+// sooner than *time, sets *time to when it does and returns true. A point
+// already within reach is met at once if it moves further in, pushing it
+// back out is left to the position passes
+bool SweepDisc(Vector2 offset, Vector2 move, float reach, float *time) {
+    float a = move.x*move.x + move.y*move.y;
+    float b = offset.x*move.x + offset.y*move.y;
+    float c = offset.x*offset.x + offset.y*offset.y - reach*reach;
+    if (b >= 0 || !(a > 0) || !(*time > 0)) return false;
+    if (c <= 0) {
+        *time = 0;
+        return true;
+    }
+    float discriminant = b*b - a*c;
+    if (discriminant < 0) return false;
+    float t = (-b - sqrtf(discriminant))/a;
+    if (!(t < *time)) return false;
+    *time = t;
+    return true;
+}
+
+// Same for the capsule a-b grown by reach: either end's disc or one of the
+// sides between them. normal points out of the capsule where it was met
+static bool SweepCapsule(Vector2 from, Vector2 move, Vector2 a, Vector2 b, float reach, float *time,
+        Vector2 *normal) {
+    float dx = b.x - a.x;
+    float dy = b.y - a.y;
+    float length = sqrtf(dx*dx + dy*dy);
+    Vector2 offset = { from.x - a.x, from.y - a.y };
+    float along = length > 0? (offset.x*dx + offset.y*dy)/length: 0;
+    float closest = fminf(fmaxf(along, 0), length)/(length > 0? length: 1);
+    float cx = offset.x - closest*dx;
+    float cy = offset.y - closest*dy;
+    float distance2 = cx*cx + cy*cy;
+    if (distance2 <= reach*reach) {
+        if (!(distance2 > 0) || cx*move.x + cy*move.y >= 0 || !(*time > 0)) return false;
+        float distance = sqrtf(distance2);
+        *time = 0;
+        *normal = (Vector2){ cx/distance, cy/distance };
+        return true;
+    }
+
+    bool hit = SweepDisc(offset, move, reach, time);
+    hit = SweepDisc((Vector2){ from.x - b.x, from.y - b.y }, move, reach, time) || hit;
+    if (length > 0) {
+        Vector2 side = { -dy/length, dx/length };
+        float distance = offset.x*side.x + offset.y*side.y;
+        float approach = move.x*side.x + move.y*side.y;
+        if (distance < 0) {
+            side = (Vector2){ -side.x, -side.y };
+            distance = -distance;
+            approach = -approach;
+        }
+        if (distance > reach && approach < 0) {
+            float t = (distance - reach)/-approach;
+            float at = ((offset.x + t*move.x)*dx + (offset.y + t*move.y)*dy)/length;
+            if (t < *time && at >= 0 && at <= length) {
+                *time = t;
+                *normal = side;
+                return true;
+            }
+        }
+    }
+    if (!hit) return false;
+    // met at one of the ends
+    Vector2 p = { from.x + *time*move.x - a.x, from.y + *time*move.y - a.y };
+    float t = length > 0? fminf(fmaxf((p.x*dx + p.y*dy)/(length*length), 0), 1): 0;
+    float nx = p.x - t*dx;
+    float ny = p.y - t*dy;
+    float distance = sqrtf(nx*nx + ny*ny);
+    *normal = distance > 0? (Vector2){ nx/distance, ny/distance }: (Vector2){ 0, -1 };
+    return true;
+}
+
+static bool SweepCollider(const Collider *collider, Vector2 from, Vector2 move, float radius,
+        float *time, Vector2 *normal) {
+    if (collider->type == COLLIDER_CAPSULE) {
+        return SweepCapsule(from, move, collider->a, collider->b, collider->radius + radius, time, normal);
+    }
+    Vector2 center = collider->a;
+    Vector2 half = collider->b;
+    Vector2 axis = collider->axis;
+    float lx = (from.x - center.x)*axis.x + (from.y - center.y)*axis.y;
+    float ly = (from.y - center.y)*axis.x - (from.x - center.x)*axis.y;
+    if (fabsf(lx) <= half.x && fabsf(ly) <= half.y) return false;
+    Vector2 corners[4];
+    for (int k = 0; k < 4; k++) {
+        float sx = k == 1 || k == 2? half.x: -half.x;
+        float sy = k >= 2? half.y: -half.y;
+        corners[k] = (Vector2){
+            center.x + sx*axis.x - sy*axis.y, center.y + sx*axis.y + sy*axis.x
+        };
+    }
+    bool hit = false;
+    for (int k = 0; k < 4; k++) {
+        hit = SweepCapsule(from, move, corners[k], corners[(k + 1) % 4], radius, time, normal) || hit;
+    }
+    return hit;
+}
+
+// The earliest time in [0, 1) a disc moving from from by move meets a
+// collider, if sooner than *time, and the collider's normal there. Discs
+// that start out touching a collider are left to ApplyColliders()
+bool SweepColliders(Vector2 from, Vector2 move, float radius, float *time, Vector2 *normal) {
+    if (numColliders == 0 || bvhDirty) return false;
+    float minX = fminf(from.x, from.x + move.x) - radius;
+    float minY = fminf(from.y, from.y + move.y) - radius;
+    float maxX = fmaxf(from.x, from.x + move.x) + radius;
+    float maxY = fmaxf(from.y, from.y + move.y) + radius;
+    bool hit = false;
+    int stack[BVH_MAX_DEPTH];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const BvhNode *node = &nodes[stack[--top]];
+        if (node->minX > maxX || node->maxX < minX || node->minY > maxY || node->maxY < minY) continue;
+        if (node->count == 0) {
+            stack[top++] = node->start;
+            stack[top++] = (int)(node - nodes) + 1;
+            continue;
+        }
+        for (int c = node->start; c < node->start + node->count; c++) {
+            Rectangle r = colliders[c].bounds;
+            if (r.x > maxX || r.x + r.width < minX || r.y > maxY || r.y + r.height < minY) continue;
+            hit = SweepCollider(&colliders[c], from, move, radius, time, normal) || hit;
+        }
+    }
+    return hit;
+}
+
+unsigned int GetCollidersVersion(void) {
+    return version;
+}
+
+// Copy the colliders into a buffer that is grown as needed, so another
+// thread can draw them. Returns the number copied, which is less than
+// the number of colliders only if the buffer could not grow
+int CopyColliders(Collider **buffer, int *capacity) {
+    if (numColliders > *capacity) {
+        Collider *grown = realloc(*buffer, sizeof(Collider)*numColliders);
+        if (grown != NULL) {
+            *buffer = grown;
+            *capacity = numColliders;
+        }
+    }
+    int count = numColliders < *capacity? numColliders: *capacity;
+    if (count > 0) memcpy(*buffer, colliders, sizeof(Collider)*count);
+    return count;
+}
+
+#if !defined(VERLET_HEADLESS)
+void DrawColliders(const Collider *shapes, int count, Color color) {
+    for (int i = 0; i < count; i++) {
+        const Collider *collider = &shapes[i];
+        if (collider->type == COLLIDER_BOX) {
+            float angle = atan2f(collider->axis.y, collider->axis.x)*RAD2DEG;
+            DrawRectanglePro((Rectangle){ collider->a.x, collider->a.y, 2*collider->b.x, 2*collider->b.y },
+                    collider->b, angle, color);
+        }
+        else if (collider->radius > 0) {
+            DrawLineEx(collider->a, collider->b, 2*collider->radius, color);
+            DrawCircleV(collider->a, collider->radius, color);
+            DrawCircleV(collider->b, collider->radius, color);
+        }
+        else {
+            DrawLineEx(collider->a, collider->b, 2, color);
+        }
+    }
+}
+#endif
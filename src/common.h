@@ -1,12 +1,22 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include "raylib.h"
 
 // Global Variables
 #define g_screenWidth 1280
 #define g_screenHeight 900
+#define TARGET_FPS 60
 #define PHYSICS_SUBSTEPS 8
+// ranges the adaptive substepping may choose from
+#define MIN_SUBSTEPS 2
+#define MAX_SUBSTEPS 16
+#define MAX_ITERATIONS 4
+// time a step may take before it gives up substeps, half a frame
+#define STEP_BUDGET (0.5/TARGET_FPS)
+// most simulated time a single frame may catch up on
 #define MAX_FRAME_TIME 0.05
 
 // ---------------------------
@@ -19,16 +29,509 @@ typedef enum Anchoring {
     NONE
 } Anchoring;
 
-void SpawnVerletObject(Vector2 pos, float radius, Color color);
-void SpawnVerletObjectStatic(Vector2 pos, float radius, Color color);
-void SpawnStructureRope(Vector2 pos, int numJoints, float distance,
+// A simulation: its objects, links, bodies and settings. Worlds share
+// nothing but the level colliders, so any number can exist side by side
+// and separate worlds can be stepped on separate threads
+typedef struct VerletWorld VerletWorld;
+
+VerletWorld *CreateVerletWorld(void);
+void DestroyVerletWorld(VerletWorld *world);
+
+void SpawnVerletObject(VerletWorld *world, Vector2 pos, float radius, Color color);
+void SpawnVerletObjectStatic(VerletWorld *world, Vector2 pos, float radius, Color color);
+void SpawnStructureRope(VerletWorld *world, Vector2 pos, int numJoints, float distance,
         float radius, Anchoring anchoring, Color color);
-void SpawnStructureCloth(Vector2 pos, int numSideJoints, float distance,
+void SpawnStructureCloth(VerletWorld *world, Vector2 pos, int numSideJoints, float distance,
         float radius, Color color);
-void SpawnStructureSquare(Vector2 pos, float length, float radius, Color color);
-void UpdateVerlet(float dt);
-void DrawVerlet(void);
-int GetNumObjects(void);
+void SpawnStructureSquare(VerletWorld *world, Vector2 pos, float length, float radius, Color color);
+void SpawnStructureRing(VerletWorld *world, Vector2 center, float ringRadius, int numJoints,
+        float radius, float pressure, Color color);
+void SpawnStructureBlob(VerletWorld *world, Vector2 center, float size, float radius,
+        float pressure, Color color, unsigned int seed);
+// A pressure body: joints at the points, in order around a closed loop,
+// linked to their neighbours with the given compliance. The air inside
+// pushes out along the loop's normals by pressure*(restArea/area - 1)
+// per pixel of perimeter. Returns the first joint's index, or -1
+int SpawnSoftBody(VerletWorld *world, const Vector2 *points, int count, float radius,
+        float pressure, float compliance, Color color);
+int GetNumSoftBodies(VerletWorld *world);
+
+// which ways a link pulls its objects back to its rest length
+typedef enum LinkMode {
+    // like a rope, only when stretched
+    LINK_TENSION = 1,
+    // like a strut that isn't attached, only when squashed
+    LINK_COMPRESSION = 2,
+    // like a rod
+    LINK_BOTH = LINK_TENSION | LINK_COMPRESSION
+} LinkMode;
+
+// Link the two objects at their current distance. Compliance is the XPBD
+// inverse stiffness in pixels per unit of force, 0 for a rigid link
+bool SpawnVerletLink(VerletWorld *world, int object1, int object2, float compliance, LinkMode mode);
+
+// Bulk spawning: room for the whole batch is reserved once and the arrays
+// are filled in parallel chunks. Generators are called once per index from
+// worker threads, in no particular order
+typedef struct VerletObjectDesc {
+    Vector2 pos;
+    float radius;
+    Color color;
+    bool isStatic;
+    bool isColliding;
+} VerletObjectDesc;
+
+// object1 and object2 count from the first object of the batch they were
+// spawned in, see SpawnVerletLinks()
+typedef struct VerletLinkDesc {
+    int object1;
+    int object2;
+    float distance;
+    float compliance;
+    LinkMode mode;
+} VerletLinkDesc;
+
+typedef void (*ObjectGenerator)(int index, void *data, VerletObjectDesc *object);
+typedef void (*LinkGenerator)(int index, void *data, VerletLinkDesc *link);
+
+// make room for this many more objects and links
+bool ReserveVerlet(VerletWorld *world, int numObjects, int numLinks);
+// both return the index of the first object spawned, or -1 if out of memory
+int SpawnVerletObjects(VerletWorld *world, const VerletObjectDesc *objects, int count);
+int GenerateVerletObjects(VerletWorld *world, ObjectGenerator generator, void *data, int count);
+// links whose objects aren't within the existing objects from firstObject
+// on are dropped, returns the number spawned
+int SpawnVerletLinks(VerletWorld *world, const VerletLinkDesc *links, int count, int firstObject);
+int GenerateVerletLinks(VerletWorld *world, LinkGenerator generator, void *data, int count,
+        int firstObject);
+
+// emitters (emitters.c), both return the number of objects spawned
+int EmitVerletGrid(VerletWorld *world, Rectangle area, float spacing, float radius, Color color);
+int EmitVerletPoissonDisk(VerletWorld *world, Vector2 center, float areaRadius, float radius,
+        Color color, unsigned int seed);
+void RemoveVerletObject(VerletWorld *world, int index);
+void UpdateVerlet(VerletWorld *world, float dt, int steps);
+// Take steps steps of dt in every world, the worlds spread over the
+// worker pool. The worlds must all be different, they share the level
+// colliders but only read them
+void StepVerletWorlds(VerletWorld **worlds, int count, float dt, int steps);
+void ClearVerlet(VerletWorld *world);
+void SetVerletGravity(VerletWorld *world, Vector2 vector);
+void SetVerletConstraint(VerletWorld *world, bool enabled);
+void SetVerletAttractor(VerletWorld *world, bool active, Vector2 point);
+void SetVerletWorldBounds(VerletWorld *world, Rectangle bounds);
+Rectangle GetVerletWorldBounds(VerletWorld *world);
+
+// Force fields, on top of gravity. Attractors pull towards center and
+// vortices swirl around it (clockwise on screen for a positive strength),
+// strength pixels/s^2 at the centre fading to nothing at radius. Wind
+// accelerates everything in area by wind, drag takes strength times the
+// velocity off everything in area every second
+typedef enum ForceFieldType {
+    FIELD_ATTRACTOR = 0,
+    FIELD_VORTEX,
+    FIELD_WIND,
+    FIELD_DRAG
+} ForceFieldType;
+
+typedef struct ForceField {
+    ForceFieldType type;
+    Vector2 center;
+    float radius;
+    Rectangle area;
+    Vector2 wind;
+    float strength;
+} ForceField;
+
+// All fields of a world are summed into a cached grid that is rebuilt
+// after a field changes, and applied to every object in a single pass.
+// Add returns an id that stays the field's until it is removed, or -1 if
+// out of memory
+int AddVerletForceField(VerletWorld *world, ForceField field);
+void SetVerletForceField(VerletWorld *world, int id, ForceField field);
+void RemoveVerletForceField(VerletWorld *world, int id);
+void ClearVerletForceFields(VerletWorld *world);
+int GetNumForceFields(VerletWorld *world);
+
+typedef enum LinkSolver {
+    // colour groups solved one after another, each in parallel
+    LINK_SOLVER_GAUSS_SEIDEL = 0,
+    // every link at once from the same positions, corrections averaged
+    LINK_SOLVER_JACOBI
+} LinkSolver;
+
+void SetVerletLinkSolver(VerletWorld *world, LinkSolver solver);
+// wake every sleeping object, e.g. after the level around them changed
+void WakeVerletObjects(VerletWorld *world);
+// objects resting in place fall asleep and skip the solver until touched
+void SetVerletSleeping(VerletWorld *world, bool enabled);
+Vector2 GetVerletGravity(VerletWorld *world);
+bool IsVerletConstraintEnabled(VerletWorld *world);
+
+// binary snapshot of the objects, links, gravity and constraint
+bool SaveVerletSnapshot(VerletWorld *world, const char *path);
+bool LoadVerletSnapshot(VerletWorld *world, const char *path);
+int GetNumObjects(VerletWorld *world);
+int GetNumSleeping(VerletWorld *world);
+
+// timing of the individual solver passes, used by the benchmark
+typedef enum SolverPass {
+    PASS_ACCELERATION = 0,
+    PASS_CONSTRAINT,
+    PASS_COLLIDERS,
+    PASS_COLLISIONS,
+    PASS_LINKS,
+    PASS_POSITIONS,
+    NUM_SOLVER_PASSES
+} SolverPass;
+
+// Every step passed to UpdateVerlet() is split into substeps, each running
+// the collision and link passes some number of iterations. Both counts adapt
+// per step to the remaining overlap and link stretch, within these ranges
+// and the time budget per step (0 for none). Equal limits fix the count
+void SetVerletSubsteps(VerletWorld *world, int minCount, int maxCount);
+void SetVerletIterations(VerletWorld *world, int minCount, int maxCount);
+void SetVerletStepBudget(VerletWorld *world, double seconds);
+int GetVerletStepSubsteps(VerletWorld *world);
+int GetVerletStepIterations(VerletWorld *world);
+// largest overlap or link stretch left after the last step, relative
+float GetVerletStepError(VerletWorld *world);
+
+// Collision pairs within the skin, as a fraction of the largest radius,
+// are listed and reused until an object moves half the skin. 0 rebuilds
+// the grid every collision pass instead
+void SetVerletNeighbourSkin(VerletWorld *world, float fraction);
+int GetVerletNeighbourRebuilds(VerletWorld *world);
+int GetVerletCollisionPasses(VerletWorld *world);
+
+double GetVerletPassTime(VerletWorld *world, SolverPass pass);
+int GetVerletSubsteps(VerletWorld *world);
+void ResetVerletPassTimes(VerletWorld *world);
+// Report the passes and counters to the profiler, and the frames to the
+// recorder. Both follow a single world, so this is off for new worlds
+void SetVerletProfiled(VerletWorld *world, bool enabled);
+void SetVerletRecorded(VerletWorld *world, bool enabled);
+// Deterministic mode for lockstep and replays: the same world stepped with
+// the same calls ends in the same state, bit for bit, whatever the thread
+// count or SIMD width, as long as the build keeps strict IEEE float (no
+// -ffast-math, no fused multiply-add). Every frame then folds a hash of the
+// state into the state hash, which two runs can compare frame by frame
+void SetVerletDeterministic(VerletWorld *world, bool enabled);
+uint64_t GetVerletStateHash(VerletWorld *world);
+void ResetVerletStateHash(VerletWorld *world);
+// Objects that move further than their radius in a substep are swept
+// along their path against the objects, the constraint and the colliders,
+// so they can't pass through them. On for new worlds
+void SetVerletSweeping(VerletWorld *world, bool enabled);
+
+// packed per-object flags
+#define BIT_WORDS(n) (((n) + 31)/32)
+#define TEST_BIT(bits, i) (((bits)[(i) >> 5] >> ((i) & 31)) & 1u)
+#define WRITE_BIT(bits, i, value) ((bits)[(i) >> 5] = ((bits)[(i) >> 5] & ~(1u << ((i) & 31))) \
+        | ((uint32_t)(value) << ((i) & 31)))
+
+// vectorised solver passes over the object arrays (kernels.c)
+void AddAccelerationKernel(float *acc, float amount, int count);
+void IntegrateKernel(float *x, float *y, float *oldX, float *oldY,
+        float *accX, float *accY, const uint32_t *frozen, int count, float dt);
+void ConstrainCircleKernel(float *x, float *y, const float *radius, int count,
+        Vector2 center, float constraintRadius);
+// the link arrays the link kernels read, lambda is also written
+typedef struct LinkArrays {
+    const int *object1;
+    const int *object2;
+    const float *distance;
+    const float *compliance;
+    const int *mode;
+    float *lambda;
+} LinkArrays;
+
+float GetInverseMass(float radius);
+void SolveLinksScalar(float *x, float *y, const float *radius, const uint32_t *frozen,
+        LinkArrays links, int start, int end, float alphaScale);
+void SolveLinksKernel(float *x, float *y, const float *radius, const uint32_t *frozen,
+        LinkArrays links, int start, int end, float alphaScale);
+void LinkCorrectionsKernel(const float *x, const float *y, const float *radius,
+        const uint32_t *frozen, LinkArrays links, float *correctionX, float *correctionY,
+        int start, int end, float alphaScale);
+void CollideCapsuleKernel(float *x, float *y, const float *radius, const uint32_t *frozen,
+        int start, int end, Vector2 a, Vector2 b, float capsuleRadius);
+void CollideBoxKernel(float *x, float *y, const float *radius, const uint32_t *frozen,
+        int start, int end, Vector2 center, Vector2 halfSize, Vector2 axis);
+// the force field grid the field kernel samples, four floats per node:
+// the acceleration, the drag rate and one unused
+typedef struct FieldGrid {
+    const float *nodes;
+    int width;
+    int height;
+    Vector2 origin;
+    float invCellSize;
+} FieldGrid;
+
+void ForceFieldKernel(const float *x, const float *y, const float *oldX, const float *oldY,
+        float *accX, float *accY, int start, int end, FieldGrid grid, Vector2 gravity, float invDt);
+float PressureKernel(const float *x, const float *y, float *accX, float *accY,
+        const float *radius, const uint32_t *frozen, const int *objects, int count, float scale);
+uint32_t OverlapBoundsKernel(const float *minX, const float *minY, const float *maxX,
+        const float *maxY, int count, float boxMinX, float boxMinY, float boxMaxX, float boxMaxY);
+
+// ---------------------------
+// Colliders
+// ---------------------------
+typedef enum ColliderType {
+    COLLIDER_CAPSULE = 0,
+    COLLIDER_BOX
+} ColliderType;
+
+typedef struct Collider {
+    ColliderType type;
+    // capsule: the segment from a to b, grown by radius (0 for segments)
+    // box: a is the centre, b the half size and axis the rotated x axis
+    Vector2 a;
+    Vector2 b;
+    float radius;
+    Vector2 axis;
+    Rectangle bounds;
+} Collider;
+
+// static level geometry, rotations in degrees
+void AddColliderSegment(Vector2 start, Vector2 end);
+void AddColliderCapsule(Vector2 start, Vector2 end, float radius);
+void AddColliderBox(Vector2 center, Vector2 size, float rotation);
+void ClearColliders(void);
+int GetNumColliders(void);
+bool LoadColliders(const char *path);
+// rebuilds the tree if the level changed, which ApplyColliders() otherwise
+// does on first use. Worlds stepped at once need it built beforehand
+void UpdateColliderTree(void);
+void ApplyColliders(float *x, float *y, const float *radius, const uint32_t *frozen, int count);
+// swept tests for objects that move further than their radius in a substep
+bool SweepDisc(Vector2 offset, Vector2 move, float reach, float *time);
+bool SweepColliders(Vector2 from, Vector2 move, float radius, float *time, Vector2 *normal);
+// bumped whenever the level changes
+unsigned int GetCollidersVersion(void);
+int CopyColliders(Collider **buffer, int *capacity);
+void DrawColliders(const Collider *shapes, int count, Color color);
+
+// ---------------------------
+// Physics thread
+// ---------------------------
+// A copy of what the renderer and the UI need from the solver, published
+// by the physics thread after every step it takes
+typedef struct PhysicsState {
+    // objects, and where the last step started them for interpolation
+    float *x;
+    float *y;
+    float *oldX;
+    float *oldY;
+    float *radius;
+    Color *colors;
+    int numObjects;
+    int objectCapacity;
+    int *link1;
+    int *link2;
+    int numLinks;
+    int linkCapacity;
+    // the objects binned by position into a coarse grid as the state is
+    // copied, so drawing only visits the cells in view. The links are kept
+    // in the order of the cell their midpoint is in. No cells if the
+    // grid couldn't be built, every object and link is visited then
+    int *cellStart;
+    int *cellObjects;
+    int *linkCellStart;
+    // each copied link's cell, kept between the two passes of the sort
+    int *linkCells;
+    int cellCapacity;
+    int gridWidth;
+    int gridHeight;
+    float gridCellSize;
+    Vector2 gridOrigin;
+    // how far outside its cell an object can be drawn, its radius plus
+    // how far it moves between the two positions drawn, and how far a link
+    // can reach, that plus half the longest link
+    float drawReach;
+    float linkReach;
+    Collider *colliders;
+    int numColliders;
+    int colliderCapacity;
+    unsigned int collidersVersion;
+
+    // when the state was published and the step length it was taken with
+    double time;
+    float stepTime;
+    int numSleeping;
+    int numThreads;
+    int substeps;
+    int iterations;
+    Vector2 gravity;
+    bool constraint;
+    bool paused;
+    bool recording;
+    int droppedFrames;
+    // bumped by every snapshot loaded, whose settings replace the UI's
+    unsigned int snapshotLoads;
+} PhysicsState;
+
+// everything the UI controls, sent whenever some of it changes
+typedef struct PhysicsSettings {
+    Vector2 gravity;
+    bool constraint;
+    bool attractor;
+    Vector2 attractorPos;
+    int numThreads;
+    LinkSolver linkSolver;
+    bool adaptive;
+    // steps of PHYSICS_SUBSTEPS substeps per second times PHYSICS_SUBSTEPS
+    int rate;
+} PhysicsSettings;
+
+typedef enum PhysicsCommandType {
+    COMMAND_SPAWN_OBJECT = 0,
+    COMMAND_SPAWN_ROPE,
+    COMMAND_SPAWN_CLOTH,
+    COMMAND_SPAWN_RING,
+    COMMAND_SPAWN_SQUARE,
+    // a Poisson disk volume of objects of the command's radius
+    COMMAND_SPAWN_VOLUME,
+    COMMAND_CLEAR,
+    // adds the command's field, or removes them all
+    COMMAND_ADD_FIELD,
+    COMMAND_CLEAR_FIELDS,
+    COMMAND_SETTINGS,
+    // rebuilds the level with build, or empties it if build is NULL
+    COMMAND_LEVEL,
+    COMMAND_SAVE_SNAPSHOT,
+    COMMAND_LOAD_SNAPSHOT,
+    COMMAND_START_RECORDING,
+    COMMAND_STOP_RECORDING,
+    // stop stepping, e.g. while a recording is replayed
+    COMMAND_PAUSE,
+    COMMAND_RESUME,
+    COMMAND_QUIT
+} PhysicsCommandType;
+
+typedef struct PhysicsCommand {
+    PhysicsCommandType type;
+    Vector2 pos;
+    float radius;
+    Color color;
+    PhysicsSettings settings;
+    ForceField field;
+    void (*build)(void);
+    // must stay valid until the command has run, e.g. a string literal
+    const char *path;
+} PhysicsCommand;
+
+// Runs the solver on its own thread if the platform allows it, otherwise
+// UpdatePhysics() steps it on the calling thread once per frame. False if
+// there is no memory for the world
+bool StartPhysics(void);
+void StopPhysics(void);
+bool IsPhysicsThreaded(void);
+void UpdatePhysics(void);
+// false if the queue is full, the command is dropped then
+bool PushPhysicsCommand(PhysicsCommand command);
+// the newest published state, valid until the next call
+const PhysicsState *AcquirePhysicsState(void);
+
+// fill in the solver's part of a state (verlet.c)
+void CopyVerletState(VerletWorld *world, PhysicsState *state);
+// draws what the camera sees, objects smaller than a pixel as density tiles
+void DrawVerletState(const PhysicsState *state, float alpha, Camera2D camera);
+
+// ---------------------------
+// Platform
+// ---------------------------
+// monotonic clock in seconds that works without a window
+double GetHighResTime(void);
+void SleepSeconds(double seconds);
+const void *MapFile(const char *path, size_t *size);
+void UnmapFile(const void *data, size_t size);
+
+// ---------------------------
+// Threads
+// ---------------------------
+typedef void (*TaskFunc)(int task, void *data);
+
+void SetNumThreads(int numThreads);
+int GetNumThreads(void);
+void RunTasks(TaskFunc func, int numTasks, void *data);
+// true on a thread running a task, RunTasks() runs nested tasks inline
+bool IsInsideTask(void);
+void ShutdownThreads(void);
+
+// ---------------------------
+// Profiler
+// ---------------------------
+typedef enum ProfileZone {
+    // the solver passes come first, in SolverPass order
+    ZONE_ACCELERATION = 0,
+    ZONE_CONSTRAINT,
+    ZONE_COLLIDERS,
+    ZONE_COLLISIONS,
+    ZONE_LINKS,
+    ZONE_POSITIONS,
+    ZONE_SLEEP,
+    ZONE_SORT,
+    ZONE_DRAW_VERLET,
+    ZONE_DRAW_UI,
+    // wall time between EndProfileFrame() calls
+    ZONE_FRAME,
+    NUM_PROFILE_ZONES
+} ProfileZone;
+
+typedef enum ProfileCounter {
+    COUNTER_PAIR_TESTS = 0,
+    COUNTER_CONTACTS,
+    COUNTER_LINKS_STRETCHED,
+    COUNTER_NEIGHBOUR_REBUILDS,
+    COUNTER_SWEPT_OBJECTS,
+    NUM_PROFILE_COUNTERS
+} ProfileCounter;
+
+double EndProfileZone(ProfileZone zone, double start);
+void AddProfileCount(ProfileCounter counter, int amount);
+void EndProfileFrame(void);
+double GetProfilePercentile(ProfileZone zone, float percentile);
+int GetProfileCount(ProfileCounter counter);
+const char *GetProfileZoneName(ProfileZone zone);
+const char *GetProfileCounterName(ProfileCounter counter);
+bool StartProfileTrace(void);
+bool IsProfileTracing(void);
+bool StopProfileTrace(const char *path);
+
+// ---------------------------
+// Recorder
+// ---------------------------
+bool StartRecording(const char *path, Rectangle bounds);
+bool StopRecording(void);
+bool IsRecording(void);
+int GetDroppedFrames(void);
+void RecordFrame(const float *x, const float *y, const float *radius, const Color *colors,
+        int count, float duration);
+bool StartReplay(const char *path);
+void StopReplay(void);
+bool IsReplaying(void);
+bool ReadReplayFrame(float *duration);
+int GetReplayObjects(const float **x, const float **y, const float **radius, const Color **colors);
+
+// ---------------------------
+// Render
+// ---------------------------
+void InitRenderer(void);
+void CloseRenderer(void);
+bool IsBatchRenderingSupported(void);
+bool DrawCirclesBatched(const float *x, const float *y, const float *oldX, const float *oldY,
+        float alpha, const float *radius, const Color *colors, int count);
+bool BeginLineBatch(int count);
+void AddLineToBatch(Vector2 start, Vector2 end, float thick);
+void EndLineBatch(Color color);
+bool BeginCircleBatch(int count);
+void AddCircleToBatch(Vector2 pos, float radius, Color color);
+void EndCircleBatch(void);
+bool BeginDensityTiles(Camera2D camera);
+void AddToDensityTiles(Vector2 pos, float radius, Color color);
+void EndDensityTiles(void);
 
 // ---------------------------
 // UI
@@ -37,13 +540,20 @@ typedef enum StructType {
     DEFAULT = 0,
     ROPE,
     CLOTH,
+    RING,
+    SQUARE,
     NUM_STRUCTURES
 } StructType;
 
 extern Vector2 g_mousePos;
+// the view of the world, and the mouse in world coordinates
+extern Camera2D g_camera;
+extern Vector2 g_mouseWorldPos;
 extern float g_spawnRadius;
 extern float g_spawnRate;
 extern float g_gravity;
+extern float g_numThreads;
+extern float g_physicsRate;
 extern bool g_buttonPressed0;
 // color control
 extern float g_red;
@@ -52,10 +562,24 @@ extern float g_blue;
 
 extern int g_structType;
 extern bool g_applyConstraint;
+extern bool g_batchRendering;
+extern bool g_jacobiLinks;
+extern bool g_adaptiveSteps;
+extern bool g_showProfiler;
+extern bool g_toggleTrace;
+extern bool g_showLevel;
+extern bool g_toggleLevel;
+extern bool g_spawnVolume;
+extern bool g_spawnVortex;
+extern bool g_clearFields;
+extern bool g_saveSnapshot;
+extern bool g_loadSnapshot;
+extern bool g_toggleRecording;
+extern bool g_toggleReplay;
 
 void InitUI(void);
 void UpdateUI(void);
-void DrawUI(void);
+void DrawUI(const PhysicsState *state);
 bool IsMouseOnUI(void);
 
 #endif // COMMON_H
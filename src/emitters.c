@@ -0,0 +1,148 @@
+// Emitters: ways of filling a region with objects in one bulk spawn.
+// EmitVerletGrid() places objects on a lattice, each position worked out
+// from its index in parallel. EmitVerletPoissonDisk() scatters them at
+// random without overlaps (Bridson's algorithm), which packs a volume
+// loosely enough that nothing starts out pushing its neighbours apart.
+#include <math.h>
+#include <stdlib.h>
+#include "raylib.h"
+#include "common.h"
+
+// candidates tried around a point before it stops taking new neighbours,
+// spread evenly around it just beyond the minimum distance
+#define POISSON_ATTEMPTS 16
+// background cells, a volume this large is refused rather than allocated
+#define POISSON_MAX_CELLS (1 << 24)
+
+typedef struct GridEmitter {
+    Vector2 origin;
+    int columns;
+    float spacing;
+    float radius;
+    Color color;
+} GridEmitter;
+
+static void GenerateGridObject(int index, void *data, VerletObjectDesc *object) {
+    const GridEmitter *grid = data;
+    object->pos = (Vector2){
+        grid->origin.x + (index % grid->columns)*grid->spacing,
+        grid->origin.y + (index/grid->columns)*grid->spacing
+    };
+    object->radius = grid->radius;
+    object->color = grid->color;
+}
+
+// objects spacing apart in rows and columns, all of each inside area
+int EmitVerletGrid(VerletWorld *world, Rectangle area, float spacing, float radius, Color color) {
+    if (!(spacing > 0) || radius < 0 || area.width < 2*radius || area.height < 2*radius) return 0;
+    double columns = floor((area.width - 2*radius)/spacing) + 1;
+    double rows = floor((area.height - 2*radius)/spacing) + 1;
+    if (columns*rows > INT32_MAX/2) return 0;
+    GridEmitter grid = {
+        { area.x + radius, area.y + radius }, (int)columns, spacing, radius, color
+    };
+    int count = (int)(columns*rows);
+    return GenerateVerletObjects(world, GenerateGridObject, &grid, count) >= 0? count: 0;
+}
+
+// xorshift32, seeded per call so the same seed always gives the same volume
+static unsigned int NextPoissonRandom(unsigned int *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static float PoissonRandom(unsigned int *state) {
+    return (float)(NextPoissonRandom(state) & 0xFFFFFF)/(float)0xFFFFFF;
+}
+
+// Objects of the given radius scattered over a disc, at least two radii
+// apart. The background grid has cells small enough to hold one object
+// each, so a candidate only has to be checked against the 5x5 cells
+// around it. Candidates sit on a circle just past the minimum distance
+// instead of anywhere in the ring out to twice it, which packs denser and
+// finds room in fewer attempts. Cells hold the object's position and empty
+// ones are infinitely far away, so the check reads one array and never
+// branches on a cell. The volume is built first, then spawned in one batch
+int EmitVerletPoissonDisk(VerletWorld *world, Vector2 center, float areaRadius, float radius,
+        Color color, unsigned int seed) {
+    if (!(radius > 0) || areaRadius < radius) return 0;
+    float minDistance = 2*radius;
+    float cellSize = minDistance/sqrtf(2);
+    // objects stay inside the disc, so their centres stay inside this one
+    float innerRadius = areaRadius - radius;
+    double side = ceil(2*innerRadius/cellSize) + 1;
+    if (side*side > POISSON_MAX_CELLS) return 0;
+    int cells = (int)side;
+    Vector2 origin = { center.x - innerRadius, center.y - innerRadius };
+
+    Vector2 *grid = malloc(sizeof(Vector2)*cells*cells);
+    Vector2 *points = malloc(sizeof(Vector2)*cells*cells);
+    int *active = malloc(sizeof(int)*cells*cells);
+    if (grid == NULL || points == NULL || active == NULL) {
+        free(grid);
+        free(points);
+        free(active);
+        return 0;
+    }
+    for (int c = 0; c < cells*cells; c++) grid[c] = (Vector2){ INFINITY, INFINITY };
+
+    unsigned int state = seed? seed: 1;
+    int numPoints = 1;
+    int numActive = 1;
+    points[0] = center;
+    active[0] = 0;
+    grid[(int)(innerRadius/cellSize)*cells + (int)(innerRadius/cellSize)] = center;
+    float stepCos = cosf(2*PI/POISSON_ATTEMPTS);
+    float stepSin = sinf(2*PI/POISSON_ATTEMPTS);
+    while (numActive > 0) {
+        int slot = (int)(NextPoissonRandom(&state) % (unsigned int)numActive);
+        Vector2 from = points[active[slot]];
+        float angle = 2*PI*PoissonRandom(&state);
+        float distance = minDistance*1.001f;
+        Vector2 offset = { distance*cosf(angle), distance*sinf(angle) };
+        bool placed = false;
+        for (int attempt = 0; attempt < POISSON_ATTEMPTS && !placed; attempt++) {
+            Vector2 p = { from.x + offset.x, from.y + offset.y };
+            offset = (Vector2){
+                offset.x*stepCos - offset.y*stepSin, offset.x*stepSin + offset.y*stepCos
+            };
+            float dx = p.x - center.x;
+            float dy = p.y - center.y;
+            if (dx*dx + dy*dy > innerRadius*innerRadius) continue;
+            int cx = (int)((p.x - origin.x)/cellSize);
+            int cy = (int)((p.y - origin.y)/cellSize);
+            if (cx < 0 || cy < 0 || cx >= cells || cy >= cells) continue;
+
+            bool clear = true;
+            for (int y = cy > 2? cy - 2: 0; y <= cy + 2 && y < cells && clear; y++) {
+                for (int x = cx > 2? cx - 2: 0; x <= cx + 2 && x < cells; x++) {
+                    Vector2 q = grid[y*cells + x];
+                    clear = clear && (p.x - q.x)*(p.x - q.x) + (p.y - q.y)*(p.y - q.y) >= minDistance*minDistance;
+                }
+            }
+            if (!clear) continue;
+            grid[cy*cells + cx] = p;
+            points[numPoints] = p;
+            active[numActive++] = numPoints++;
+            placed = true;
+        }
+        // a point with no room left around it is done
+        if (!placed) active[slot] = active[--numActive];
+    }
+    free(grid);
+    free(active);
+
+    VerletObjectDesc *objects = malloc(sizeof(VerletObjectDesc)*numPoints);
+    int spawned = 0;
+    if (objects != NULL) {
+        for (int i = 0; i < numPoints; i++) {
+            objects[i] = (VerletObjectDesc){ points[i], radius, color, false, true };
+        }
+        spawned = SpawnVerletObjects(world, objects, numPoints) >= 0? numPoints: 0;
+    }
+    free(objects);
+    free(points);
+    return spawned;
+}
@@ -0,0 +1,619 @@
+// Vectorised passes over the structure-of-arrays particle store. The AVX2
+// or SSE2 path is picked at compile time, and a scalar loop handles the
+// tail and any other target. Every path performs the same float operations
+// in the same order, so they produce identical results.
+#include "common.h"
+#include <math.h>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+void AddAccelerationKernel(float *acc, float amount, int count) {
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 a = _mm256_set1_ps(amount);
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), a));
+    }
+#elif defined(__SSE2__)
+    __m128 a = _mm_set1_ps(amount);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), a));
+    }
+#endif
+    for (; i < count; i++) {
+        acc[i] += amount;
+    }
+}
+
+void IntegrateKernel(float *x, float *y, float *oldX, float *oldY,
+        float *accX, float *accY, const uint32_t *frozen, int count, float dt) {
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 vdt = _mm256_set1_ps(dt);
+    __m256i lanes = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    for (; i + 8 <= count; i += 8) {
+        __m256i bits = _mm256_set1_epi32((frozen[i >> 5] >> (i & 31)) & 0xFF);
+        __m256 keep = _mm256_castsi256_ps(
+                _mm256_cmpeq_epi32(_mm256_and_si256(bits, lanes), lanes));
+
+        __m256 px = _mm256_loadu_ps(x + i);
+        __m256 py = _mm256_loadu_ps(y + i);
+        __m256 ox = _mm256_loadu_ps(oldX + i);
+        __m256 oy = _mm256_loadu_ps(oldY + i);
+        __m256 ax = _mm256_loadu_ps(accX + i);
+        __m256 ay = _mm256_loadu_ps(accY + i);
+        __m256 nx = _mm256_add_ps(_mm256_add_ps(px, _mm256_sub_ps(px, ox)),
+                _mm256_mul_ps(_mm256_mul_ps(ax, vdt), vdt));
+        __m256 ny = _mm256_add_ps(_mm256_add_ps(py, _mm256_sub_ps(py, oy)),
+                _mm256_mul_ps(_mm256_mul_ps(ay, vdt), vdt));
+
+        _mm256_storeu_ps(x + i, _mm256_blendv_ps(nx, px, keep));
+        _mm256_storeu_ps(y + i, _mm256_blendv_ps(ny, py, keep));
+        _mm256_storeu_ps(oldX + i, _mm256_blendv_ps(px, ox, keep));
+        _mm256_storeu_ps(oldY + i, _mm256_blendv_ps(py, oy, keep));
+        _mm256_storeu_ps(accX + i, _mm256_and_ps(ax, keep));
+        _mm256_storeu_ps(accY + i, _mm256_and_ps(ay, keep));
+    }
+#elif defined(__SSE2__)
+    __m128 vdt = _mm_set1_ps(dt);
+    __m128i lanes = _mm_set_epi32(8, 4, 2, 1);
+    for (; i + 4 <= count; i += 4) {
+        __m128i bits = _mm_set1_epi32((frozen[i >> 5] >> (i & 31)) & 0xF);
+        __m128 keep = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, lanes), lanes));
+
+        __m128 px = _mm_loadu_ps(x + i);
+        __m128 py = _mm_loadu_ps(y + i);
+        __m128 ox = _mm_loadu_ps(oldX + i);
+        __m128 oy = _mm_loadu_ps(oldY + i);
+        __m128 ax = _mm_loadu_ps(accX + i);
+        __m128 ay = _mm_loadu_ps(accY + i);
+        __m128 nx = _mm_add_ps(_mm_add_ps(px, _mm_sub_ps(px, ox)),
+                _mm_mul_ps(_mm_mul_ps(ax, vdt), vdt));
+        __m128 ny = _mm_add_ps(_mm_add_ps(py, _mm_sub_ps(py, oy)),
+                _mm_mul_ps(_mm_mul_ps(ay, vdt), vdt));
+
+        _mm_storeu_ps(x + i, _mm_or_ps(_mm_and_ps(keep, px), _mm_andnot_ps(keep, nx)));
+        _mm_storeu_ps(y + i, _mm_or_ps(_mm_and_ps(keep, py), _mm_andnot_ps(keep, ny)));
+        _mm_storeu_ps(oldX + i, _mm_or_ps(_mm_and_ps(keep, ox), _mm_andnot_ps(keep, px)));
+        _mm_storeu_ps(oldY + i, _mm_or_ps(_mm_and_ps(keep, oy), _mm_andnot_ps(keep, py)));
+        _mm_storeu_ps(accX + i, _mm_and_ps(ax, keep));
+        _mm_storeu_ps(accY + i, _mm_and_ps(ay, keep));
+    }
+#endif
+    for (; i < count; i++) {
+        if (TEST_BIT(frozen, i)) continue;
+        float displacementX = x[i] - oldX[i];
+        float displacementY = y[i] - oldY[i];
+        oldX[i] = x[i];
+        oldY[i] = y[i];
+        x[i] = x[i] + displacementX + accX[i]*dt*dt;
+        y[i] = y[i] + displacementY + accY[i]*dt*dt;
+        accX[i] = 0;
+        accY[i] = 0;
+    }
+}
+
+void ConstrainCircleKernel(float *x, float *y, const float *radius, int count,
+        Vector2 center, float constraintRadius) {
+    int i = 0;
+#if defined(__AVX2__)
+    __m256 cx = _mm256_set1_ps(center.x);
+    __m256 cy = _mm256_set1_ps(center.y);
+    __m256 cr = _mm256_set1_ps(constraintRadius);
+    for (; i + 8 <= count; i += 8) {
+        __m256 px = _mm256_loadu_ps(x + i);
+        __m256 py = _mm256_loadu_ps(y + i);
+        __m256 dx = _mm256_sub_ps(px, cx);
+        __m256 dy = _mm256_sub_ps(py, cy);
+        __m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+        __m256 limit = _mm256_sub_ps(cr, _mm256_loadu_ps(radius + i));
+        __m256 outside = _mm256_cmp_ps(dist, limit, _CMP_GT_OQ);
+        __m256 nx = _mm256_add_ps(cx, _mm256_mul_ps(_mm256_div_ps(dx, dist), limit));
+        __m256 ny = _mm256_add_ps(cy, _mm256_mul_ps(_mm256_div_ps(dy, dist), limit));
+        _mm256_storeu_ps(x + i, _mm256_blendv_ps(px, nx, outside));
+        _mm256_storeu_ps(y + i, _mm256_blendv_ps(py, ny, outside));
+    }
+#elif defined(__SSE2__)
+    __m128 cx = _mm_set1_ps(center.x);
+    __m128 cy = _mm_set1_ps(center.y);
+    __m128 cr = _mm_set1_ps(constraintRadius);
+    for (; i + 4 <= count; i += 4) {
+        __m128 px = _mm_loadu_ps(x + i);
+        __m128 py = _mm_loadu_ps(y + i);
+        __m128 dx = _mm_sub_ps(px, cx);
+        __m128 dy = _mm_sub_ps(py, cy);
+        __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+        __m128 limit = _mm_sub_ps(cr, _mm_loadu_ps(radius + i));
+        __m128 outside = _mm_cmpgt_ps(dist, limit);
+        __m128 nx = _mm_add_ps(cx, _mm_mul_ps(_mm_div_ps(dx, dist), limit));
+        __m128 ny = _mm_add_ps(cy, _mm_mul_ps(_mm_div_ps(dy, dist), limit));
+        _mm_storeu_ps(x + i, _mm_or_ps(_mm_and_ps(outside, nx), _mm_andnot_ps(outside, px)));
+        _mm_storeu_ps(y + i, _mm_or_ps(_mm_and_ps(outside, ny), _mm_andnot_ps(outside, py)));
+    }
+#endif
+    for (; i < count; i++) {
+        float dx = x[i] - center.x;
+        float dy = y[i] - center.y;
+        float dist = sqrtf(dx*dx + dy*dy);
+        float limit = constraintRadius - radius[i];
+        if (dist > limit) {
+            x[i] = center.x + dx/dist*limit;
+            y[i] = center.y + dy/dist*limit;
+        }
+    }
+}
+
+// Objects weigh as much as their area, so links move small objects more
+// than big ones. Radius 0 joints (cloth) weigh as much as radius 1
+float GetInverseMass(float radius) {
+    float r = fmaxf(radius, 1);
+    return 1/(r*r);
+}
+
+// XPBD distance links, Gauss-Seidel in link order. A link only acts in the
+// directions its mode allows, and moves each end by its inverse mass
+// (none if frozen). alphaScale is 1/dt^2 of the substep, turning the
+// compliance into XPBD's alpha, and lambda carries each link's multiplier
+// across the iterations of a substep. Compliance 0 is a rigid link
+void SolveLinksScalar(float *x, float *y, const float *radius, const uint32_t *frozen,
+        LinkArrays links, int start, int end, float alphaScale) {
+    for (int l = start; l < end; l++) {
+        int obj1 = links.object1[l];
+        int obj2 = links.object2[l];
+        float axisX = x[obj1] - x[obj2];
+        float axisY = y[obj1] - y[obj2];
+        float dist = sqrtf(axisX*axisX + axisY*axisY);
+        float delta = links.distance[l] - dist;
+        int mode = links.mode[l];
+        bool active = ((mode & LINK_TENSION) && delta < 0) || ((mode & LINK_COMPRESSION) && delta > 0);
+        float w1 = TEST_BIT(frozen, obj1)? 0: GetInverseMass(radius[obj1]);
+        float w2 = TEST_BIT(frozen, obj2)? 0: GetInverseMass(radius[obj2]);
+        float alpha = links.compliance[l]*alphaScale;
+        float weight = w1 + w2 + alpha;
+        if (!active || !(dist > 0) || !(weight > 0)) continue;
+
+        float dlambda = (delta - alpha*links.lambda[l])/weight;
+        links.lambda[l] += dlambda;
+        float px = dlambda*(axisX/dist);
+        float py = dlambda*(axisY/dist);
+        x[obj1] += w1*px;
+        y[obj1] += w1*py;
+        x[obj2] -= w2*px;
+        y[obj2] -= w2*py;
+    }
+}
+
+// Same as SolveLinksScalar, but the links in [start, end) must not share
+// any object so four of them can be gathered, solved and scattered at once
+void SolveLinksKernel(float *x, float *y, const float *radius, const uint32_t *frozen,
+        LinkArrays links, int start, int end, float alphaScale) {
+    int l = start;
+#if defined(__SSE2__)
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1);
+    __m128i tension = _mm_set1_epi32(LINK_TENSION);
+    __m128i compression = _mm_set1_epi32(LINK_COMPRESSION);
+    __m128 scale = _mm_set1_ps(alphaScale);
+    for (; l + 4 <= end; l += 4) {
+        const int *a = links.object1 + l;
+        const int *b = links.object2 + l;
+        __m128 dx = _mm_sub_ps(_mm_set_ps(x[a[3]], x[a[2]], x[a[1]], x[a[0]]),
+                _mm_set_ps(x[b[3]], x[b[2]], x[b[1]], x[b[0]]));
+        __m128 dy = _mm_sub_ps(_mm_set_ps(y[a[3]], y[a[2]], y[a[1]], y[a[0]]),
+                _mm_set_ps(y[b[3]], y[b[2]], y[b[1]], y[b[0]]));
+        __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+        __m128 delta = _mm_sub_ps(_mm_loadu_ps(links.distance + l), dist);
+        __m128i mode = _mm_loadu_si128((const __m128i *)(links.mode + l));
+        __m128 pulls = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(mode, tension), tension)),
+                _mm_cmplt_ps(delta, zero));
+        __m128 pushes = _mm_and_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(mode, compression), compression)),
+                _mm_cmpgt_ps(delta, zero));
+
+        // frozen ends weigh nothing
+        __m128 free1 = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_set_epi32(TEST_BIT(frozen, a[3]),
+                TEST_BIT(frozen, a[2]), TEST_BIT(frozen, a[1]), TEST_BIT(frozen, a[0])), _mm_setzero_si128()));
+        __m128 free2 = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_set_epi32(TEST_BIT(frozen, b[3]),
+                TEST_BIT(frozen, b[2]), TEST_BIT(frozen, b[1]), TEST_BIT(frozen, b[0])), _mm_setzero_si128()));
+        __m128 r1 = _mm_max_ps(_mm_set_ps(radius[a[3]], radius[a[2]], radius[a[1]], radius[a[0]]), one);
+        __m128 r2 = _mm_max_ps(_mm_set_ps(radius[b[3]], radius[b[2]], radius[b[1]], radius[b[0]]), one);
+        __m128 w1 = _mm_and_ps(free1, _mm_div_ps(one, _mm_mul_ps(r1, r1)));
+        __m128 w2 = _mm_and_ps(free2, _mm_div_ps(one, _mm_mul_ps(r2, r2)));
+        __m128 alpha = _mm_mul_ps(_mm_loadu_ps(links.compliance + l), scale);
+        __m128 weight = _mm_add_ps(_mm_add_ps(w1, w2), alpha);
+        __m128 active = _mm_and_ps(_mm_or_ps(pulls, pushes),
+                _mm_and_ps(_mm_cmpgt_ps(dist, zero), _mm_cmpgt_ps(weight, zero)));
+        if (_mm_movemask_ps(active) == 0) continue;
+
+        __m128 lambda = _mm_loadu_ps(links.lambda + l);
+        __m128 dlambda = _mm_and_ps(active,
+                _mm_div_ps(_mm_sub_ps(delta, _mm_mul_ps(alpha, lambda)), weight));
+        _mm_storeu_ps(links.lambda + l, _mm_add_ps(lambda, dlambda));
+        __m128 px = _mm_mul_ps(dlambda, _mm_div_ps(dx, dist));
+        __m128 py = _mm_mul_ps(dlambda, _mm_div_ps(dy, dist));
+        float cx1[4];
+        float cy1[4];
+        float cx2[4];
+        float cy2[4];
+        _mm_storeu_ps(cx1, _mm_mul_ps(w1, px));
+        _mm_storeu_ps(cy1, _mm_mul_ps(w1, py));
+        _mm_storeu_ps(cx2, _mm_mul_ps(w2, px));
+        _mm_storeu_ps(cy2, _mm_mul_ps(w2, py));
+        // inactive lanes are skipped like the scalar path does
+        int mask = _mm_movemask_ps(active);
+        for (int k = 0; k < 4; k++) {
+            if (!(mask & (1 << k))) continue;
+            x[a[k]] += cx1[k];
+            y[a[k]] += cy1[k];
+            x[b[k]] -= cx2[k];
+            y[b[k]] -= cy2[k];
+        }
+    }
+#endif
+    SolveLinksScalar(x, y, radius, frozen, links, l, end, alphaScale);
+}
+
+// Jacobi step: the same multiplier update as SolveLinksScalar, but every
+// link reads the same positions. The correction along the link is stored
+// unweighted, each end moves by it times its inverse mass (the second
+// end the opposite way). Zero for links that don't act
+void LinkCorrectionsKernel(const float *x, const float *y, const float *radius,
+        const uint32_t *frozen, LinkArrays links, float *correctionX, float *correctionY,
+        int start, int end, float alphaScale) {
+    for (int l = start; l < end; l++) {
+        int obj1 = links.object1[l];
+        int obj2 = links.object2[l];
+        float axisX = x[obj1] - x[obj2];
+        float axisY = y[obj1] - y[obj2];
+        float dist = sqrtf(axisX*axisX + axisY*axisY);
+        float delta = links.distance[l] - dist;
+        int mode = links.mode[l];
+        bool active = ((mode & LINK_TENSION) && delta < 0) || ((mode & LINK_COMPRESSION) && delta > 0);
+        float w1 = TEST_BIT(frozen, obj1)? 0: GetInverseMass(radius[obj1]);
+        float w2 = TEST_BIT(frozen, obj2)? 0: GetInverseMass(radius[obj2]);
+        float alpha = links.compliance[l]*alphaScale;
+        float weight = w1 + w2 + alpha;
+        correctionX[l] = 0;
+        correctionY[l] = 0;
+        if (!active || !(dist > 0) || !(weight > 0)) continue;
+
+        float dlambda = (delta - alpha*links.lambda[l])/weight;
+        links.lambda[l] += dlambda;
+        correctionX[l] = dlambda*(axisX/dist);
+        correctionY[l] = dlambda*(axisY/dist);
+    }
+}
+
+// One vertex of PressureKernel, k is its place in the loop
+static float PressureVertex(const float *x, const float *y, float *accX, float *accY,
+        const float *radius, const uint32_t *frozen, const int *objects, int count,
+        int k, float scale) {
+    int i = objects[k];
+    int prev = objects[k > 0? k - 1: count - 1];
+    int next = objects[k < count - 1? k + 1: 0];
+    float dx = x[next] - x[prev];
+    float dy = y[next] - y[prev];
+    float w = TEST_BIT(frozen, i)? 0: GetInverseMass(radius[i]);
+    accX[i] += w*(scale*dy);
+    accY[i] -= w*(scale*dx);
+    return x[i]*dy;
+}
+
+// Pressure on a closed loop of count objects, listed in order around it.
+// Half of each edge's normal force goes to either end, which for a vertex
+// is the normal of the chord from its previous to its next neighbour:
+// acceleration += w*scale*(dy, -dx). Scale is half the pressure, signed
+// by which way round the loop goes. Returns twice the signed area from
+// the shoelace formula in the same pass, x[i]*(y[next] - y[prev]) summed
+// in loop order on every path
+float PressureKernel(const float *x, const float *y, float *accX, float *accY,
+        const float *radius, const uint32_t *frozen, const int *objects, int count, float scale) {
+    if (count < 3) return 0;
+    float area = PressureVertex(x, y, accX, accY, radius, frozen, objects, count, 0, scale);
+    int k = 1;
+#if defined(__SSE2__)
+    // the first and last vertex wrap around, the ones between read their
+    // neighbours from the list as it is
+    __m128 one = _mm_set1_ps(1);
+    __m128 vscale = _mm_set1_ps(scale);
+    for (; k + 4 <= count - 1; k += 4) {
+        const int *o = objects + k;
+        const int *p = objects + k - 1;
+        const int *n = objects + k + 1;
+        __m128 dx = _mm_sub_ps(_mm_set_ps(x[n[3]], x[n[2]], x[n[1]], x[n[0]]),
+                _mm_set_ps(x[p[3]], x[p[2]], x[p[1]], x[p[0]]));
+        __m128 dy = _mm_sub_ps(_mm_set_ps(y[n[3]], y[n[2]], y[n[1]], y[n[0]]),
+                _mm_set_ps(y[p[3]], y[p[2]], y[p[1]], y[p[0]]));
+        __m128 unfrozen = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_set_epi32(TEST_BIT(frozen, o[3]),
+                TEST_BIT(frozen, o[2]), TEST_BIT(frozen, o[1]), TEST_BIT(frozen, o[0])), _mm_setzero_si128()));
+        __m128 r = _mm_max_ps(_mm_set_ps(radius[o[3]], radius[o[2]], radius[o[1]], radius[o[0]]), one);
+        __m128 w = _mm_and_ps(unfrozen, _mm_div_ps(one, _mm_mul_ps(r, r)));
+        float ax[4];
+        float ay[4];
+        float terms[4];
+        _mm_storeu_ps(ax, _mm_mul_ps(w, _mm_mul_ps(vscale, dy)));
+        _mm_storeu_ps(ay, _mm_mul_ps(w, _mm_mul_ps(vscale, dx)));
+        _mm_storeu_ps(terms, _mm_mul_ps(_mm_set_ps(x[o[3]], x[o[2]], x[o[1]], x[o[0]]), dy));
+        for (int j = 0; j < 4; j++) {
+            accX[o[j]] += ax[j];
+            accY[o[j]] -= ay[j];
+            area += terms[j];
+        }
+    }
+#endif
+    for (; k < count; k++) {
+        area += PressureVertex(x, y, accX, accY, radius, frozen, objects, count, k, scale);
+    }
+    return area;
+}
+
+// The field at one lane's four nodes, n its lower left node, weighted
+// and summed in the same order as the scalar path
+#if defined(__SSE2__)
+#define SAMPLE_FIELD_LANE(nodes, n, width, w00, w10, w01, w11, lane) \
+    _mm_add_ps(_mm_add_ps(_mm_add_ps( \
+        _mm_mul_ps(_mm_shuffle_ps(w00, w00, _MM_SHUFFLE(lane, lane, lane, lane)), \
+            _mm_loadu_ps((nodes) + 4*(n))), \
+        _mm_mul_ps(_mm_shuffle_ps(w10, w10, _MM_SHUFFLE(lane, lane, lane, lane)), \
+            _mm_loadu_ps((nodes) + 4*((n) + 1)))), \
+        _mm_mul_ps(_mm_shuffle_ps(w01, w01, _MM_SHUFFLE(lane, lane, lane, lane)), \
+            _mm_loadu_ps((nodes) + 4*((n) + (width))))), \
+        _mm_mul_ps(_mm_shuffle_ps(w11, w11, _MM_SHUFFLE(lane, lane, lane, lane)), \
+            _mm_loadu_ps((nodes) + 4*((n) + (width) + 1))))
+#endif
+
+// Gravity plus the field grid sampled bilinearly at each object in
+// [start, end): acc += gravity + field - drag*(x - old)*invDt. Positions
+// are clamped to the grid, whose border nodes are empty, and a NaN
+// position samples the first node. The grid needs at least 2x2 nodes
+void ForceFieldKernel(const float *x, const float *y, const float *oldX, const float *oldY,
+        float *accX, float *accY, int start, int end, FieldGrid grid, Vector2 gravity, float invDt) {
+    float maxX = (float)(grid.width - 1);
+    float maxY = (float)(grid.height - 1);
+    float lastX = (float)(grid.width - 2);
+    float lastY = (float)(grid.height - 2);
+    int i = start;
+#if defined(__SSE2__)
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1);
+    __m128 ox = _mm_set1_ps(grid.origin.x);
+    __m128 oy = _mm_set1_ps(grid.origin.y);
+    __m128 inv = _mm_set1_ps(grid.invCellSize);
+    __m128 gravityX = _mm_set1_ps(gravity.x);
+    __m128 gravityY = _mm_set1_ps(gravity.y);
+    __m128 vdt = _mm_set1_ps(invDt);
+    __m128 width = _mm_set1_ps((float)grid.width);
+    for (; i + 4 <= end; i += 4) {
+        __m128 px = _mm_loadu_ps(x + i);
+        __m128 py = _mm_loadu_ps(y + i);
+        // max(v, 0) gives 0 for a NaN v, like fmaxf
+        __m128 gx = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(px, ox), inv), zero), _mm_set1_ps(maxX));
+        __m128 gy = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(py, oy), inv), zero), _mm_set1_ps(maxY));
+        __m128 cx = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(gx)), _mm_set1_ps(lastX));
+        __m128 cy = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(gy)), _mm_set1_ps(lastY));
+        __m128 fx = _mm_sub_ps(gx, cx);
+        __m128 fy = _mm_sub_ps(gy, cy);
+        __m128 w00 = _mm_mul_ps(_mm_sub_ps(one, fx), _mm_sub_ps(one, fy));
+        __m128 w10 = _mm_mul_ps(fx, _mm_sub_ps(one, fy));
+        __m128 w01 = _mm_mul_ps(_mm_sub_ps(one, fx), fy);
+        __m128 w11 = _mm_mul_ps(fx, fy);
+        // node indices stay far below 2^24, so float gets them exactly
+        int n[4];
+        _mm_storeu_si128((__m128i *)n, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(cy, width), cx)));
+
+        // a node is its acceleration and drag, so a lane's sample comes out
+        // as a row and the transpose turns the rows into ax, ay and drag
+        __m128 ax = SAMPLE_FIELD_LANE(grid.nodes, n[0], grid.width, w00, w10, w01, w11, 0);
+        __m128 ay = SAMPLE_FIELD_LANE(grid.nodes, n[1], grid.width, w00, w10, w01, w11, 1);
+        __m128 drag = SAMPLE_FIELD_LANE(grid.nodes, n[2], grid.width, w00, w10, w01, w11, 2);
+        __m128 unused = SAMPLE_FIELD_LANE(grid.nodes, n[3], grid.width, w00, w10, w01, w11, 3);
+        _MM_TRANSPOSE4_PS(ax, ay, drag, unused);
+        __m128 vx = _mm_mul_ps(_mm_sub_ps(px, _mm_loadu_ps(oldX + i)), vdt);
+        __m128 vy = _mm_mul_ps(_mm_sub_ps(py, _mm_loadu_ps(oldY + i)), vdt);
+        _mm_storeu_ps(accX + i, _mm_add_ps(_mm_loadu_ps(accX + i),
+                _mm_sub_ps(_mm_add_ps(gravityX, ax), _mm_mul_ps(drag, vx))));
+        _mm_storeu_ps(accY + i, _mm_add_ps(_mm_loadu_ps(accY + i),
+                _mm_sub_ps(_mm_add_ps(gravityY, ay), _mm_mul_ps(drag, vy))));
+    }
+#endif
+    for (; i < end; i++) {
+        float gx = fminf(fmaxf((x[i] - grid.origin.x)*grid.invCellSize, 0), maxX);
+        float gy = fminf(fmaxf((y[i] - grid.origin.y)*grid.invCellSize, 0), maxY);
+        float cx = fminf((float)(int)gx, lastX);
+        float cy = fminf((float)(int)gy, lastY);
+        float fx = gx - cx;
+        float fy = gy - cy;
+        float w00 = (1 - fx)*(1 - fy);
+        float w10 = fx*(1 - fy);
+        float w01 = (1 - fx)*fy;
+        float w11 = fx*fy;
+        const float *n00 = grid.nodes + 4*((int)cy*grid.width + (int)cx);
+        const float *n10 = n00 + 4;
+        const float *n01 = n00 + 4*grid.width;
+        const float *n11 = n01 + 4;
+        float ax = w00*n00[0] + w10*n10[0] + w01*n01[0] + w11*n11[0];
+        float ay = w00*n00[1] + w10*n10[1] + w01*n01[1] + w11*n11[1];
+        float drag = w00*n00[2] + w10*n10[2] + w01*n01[2] + w11*n11[2];
+        float vx = (x[i] - oldX[i])*invDt;
+        float vy = (y[i] - oldY[i])*invDt;
+        accX[i] += gravity.x + ax - drag*vx;
+        accY[i] += gravity.y + ay - drag*vy;
+    }
+}
+
+// Push the objects in [start, end) out of a capsule, the segment a-b grown
+// by capsuleRadius. Objects centred on the segment leave along its normal.
+// The SSE2 path reads the frozen bits four at a time, so start must be a
+// multiple of 4
+void CollideCapsuleKernel(float *x, float *y, const float *radius, const uint32_t *frozen,
+        int start, int end, Vector2 a, Vector2 b, float capsuleRadius) {
+    float dx = b.x - a.x;
+    float dy = b.y - a.y;
+    float length2 = dx*dx + dy*dy;
+    float invLength2 = length2 > 0? 1/length2: 0;
+    float length = sqrtf(length2);
+    Vector2 normal = length > 0? (Vector2){ -dy/length, dx/length }: (Vector2){ 0, -1 };
+    int i = start;
+#if defined(__SSE2__)
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1);
+    __m128 ax = _mm_set1_ps(a.x);
+    __m128 ay = _mm_set1_ps(a.y);
+    __m128 sx = _mm_set1_ps(dx);
+    __m128 sy = _mm_set1_ps(dy);
+    __m128 inv = _mm_set1_ps(invLength2);
+    __m128 nx0 = _mm_set1_ps(normal.x);
+    __m128 ny0 = _mm_set1_ps(normal.y);
+    __m128 cr = _mm_set1_ps(capsuleRadius);
+    __m128i lanes = _mm_set_epi32(8, 4, 2, 1);
+    for (; i + 4 <= end; i += 4) {
+        __m128i bits = _mm_set1_epi32((frozen[i >> 5] >> (i & 31)) & 0xF);
+        __m128 moving = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, lanes), _mm_setzero_si128()));
+
+        __m128 px = _mm_sub_ps(_mm_loadu_ps(x + i), ax);
+        __m128 py = _mm_sub_ps(_mm_loadu_ps(y + i), ay);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(px, sx), _mm_mul_ps(py, sy)), inv);
+        t = _mm_min_ps(_mm_max_ps(t, zero), one);
+        __m128 cx = _mm_sub_ps(px, _mm_mul_ps(t, sx));
+        __m128 cy = _mm_sub_ps(py, _mm_mul_ps(t, sy));
+        __m128 dist2 = _mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy));
+        __m128 reach = _mm_add_ps(_mm_loadu_ps(radius + i), cr);
+        __m128 hit = _mm_and_ps(_mm_cmplt_ps(dist2, _mm_mul_ps(reach, reach)), moving);
+        if (_mm_movemask_ps(hit) == 0) continue;
+
+        __m128 dist = _mm_sqrt_ps(dist2);
+        __m128 apart = _mm_cmpgt_ps(dist, zero);
+        __m128 nx = _mm_or_ps(_mm_and_ps(apart, _mm_div_ps(cx, dist)), _mm_andnot_ps(apart, nx0));
+        __m128 ny = _mm_or_ps(_mm_and_ps(apart, _mm_div_ps(cy, dist)), _mm_andnot_ps(apart, ny0));
+        __m128 depth = _mm_and_ps(hit, _mm_sub_ps(reach, dist));
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_and_ps(hit, _mm_mul_ps(nx, depth))));
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_and_ps(hit, _mm_mul_ps(ny, depth))));
+    }
+#endif
+    for (; i < end; i++) {
+        float px = x[i] - a.x;
+        float py = y[i] - a.y;
+        float t = (px*dx + py*dy)*invLength2;
+        t = fminf(fmaxf(t, 0), 1);
+        float cx = px - t*dx;
+        float cy = py - t*dy;
+        float dist2 = cx*cx + cy*cy;
+        float reach = radius[i] + capsuleRadius;
+        if (!(dist2 < reach*reach) || TEST_BIT(frozen, i)) continue;
+        float dist = sqrtf(dist2);
+        float nx = dist > 0? cx/dist: normal.x;
+        float ny = dist > 0? cy/dist: normal.y;
+        x[i] += nx*(reach - dist);
+        y[i] += ny*(reach - dist);
+    }
+}
+
+// Push the objects in [start, end) out of a box around center, rotated so
+// its x axis points along axis (a unit vector). Objects centred inside the
+// box leave through the nearest face. Same alignment rule as above
+void CollideBoxKernel(float *x, float *y, const float *radius, const uint32_t *frozen,
+        int start, int end, Vector2 center, Vector2 halfSize, Vector2 axis) {
+    int i = start;
+#if defined(__SSE2__)
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 cx = _mm_set1_ps(center.x);
+    __m128 cy = _mm_set1_ps(center.y);
+    __m128 hx = _mm_set1_ps(halfSize.x);
+    __m128 hy = _mm_set1_ps(halfSize.y);
+    __m128 c = _mm_set1_ps(axis.x);
+    __m128 s = _mm_set1_ps(axis.y);
+    __m128i lanes = _mm_set_epi32(8, 4, 2, 1);
+    for (; i + 4 <= end; i += 4) {
+        __m128i bits = _mm_set1_epi32((frozen[i >> 5] >> (i & 31)) & 0xF);
+        __m128 moving = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, lanes), _mm_setzero_si128()));
+
+        __m128 px = _mm_sub_ps(_mm_loadu_ps(x + i), cx);
+        __m128 py = _mm_sub_ps(_mm_loadu_ps(y + i), cy);
+        __m128 lx = _mm_add_ps(_mm_mul_ps(px, c), _mm_mul_ps(py, s));
+        __m128 ly = _mm_sub_ps(_mm_mul_ps(py, c), _mm_mul_ps(px, s));
+        __m128 qx = _mm_min_ps(_mm_max_ps(lx, _mm_xor_ps(hx, sign)), hx);
+        __m128 qy = _mm_min_ps(_mm_max_ps(ly, _mm_xor_ps(hy, sign)), hy);
+        __m128 dx = _mm_sub_ps(lx, qx);
+        __m128 dy = _mm_sub_ps(ly, qy);
+        __m128 dist2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 r = _mm_loadu_ps(radius + i);
+        __m128 hit = _mm_and_ps(_mm_cmplt_ps(dist2, _mm_mul_ps(r, r)), moving);
+        if (_mm_movemask_ps(hit) == 0) continue;
+
+        // outside: away from the nearest point on the box
+        __m128 dist = _mm_sqrt_ps(dist2);
+        __m128 scale = _mm_div_ps(_mm_sub_ps(r, dist), dist);
+        __m128 outX = _mm_mul_ps(dx, scale);
+        __m128 outY = _mm_mul_ps(dy, scale);
+        // inside: out through the nearest face
+        __m128 depthX = _mm_sub_ps(hx, _mm_andnot_ps(sign, lx));
+        __m128 depthY = _mm_sub_ps(hy, _mm_andnot_ps(sign, ly));
+        __m128 alongX = _mm_cmplt_ps(depthX, depthY);
+        __m128 inX = _mm_and_ps(alongX, _mm_or_ps(_mm_add_ps(depthX, r), _mm_and_ps(sign, lx)));
+        __m128 inY = _mm_andnot_ps(alongX, _mm_or_ps(_mm_add_ps(depthY, r), _mm_and_ps(sign, ly)));
+        __m128 outside = _mm_cmpgt_ps(dist2, zero);
+        __m128 pushX = _mm_and_ps(hit, _mm_or_ps(_mm_and_ps(outside, outX), _mm_andnot_ps(outside, inX)));
+        __m128 pushY = _mm_and_ps(hit, _mm_or_ps(_mm_and_ps(outside, outY), _mm_andnot_ps(outside, inY)));
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i),
+                _mm_sub_ps(_mm_mul_ps(pushX, c), _mm_mul_ps(pushY, s))));
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i),
+                _mm_add_ps(_mm_mul_ps(pushX, s), _mm_mul_ps(pushY, c))));
+    }
+#endif
+    for (; i < end; i++) {
+        float px = x[i] - center.x;
+        float py = y[i] - center.y;
+        float lx = px*axis.x + py*axis.y;
+        float ly = py*axis.x - px*axis.y;
+        float dx = lx - fminf(fmaxf(lx, -halfSize.x), halfSize.x);
+        float dy = ly - fminf(fmaxf(ly, -halfSize.y), halfSize.y);
+        float dist2 = dx*dx + dy*dy;
+        float r = radius[i];
+        if (!(dist2 < r*r) || TEST_BIT(frozen, i)) continue;
+        float pushX = 0;
+        float pushY = 0;
+        if (dist2 > 0) {
+            float dist = sqrtf(dist2);
+            float scale = (r - dist)/dist;
+            pushX = dx*scale;
+            pushY = dy*scale;
+        }
+        else {
+            float depthX = halfSize.x - fabsf(lx);
+            float depthY = halfSize.y - fabsf(ly);
+            if (depthX < depthY) pushX = copysignf(depthX + r, lx);
+            else pushY = copysignf(depthY + r, ly);
+        }
+        x[i] += pushX*axis.x - pushY*axis.y;
+        y[i] += pushX*axis.y + pushY*axis.x;
+    }
+}
+
+// Bit k is set when the bounds of object k overlap the box, for up to 32
+// objects. Used to cull collider queries, see colliders.c
+uint32_t OverlapBoundsKernel(const float *minX, const float *minY, const float *maxX,
+        const float *maxY, int count, float boxMinX, float boxMinY, float boxMaxX, float boxMaxY) {
+    uint32_t mask = 0;
+    int k = 0;
+#if defined(__SSE2__)
+    __m128 bx0 = _mm_set1_ps(boxMinX);
+    __m128 by0 = _mm_set1_ps(boxMinY);
+    __m128 bx1 = _mm_set1_ps(boxMaxX);
+    __m128 by1 = _mm_set1_ps(boxMaxY);
+    for (; k + 4 <= count; k += 4) {
+        __m128 inX = _mm_and_ps(_mm_cmple_ps(bx0, _mm_loadu_ps(maxX + k)), _mm_cmpge_ps(bx1, _mm_loadu_ps(minX + k)));
+        __m128 inY = _mm_and_ps(_mm_cmple_ps(by0, _mm_loadu_ps(maxY + k)), _mm_cmpge_ps(by1, _mm_loadu_ps(minY + k)));
+        mask |= (uint32_t)_mm_movemask_ps(_mm_and_ps(inX, inY)) << k;
+    }
+#endif
+    for (; k < count; k++) {
+        if (boxMinX <= maxX[k] && boxMaxX >= minX[k] && boxMinY <= maxY[k] && boxMaxY >= minY[k]) {
+            mask |= 1u << k;
+        }
+    }
+    return mask;
+}
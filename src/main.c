@@ -1,3 +1,4 @@
+#include <string.h>
 #include "raylib.h"
 #include "raymath.h"
 #include "common.h"
@@ -6,22 +7,70 @@
     #include <emscripten/emscripten.h>
 #endif
 
+#define SNAPSHOT_PATH "verlet.snap"
+#define RECORDING_PATH "verlet.rec"
+#define TRACE_PATH "verlet.trace.json"
+
 static int framesCounter = 0;
+// recorded time not yet shown, replay reads frames until it is used up
+static float replayClock = 0;
+// F7 waits for the solver to pause and close the recording it replays
+static bool replayPending = false;
+static bool physicsPaused = false;
+// settings are only sent when they differ from the last ones sent
+static PhysicsSettings sentSettings;
+static unsigned int snapshotLoads = 0;
 
 // function prototype
 static void UpdateDrawFrame(void);
 
-int main(void) {
+// ramps above a board of pegs that drops into bins, inside the constraint.
+// Runs on the physics thread
+static void BuildDemoLevel(void) {
+    ClearColliders();
+    AddColliderBox((Vector2){ 500, 200 }, (Vector2){ 260, 14 }, 20);
+    AddColliderBox((Vector2){ 780, 200 }, (Vector2){ 260, 14 }, -20);
+    for (int row = 0; row < 8; row++) {
+        float y = 320 + row*36.0f;
+        for (float x = 640 - 300 + (row % 2)*20; x <= 640 + 300; x += 40) {
+            AddColliderCapsule((Vector2){ x, y }, (Vector2){ x, y }, 5);
+        }
+    }
+    for (float x = 400; x <= 880; x += 60) {
+        AddColliderCapsule((Vector2){ x, 640 }, (Vector2){ x, 820 }, 3);
+    }
+    AddColliderSegment((Vector2){ 380, 820 }, (Vector2){ 900, 820 });
+}
+
+// usage: Verlet [--replay recording] [--level file]
+int main(int argc, char **argv) {
     SetConfigFlags(FLAG_MSAA_4X_HINT);
 
     InitWindow(g_screenWidth, g_screenHeight, "Verlet Integration Test");
     // load textures / initialize variables
     InitUI();
+    InitRenderer();
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (TextIsEqual(argv[i], "--replay") && !StartReplay(argv[i + 1])) {
+            TraceLog(LOG_WARNING, "Could not replay %s", argv[i + 1]);
+        }
+        if (TextIsEqual(argv[i], "--level")) {
+            if (LoadColliders(argv[i + 1])) g_showLevel = true;
+            else TraceLog(LOG_WARNING, "Could not load level %s", argv[i + 1]);
+        }
+    }
+    // from here on the solver belongs to the physics thread
+    if (!StartPhysics()) {
+        TraceLog(LOG_ERROR, "Could not create the physics world");
+        CloseRenderer();
+        CloseWindow();
+        return 1;
+    }
 
 #if defined(PLATFORM_WEB)
     emscripten_set_main_loop(UpdateDrawFrame, 60, 1);
 #else
-    SetTargetFPS(60);
+    SetTargetFPS(TARGET_FPS);
 
     // Main game loop
     while (!WindowShouldClose())    // Detect window close button or ESC key
@@ -31,12 +80,160 @@ int main(void) {
 #endif
 
     // De-Initialization
+    StopPhysics();
+    if (IsProfileTracing()) {
+        StopProfileTrace(TRACE_PATH);
+    }
+    StopRecording();
+    StopReplay();
+    ShutdownThreads();
+    CloseRenderer();
     CloseWindow();
     return 0;
 }
 
+// advance the replay by the frame time and draw the frame it lands on,
+// the solver is left untouched
+static void UpdateReplay(void) {
+    replayClock += GetFrameTime();
+    while (replayClock > 0) {
+        float duration;
+        if (!ReadReplayFrame(&duration)) {
+            TraceLog(LOG_WARNING, "Replay stopped, recording is corrupt");
+            StopReplay();
+            return;
+        }
+        // a frame without duration would spin forever
+        replayClock -= duration > 0? duration: 1.0f/TARGET_FPS;
+    }
+}
+
+static void DrawReplay(void) {
+    const float *x;
+    const float *y;
+    const float *radius;
+    const Color *colors;
+    int count = GetReplayObjects(&x, &y, &radius, &colors);
+    if (g_batchRendering && DrawCirclesBatched(x, y, x, y, 1.0f, radius, colors, count)) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        DrawCircleV((Vector2){ x[i], y[i] }, radius[i], colors[i]);
+    }
+}
+
+// draw the UI, timed for the profiler
+static void DrawProfiledUI(const PhysicsState *state) {
+    double t = GetHighResTime();
+    DrawUI(state);
+    EndProfileZone(ZONE_DRAW_UI, t);
+}
+
+static PhysicsCommand MakeCommand(PhysicsCommandType type) {
+    PhysicsCommand command = { 0 };
+    command.type = type;
+    return command;
+}
+
+// queue a command for the solver, false if the queue is full
+static bool SendCommand(PhysicsCommand command) {
+    if (PushPhysicsCommand(command)) return true;
+    TraceLog(LOG_WARNING, "Physics command queue is full");
+    return false;
+}
+
+static bool SendPathCommand(PhysicsCommandType type, const char *path) {
+    PhysicsCommand command = MakeCommand(type);
+    command.path = path;
+    return SendCommand(command);
+}
+
+static bool SendSpawnCommand(PhysicsCommandType type, Vector2 pos, float radius, Color color) {
+    PhysicsCommand command = MakeCommand(type);
+    command.pos = pos;
+    command.radius = radius;
+    command.color = color;
+    return SendCommand(command);
+}
+
+// send the UI's settings if they changed, they are zeroed first so that
+// they compare as memory
+static void SendSettings(void) {
+    PhysicsSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.gravity = (Vector2){ 0, (int)(g_gravity/100)*100 };
+    settings.constraint = g_applyConstraint;
+    settings.attractor = IsMouseButtonDown(MOUSE_BUTTON_RIGHT) && !IsMouseOnUI();
+    settings.attractorPos = g_mouseWorldPos;
+    settings.numThreads = (int)g_numThreads;
+    settings.linkSolver = g_jacobiLinks? LINK_SOLVER_JACOBI: LINK_SOLVER_GAUSS_SEIDEL;
+    settings.adaptive = g_adaptiveSteps;
+    settings.rate = (int)g_physicsRate;
+    if (memcmp(&settings, &sentSettings, sizeof(settings)) == 0) return;
+    PhysicsCommand command = MakeCommand(COMMAND_SETTINGS);
+    command.settings = settings;
+    if (SendCommand(command)) sentSettings = settings;
+}
+
 static void UpdateDrawFrame() {
+    EndProfileFrame();
+    const PhysicsState *state = AcquirePhysicsState();
     // Update
+    if (g_toggleTrace) {
+        if (!IsProfileTracing()) {
+            if (!StartProfileTrace()) {
+                TraceLog(LOG_WARNING, "Could not start a profile trace");
+            }
+        }
+        else if (StopProfileTrace(TRACE_PATH)) {
+            TraceLog(LOG_INFO, "Saved profile trace to %s", TRACE_PATH);
+        }
+        else {
+            TraceLog(LOG_WARNING, "Could not save profile trace to %s", TRACE_PATH);
+        }
+        g_toggleTrace = false;
+    }
+    if (g_toggleRecording && SendPathCommand(state->recording?
+            COMMAND_STOP_RECORDING: COMMAND_START_RECORDING, RECORDING_PATH)) {
+        g_toggleRecording = false;
+    }
+    if (g_toggleReplay) {
+        if (IsReplaying()) {
+            StopReplay();
+            g_toggleReplay = false;
+        }
+        // don't replay a recording that is still being written
+        else if (SendPathCommand(COMMAND_STOP_RECORDING, RECORDING_PATH)) {
+            replayPending = true;
+            g_toggleReplay = false;
+        }
+    }
+    // the solver stands still while a recording is replayed
+    bool pause = IsReplaying() || replayPending;
+    if (pause != physicsPaused && SendCommand(MakeCommand(pause? COMMAND_PAUSE: COMMAND_RESUME))) {
+        physicsPaused = pause;
+    }
+    if (replayPending && state->paused && !state->recording) {
+        replayPending = false;
+        replayClock = 0;
+        if (!StartReplay(RECORDING_PATH)) {
+            TraceLog(LOG_WARNING, "Could not replay %s", RECORDING_PATH);
+        }
+    }
+    if (IsReplaying()) {
+        UpdateReplay();
+        UpdateUI();
+        BeginDrawing();
+            ClearBackground((Color){ 50, 45, 55, 255 });
+            BeginMode2D(g_camera);
+                DrawReplay();
+            EndMode2D();
+            DrawProfiledUI(state);
+            DrawFPS(10, 10);
+        EndDrawing();
+        return;
+    }
+
     Color objectColor = { g_red, g_green, g_blue, 255 };
 
     if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) && !IsMouseOnUI()) {
@@ -46,10 +243,11 @@ static void UpdateDrawFrame() {
         if (framesCounter >= 60/(int)g_spawnRate) {
             framesCounter = 0;
             if (g_structType == DEFAULT) {
-                SpawnVerletObject(
+                SendSpawnCommand(
+                    COMMAND_SPAWN_OBJECT,
                     (Vector2){
-                        g_mousePos.x, //+ GetRandomValue(-5, 5),
-                        g_mousePos.y //+ GetRandomValue(-5, 5)
+                        g_mouseWorldPos.x, //+ GetRandomValue(-5, 5),
+                        g_mouseWorldPos.y //+ GetRandomValue(-5, 5)
                     },
                     (int)g_spawnRadius,
                     (Color){
@@ -61,31 +259,81 @@ static void UpdateDrawFrame() {
                 );
             }
             else if (g_structType == ROPE) {
-                SpawnStructureRope(g_mousePos, 35, 25, 8, BOTH, objectColor);
+                SendSpawnCommand(COMMAND_SPAWN_ROPE, g_mouseWorldPos, 0, objectColor);
             }
             else if (g_structType == CLOTH) {
-                SpawnStructureCloth(g_mousePos, 60, 12, 0, objectColor);
+                SendSpawnCommand(COMMAND_SPAWN_CLOTH, g_mouseWorldPos, 0, objectColor);
+            }
+            else if (g_structType == RING) {
+                SendSpawnCommand(COMMAND_SPAWN_RING, g_mouseWorldPos, 0, objectColor);
+            }
+            else if (g_structType == SQUARE) {
+                SendSpawnCommand(COMMAND_SPAWN_SQUARE, g_mouseWorldPos, 0, objectColor);
             }
         }
     }
-    // cap dt at a reasonable value
-    float frameTime = GetFrameTime();
-    frameTime = frameTime > MAX_FRAME_TIME? MAX_FRAME_TIME: frameTime;
-    float substepTime = frameTime/(float)PHYSICS_SUBSTEPS;
+    // reacting to UI signals, a signal stays up until its command is queued
+    if (g_buttonPressed0 && SendCommand(MakeCommand(COMMAND_CLEAR))) {
+        g_buttonPressed0 = false;
+    }
+    if (g_toggleLevel) {
+        PhysicsCommand command = MakeCommand(COMMAND_LEVEL);
+        command.build = g_showLevel? BuildDemoLevel: NULL;
+        if (SendCommand(command)) g_toggleLevel = false;
+    }
+    if (g_spawnVolume && SendSpawnCommand(COMMAND_SPAWN_VOLUME, g_mouseWorldPos, (int)g_spawnRadius, objectColor)) {
+        g_spawnVolume = false;
+    }
+    if (g_spawnVortex) {
+        PhysicsCommand command = MakeCommand(COMMAND_ADD_FIELD);
+        command.field = (ForceField){ 0 };
+        command.field.type = FIELD_VORTEX;
+        command.field.center = g_mouseWorldPos;
+        command.field.radius = 150;
+        command.field.strength = 3000;
+        if (SendCommand(command)) g_spawnVortex = false;
+    }
+    if (g_clearFields && SendCommand(MakeCommand(COMMAND_CLEAR_FIELDS))) {
+        g_clearFields = false;
+    }
+    if (g_saveSnapshot && SendPathCommand(COMMAND_SAVE_SNAPSHOT, SNAPSHOT_PATH)) {
+        g_saveSnapshot = false;
+    }
+    if (g_loadSnapshot && SendPathCommand(COMMAND_LOAD_SNAPSHOT, SNAPSHOT_PATH)) {
+        g_loadSnapshot = false;
+    }
+    if (state->snapshotLoads != snapshotLoads) {
+        // the snapshot's settings replace whatever the UI had
+        g_gravity = state->gravity.y;
+        g_applyConstraint = state->constraint;
+        snapshotLoads = state->snapshotLoads;
+    }
+    SendSettings();
 
-    UpdateVerlet(substepTime);
+    // without a thread of its own the solver steps here, either way it
+    // runs fixed steps of PHYSICS_SUBSTEPS substeps at g_physicsRate
+    UpdatePhysics();
     UpdateUI();
     framesCounter++;
 
-    // Draw
+    // Draw the newest state, alpha of the way from where the last step
+    // started to where it ended by how long ago the step was due
+    state = AcquirePhysicsState();
+    float alpha = state->stepTime > 0? (float)((GetHighResTime() - state->time)/state->stepTime): 1;
+    alpha = Clamp(alpha, 0, 1);
     BeginDrawing();
         ClearBackground((Color){ 50, 45, 55, 255 });
-        if (g_applyConstraint) {
-            DrawCircleSector((Vector2){(float)g_screenWidth/2, (float)g_screenHeight/2},
-                    400, 0, 360, 128, (Color){ 28, 27, 25, 255 });
-        }
-        DrawVerlet();
-        DrawUI();
+        BeginMode2D(g_camera);
+            if (g_applyConstraint) {
+                DrawCircleSector((Vector2){(float)g_screenWidth/2, (float)g_screenHeight/2},
+                        400, 0, 360, 128, (Color){ 28, 27, 25, 255 });
+            }
+            DrawColliders(state->colliders, state->numColliders, (Color){ 90, 85, 80, 255 });
+            double t = GetHighResTime();
+            DrawVerletState(state, alpha, g_camera);
+            EndProfileZone(ZONE_DRAW_VERLET, t);
+        EndMode2D();
+        DrawProfiledUI(state);
         DrawFPS(10, 10);
     EndDrawing();
 }
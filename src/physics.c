@@ -0,0 +1,283 @@
+// Physics thread. The solver runs on a thread of its own and owns
+// everything behind it: the demo's world, the colliders, the worker pool
+// and the recorder. The main thread only talks to it through a single producer
+// single consumer ring of commands, and reads back the PhysicsState the
+// physics thread publishes after every step through a triple buffer.
+// Neither side ever waits for the other, a slow frame only means fewer
+// states get drawn and a slow step only means commands wait a little.
+//
+// Where threads can't be created (the web build) UpdatePhysics() does the
+// same work on the main thread once per frame, through the same queue.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raylib.h"
+#include "common.h"
+
+// a power of two, the counters below wrap by masking
+#define COMMAND_RING_SIZE 256
+// set next to the shared state's index while the reader hasn't taken it
+#define STATE_FRESH 4
+
+// the ring, head is only written by the physics thread and tail only by
+// the main thread
+static PhysicsCommand ring[COMMAND_RING_SIZE];
+static unsigned int ringHead = 0;
+static unsigned int ringTail = 0;
+
+// the writer fills states[writeState], the reader draws states[readState]
+// and the third one is handed between them through sharedState
+static PhysicsState states[3];
+static int writeState = 0;
+static int readState = 1;
+static int sharedState = 2;
+
+static pthread_t physicsThread;
+static bool threaded = false;
+
+// physics side
+static VerletWorld *world = NULL;
+static bool paused = false;
+static int physicsRate = PHYSICS_SUBSTEPS*TARGET_FPS;
+static double lastTime = 0;
+static double accumulator = 0;
+static unsigned int snapshotLoads = 0;
+static unsigned int volumeSeed = 1;
+static PhysicsSettings applied;
+static bool settingsApplied = false;
+
+bool PushPhysicsCommand(PhysicsCommand command) {
+    unsigned int tail = __atomic_load_n(&ringTail, __ATOMIC_RELAXED);
+    unsigned int head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+    if (tail - head == COMMAND_RING_SIZE) return false;
+    ring[tail & (COMMAND_RING_SIZE - 1)] = command;
+    __atomic_store_n(&ringTail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool PopPhysicsCommand(PhysicsCommand *command) {
+    unsigned int head = __atomic_load_n(&ringHead, __ATOMIC_RELAXED);
+    unsigned int tail = __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE);
+    if (head == tail) return false;
+    *command = ring[head & (COMMAND_RING_SIZE - 1)];
+    __atomic_store_n(&ringHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Only what changed since the last settings is applied, so settings the UI
+// sent before it saw a snapshot load can't undo the snapshot's gravity
+static void ApplySettings(const PhysicsSettings *settings) {
+    bool all = !settingsApplied;
+    if (all || settings->gravity.x != applied.gravity.x || settings->gravity.y != applied.gravity.y) {
+        SetVerletGravity(world, settings->gravity);
+    }
+    if (all || settings->constraint != applied.constraint) {
+        SetVerletConstraint(world, settings->constraint);
+    }
+    SetVerletAttractor(world, settings->attractor, settings->attractorPos);
+    SetNumThreads(settings->numThreads);
+    SetVerletLinkSolver(world, settings->linkSolver);
+    if (settings->adaptive) {
+        SetVerletSubsteps(world, MIN_SUBSTEPS, MAX_SUBSTEPS);
+        SetVerletIterations(world, 1, MAX_ITERATIONS);
+        SetVerletStepBudget(world, STEP_BUDGET);
+    }
+    else {
+        SetVerletSubsteps(world, PHYSICS_SUBSTEPS, PHYSICS_SUBSTEPS);
+        SetVerletIterations(world, 1, 1);
+    }
+    if (settings->rate > 0) physicsRate = settings->rate;
+    applied = *settings;
+    settingsApplied = true;
+}
+
+// returns false for COMMAND_QUIT
+static bool RunPhysicsCommand(const PhysicsCommand *command) {
+    switch (command->type) {
+        case COMMAND_SPAWN_OBJECT:
+            SpawnVerletObject(world, command->pos, command->radius, command->color);
+            break;
+        case COMMAND_SPAWN_ROPE:
+            SpawnStructureRope(world, command->pos, 35, 25, 8, BOTH, command->color);
+            break;
+        case COMMAND_SPAWN_CLOTH:
+            SpawnStructureCloth(world, command->pos, 60, 12, 0, command->color);
+            break;
+        case COMMAND_SPAWN_RING:
+            SpawnStructureRing(world, command->pos, 60, 36, 4, 4000, command->color);
+            break;
+        case COMMAND_SPAWN_SQUARE:
+            SpawnStructureSquare(world, (Vector2){ command->pos.x - 50, command->pos.y - 50 }, 100, 4,
+                    command->color);
+            break;
+        case COMMAND_SPAWN_VOLUME:
+            EmitVerletPoissonDisk(world, command->pos, 150, command->radius, command->color,
+                    volumeSeed++);
+            break;
+        case COMMAND_CLEAR:
+            ClearVerlet(world);
+            break;
+        case COMMAND_ADD_FIELD:
+            if (AddVerletForceField(world, command->field) < 0) {
+                TraceLog(LOG_WARNING, "Could not add a force field");
+            }
+            break;
+        case COMMAND_CLEAR_FIELDS:
+            ClearVerletForceFields(world);
+            break;
+        case COMMAND_SETTINGS:
+            ApplySettings(&command->settings);
+            break;
+        case COMMAND_LEVEL:
+            if (command->build != NULL) command->build();
+            else ClearColliders();
+            // the level changes under whatever was resting on it
+            WakeVerletObjects(world);
+            break;
+        case COMMAND_SAVE_SNAPSHOT:
+            if (SaveVerletSnapshot(world, command->path)) {
+                TraceLog(LOG_INFO, "Saved snapshot to %s", command->path);
+            }
+            else {
+                TraceLog(LOG_WARNING, "Could not save snapshot to %s", command->path);
+            }
+            break;
+        case COMMAND_LOAD_SNAPSHOT:
+            if (LoadVerletSnapshot(world, command->path)) {
+                snapshotLoads++;
+                TraceLog(LOG_INFO, "Loaded snapshot from %s", command->path);
+            }
+            else {
+                TraceLog(LOG_WARNING, "Could not load snapshot from %s", command->path);
+            }
+            break;
+        case COMMAND_START_RECORDING:
+            if (!StartRecording(command->path, GetVerletWorldBounds(world))) {
+                TraceLog(LOG_WARNING, "Could not record to %s", command->path);
+            }
+            break;
+        case COMMAND_STOP_RECORDING:
+            if (IsRecording() && !StopRecording()) {
+                TraceLog(LOG_WARNING, "Recording to %s is incomplete", command->path);
+            }
+            break;
+        case COMMAND_PAUSE:
+            paused = true;
+            break;
+        case COMMAND_RESUME:
+            paused = false;
+            break;
+        case COMMAND_QUIT:
+            return false;
+    }
+    return true;
+}
+
+// fill the writer's state and swap it in as the newest one
+static void PublishPhysicsState(double time, float stepTime) {
+    PhysicsState *state = &states[writeState];
+    CopyVerletState(world, state);
+    unsigned int version = GetCollidersVersion();
+    if (state->collidersVersion != version) {
+        state->numColliders = CopyColliders(&state->colliders, &state->colliderCapacity);
+        state->collidersVersion = version;
+    }
+    state->time = time;
+    state->stepTime = stepTime;
+    state->numThreads = GetNumThreads();
+    state->paused = paused;
+    state->recording = IsRecording();
+    state->droppedFrames = GetDroppedFrames();
+    state->snapshotLoads = snapshotLoads;
+    writeState = __atomic_exchange_n(&sharedState, writeState | STATE_FRESH, __ATOMIC_ACQ_REL) & 3;
+}
+
+const PhysicsState *AcquirePhysicsState(void) {
+    if (__atomic_load_n(&sharedState, __ATOMIC_RELAXED) & STATE_FRESH) {
+        readState = __atomic_exchange_n(&sharedState, readState, __ATOMIC_ACQ_REL) & 3;
+    }
+    return &states[readState];
+}
+
+// Run the queued commands, take the steps that are due and publish the
+// result. Returns the time until the next step is due, or a negative time
+// once asked to quit. Like the old frame loop, time beyond MAX_FRAME_TIME
+// since the last call is dropped so a stall can't snowball
+static double RunPhysics(void) {
+    PhysicsCommand command;
+    bool changed = false;
+    while (PopPhysicsCommand(&command)) {
+        if (!RunPhysicsCommand(&command)) return -1;
+        changed = true;
+    }
+
+    double now = GetHighResTime();
+    double elapsed = lastTime > 0? now - lastTime: 0;
+    lastTime = now;
+    float stepTime = (float)PHYSICS_SUBSTEPS/physicsRate;
+    int steps = 0;
+    if (!paused) {
+        accumulator += elapsed > MAX_FRAME_TIME? MAX_FRAME_TIME: elapsed;
+        steps = (int)(accumulator/stepTime);
+        accumulator -= steps*stepTime;
+        UpdateVerlet(world, stepTime, steps);
+    }
+    // the state shows the simulation as of the last step, which was due
+    // accumulator ago
+    if (steps > 0 || changed) {
+        PublishPhysicsState(now - accumulator, stepTime);
+    }
+    return paused? stepTime: stepTime - accumulator;
+}
+
+static void *PhysicsMain(void *arg) {
+    (void)arg;
+    for (;;) {
+        double wait = RunPhysics();
+        if (wait < 0) break;
+        SleepSeconds(wait);
+    }
+    return NULL;
+}
+
+// Create the world, publish the state it starts from and hand it to its
+// thread. Returns false if the world could not be created
+bool StartPhysics(void) {
+    world = CreateVerletWorld();
+    if (world == NULL) return false;
+    // the demo's world is the one the profiler and recorder follow
+    SetVerletProfiled(world, true);
+    SetVerletRecorded(world, true);
+    lastTime = 0;
+    PublishPhysicsState(GetHighResTime(), (float)PHYSICS_SUBSTEPS/physicsRate);
+    threaded = pthread_create(&physicsThread, NULL, PhysicsMain, NULL) == 0;
+    if (!threaded) {
+        TraceLog(LOG_INFO, "Physics runs on the main thread");
+    }
+    return true;
+}
+
+// waits for the commands already queued, then frees the world
+void StopPhysics(void) {
+    if (threaded) {
+        PhysicsCommand quit = { 0 };
+        quit.type = COMMAND_QUIT;
+        // the ring may be full for a moment
+        while (!PushPhysicsCommand(quit)) {
+            SleepSeconds(0.001);
+        }
+        pthread_join(physicsThread, NULL);
+        threaded = false;
+    }
+    DestroyVerletWorld(world);
+    world = NULL;
+}
+
+bool IsPhysicsThreaded(void) {
+    return threaded;
+}
+
+// steps the solver on the calling thread if it has no thread of its own
+void UpdatePhysics(void) {
+    if (!threaded) RunPhysics();
+}
@@ -0,0 +1,221 @@
+// Frame profiler. Zones are timed by the caller and summed per frame, the
+// last PROFILE_HISTORY frames are kept for percentiles. Counters are summed
+// per frame the same way. While a trace is running every zone is also kept
+// as an event and written out as Chrome trace JSON (chrome://tracing or
+// ui.perfetto.dev) when the trace stops.
+//
+// Zones and counters come from both the physics thread and the main thread,
+// so everything here takes profileMutex. That is a few dozen uncontended
+// locks per frame. In traces the solver's zones get a track of their own.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+#define PROFILE_HISTORY 240
+// about a minute of frames at the demo's default settings
+#define MAX_TRACE_EVENTS (1 << 18)
+#define MAX_TRACE_FRAMES (1 << 14)
+
+typedef struct TraceEvent {
+    double start;
+    float duration;
+    int zone;
+} TraceEvent;
+
+typedef struct TraceFrame {
+    double end;
+    int counts[NUM_PROFILE_COUNTERS];
+} TraceFrame;
+
+static const char *zoneNames[NUM_PROFILE_ZONES] = {
+    "ApplyAcceleration",
+    "ApplyConstraintCircle",
+    "ApplyColliders",
+    "SolveCollisions",
+    "ApplyLinks",
+    "UpdatePositions",
+    "UpdateSleep",
+    "SortObjects",
+    "DrawVerlet",
+    "DrawUI",
+    "Frame",
+};
+
+static const char *counterNames[NUM_PROFILE_COUNTERS] = {
+    "pair tests",
+    "contacts",
+    "links stretched",
+    "neighbour rebuilds",
+    "swept objects",
+};
+
+// totals of the frame in progress and of the finished frames
+static double frameTimes[NUM_PROFILE_ZONES];
+static int frameCounts[NUM_PROFILE_COUNTERS];
+static float history[NUM_PROFILE_ZONES][PROFILE_HISTORY];
+static int lastCounts[NUM_PROFILE_COUNTERS];
+static int historyNext = 0;
+static int historyCount = 0;
+static double frameStart = 0;
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static TraceEvent *traceEvents = NULL;
+static TraceFrame *traceFrames = NULL;
+static int numTraceEvents = 0;
+static int numTraceFrames = 0;
+static double traceStart = 0;
+
+// adds the time since start to the zone and returns the current time, so
+// consecutive zones can be timed from one clock read each
+double EndProfileZone(ProfileZone zone, double start) {
+    double now = GetHighResTime();
+    pthread_mutex_lock(&profileMutex);
+    frameTimes[zone] += now - start;
+    if (traceEvents != NULL && numTraceEvents < MAX_TRACE_EVENTS) {
+        traceEvents[numTraceEvents++] = (TraceEvent){ start, (float)(now - start), zone };
+    }
+    pthread_mutex_unlock(&profileMutex);
+    return now;
+}
+
+void AddProfileCount(ProfileCounter counter, int amount) {
+    pthread_mutex_lock(&profileMutex);
+    frameCounts[counter] += amount;
+    pthread_mutex_unlock(&profileMutex);
+}
+
+// closes the frame: the time since the previous call is the frame zone,
+// and the frame's totals go into the history
+void EndProfileFrame(void) {
+    double now = GetHighResTime();
+    if (frameStart > 0) {
+        EndProfileZone(ZONE_FRAME, frameStart);
+    }
+    frameStart = now;
+
+    pthread_mutex_lock(&profileMutex);
+    for (int z = 0; z < NUM_PROFILE_ZONES; z++) {
+        history[z][historyNext] = (float)frameTimes[z];
+        frameTimes[z] = 0;
+    }
+    historyNext = (historyNext + 1) % PROFILE_HISTORY;
+    if (historyCount < PROFILE_HISTORY) historyCount++;
+
+    if (traceFrames != NULL && numTraceFrames < MAX_TRACE_FRAMES) {
+        traceFrames[numTraceFrames].end = now;
+        memcpy(traceFrames[numTraceFrames].counts, frameCounts, sizeof(frameCounts));
+        numTraceFrames++;
+    }
+    memcpy(lastCounts, frameCounts, sizeof(frameCounts));
+    memset(frameCounts, 0, sizeof(frameCounts));
+    pthread_mutex_unlock(&profileMutex);
+}
+
+static int CompareFloats(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// time per frame the zone took in the given fraction of the recent frames,
+// e.g. 0.99 for p99
+double GetProfilePercentile(ProfileZone zone, float percentile) {
+    if (historyCount == 0) return 0;
+    float sorted[PROFILE_HISTORY];
+    memcpy(sorted, history[zone], sizeof(float)*historyCount);
+    qsort(sorted, historyCount, sizeof(float), CompareFloats);
+    int index = (int)(percentile*(historyCount - 1) + 0.5f);
+    if (index < 0) index = 0;
+    if (index > historyCount - 1) index = historyCount - 1;
+    return sorted[index];
+}
+
+int GetProfileCount(ProfileCounter counter) {
+    pthread_mutex_lock(&profileMutex);
+    int count = lastCounts[counter];
+    pthread_mutex_unlock(&profileMutex);
+    return count;
+}
+
+const char *GetProfileZoneName(ProfileZone zone) {
+    return zoneNames[zone];
+}
+
+const char *GetProfileCounterName(ProfileCounter counter) {
+    return counterNames[counter];
+}
+
+bool StartProfileTrace(void) {
+    if (IsProfileTracing()) return true;
+    TraceEvent *events = malloc(sizeof(TraceEvent)*MAX_TRACE_EVENTS);
+    TraceFrame *frames = malloc(sizeof(TraceFrame)*MAX_TRACE_FRAMES);
+    if (events == NULL || frames == NULL) {
+        free(events);
+        free(frames);
+        return false;
+    }
+    pthread_mutex_lock(&profileMutex);
+    traceEvents = events;
+    traceFrames = frames;
+    numTraceEvents = 0;
+    numTraceFrames = 0;
+    traceStart = GetHighResTime();
+    pthread_mutex_unlock(&profileMutex);
+    return true;
+}
+
+bool IsProfileTracing(void) {
+    pthread_mutex_lock(&profileMutex);
+    bool tracing = traceEvents != NULL;
+    pthread_mutex_unlock(&profileMutex);
+    return tracing;
+}
+
+// Writes the events gathered since StartProfileTrace() as complete ("X")
+// events with the counters as counter ("C") events at the end of each
+// frame, times in microseconds. The solver's zones go on a "physics" track
+// and the rest on a "main" track. The trace is dropped even if writing
+// fails, and it is written outside the lock so the solver never waits on
+// the disk
+bool StopProfileTrace(const char *path) {
+    pthread_mutex_lock(&profileMutex);
+    TraceEvent *events = traceEvents;
+    TraceFrame *frames = traceFrames;
+    int numEvents = numTraceEvents;
+    int numFrames = numTraceFrames;
+    traceEvents = NULL;
+    traceFrames = NULL;
+    pthread_mutex_unlock(&profileMutex);
+    if (events == NULL) return false;
+
+    FILE *file = fopen(path, "w");
+    bool ok = file != NULL;
+    if (ok) {
+        fprintf(file, "{\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"main\"}},\n");
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"physics\"}}");
+        for (int i = 0; i < numEvents; i++) {
+            TraceEvent *event = &events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    zoneNames[event->zone], event->zone < ZONE_DRAW_VERLET? 2: 1,
+                    (event->start - traceStart)*1e6, event->duration*1e6);
+        }
+        for (int i = 0; i < numFrames; i++) {
+            TraceFrame *frame = &frames[i];
+            fprintf(file, ",\n{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{",
+                    (frame->end - traceStart)*1e6);
+            for (int c = 0; c < NUM_PROFILE_COUNTERS; c++) {
+                fprintf(file, "%s\"%s\":%d", c > 0? ",": "", counterNames[c], frame->counts[c]);
+            }
+            fprintf(file, "}}");
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        ok = !ferror(file);
+        ok = fclose(file) == 0 && ok;
+    }
+    free(events);
+    free(frames);
+    return ok;
+}
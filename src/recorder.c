@@ -0,0 +1,452 @@
+// Frame recorder and replay. Every recorded frame stores the position,
+// radius and colour of each object quantised to 16 bits and delta encoded
+// against the previous frame as zigzag varints, with a keyframe encoded
+// against zero every KEYFRAME_INTERVAL frames. Frames are encoded on the
+// simulation thread into a ring of buffers that a writer thread flushes to
+// disk. If the ring is full the frame is dropped and the next one is a
+// keyframe, so recording never waits for the disk.
+//
+// file:  header, then frames
+// frame: uint32 payload size, payload
+// payload: float duration, varint count, uint8 keyframe,
+//          per object zigzag varint dx and dy,
+//          varint number of objects whose radius or colour changed, then
+//          for each of those varint index gap, zigzag dradius, colour xor
+// Radius and colour rarely change, so a frame costs about two to four
+// bytes per object against sixteen raw
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+#define RECORD_MAGIC "VREC"
+#define RECORD_VERSION 1
+#define RECORD_BUFFERS 8
+#define KEYFRAME_INTERVAL 120
+// radii are stored in 1/64ths of a pixel
+#define RADIUS_STEPS 64.0f
+// worst case bytes for one object: two 17 bit position deltas, then an
+// index gap, a radius delta and a colour
+#define MAX_OBJECT_BYTES (3 + 3 + 5 + 3 + 5)
+#define MAX_FRAME_HEADER_BYTES (4 + 4 + 5 + 1 + 5)
+
+typedef struct RecordHeader {
+    char magic[4];
+    uint32_t version;
+    // positions are stored as origin + q*step
+    float originX;
+    float originY;
+    float step;
+} RecordHeader;
+
+// the last frame as the decoder sees it, deltas are taken against this
+typedef struct QuantisedFrame {
+    uint16_t *x;
+    uint16_t *y;
+    uint16_t *radius;
+    uint32_t *color;
+    int count;
+    int capacity;
+} QuantisedFrame;
+
+typedef struct FrameBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} FrameBuffer;
+
+// recording state, the ring is guarded by recordMutex
+static FILE *recordFile = NULL;
+static RecordHeader recordHeader;
+static QuantisedFrame recordFrame;
+static pthread_t writerThread;
+static pthread_mutex_t recordMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recordCond = PTHREAD_COND_INITIALIZER;
+static FrameBuffer buffers[RECORD_BUFFERS];
+// buffers[queueStart] up to queueCount slots on wait for the writer, which
+// only releases a slot once it is written
+static int queueStart = 0;
+static int queueCount = 0;
+static bool stopWriter = false;
+static bool writeFailed = false;
+static int framesSinceKeyframe = 0;
+static int droppedFrames = 0;
+
+// replay state
+static FILE *replayFile = NULL;
+static RecordHeader replayHeader;
+static QuantisedFrame replayFrame;
+static uint8_t *replayData = NULL;
+static size_t replayCapacity = 0;
+static float *replayX = NULL;
+static float *replayY = NULL;
+static float *replayRadius = NULL;
+static Color *replayColors = NULL;
+
+static bool ReserveQuantisedFrame(QuantisedFrame *frame, int count) {
+    if (count <= frame->capacity) return true;
+    int capacity = frame->capacity > 0? frame->capacity: 1024;
+    while (capacity < count) capacity *= 2;
+    uint16_t *x = realloc(frame->x, sizeof(uint16_t)*capacity);
+    if (x != NULL) frame->x = x;
+    uint16_t *y = realloc(frame->y, sizeof(uint16_t)*capacity);
+    if (y != NULL) frame->y = y;
+    uint16_t *radius = realloc(frame->radius, sizeof(uint16_t)*capacity);
+    if (radius != NULL) frame->radius = radius;
+    uint32_t *color = realloc(frame->color, sizeof(uint32_t)*capacity);
+    if (color != NULL) frame->color = color;
+    if (x == NULL || y == NULL || radius == NULL || color == NULL) return false;
+    frame->capacity = capacity;
+    return true;
+}
+
+static void FreeQuantisedFrame(QuantisedFrame *frame) {
+    free(frame->x);
+    free(frame->y);
+    free(frame->radius);
+    free(frame->color);
+    *frame = (QuantisedFrame){ 0 };
+}
+
+static uint16_t Quantise(float value, float origin, float step) {
+    float q = (value - origin)/step + 0.5f;
+    // also catches NaN
+    if (!(q >= 0)) return 0;
+    if (q > 65535) return 65535;
+    return (uint16_t)q;
+}
+
+static uint8_t *WriteVarint(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static uint8_t *WriteDelta(uint8_t *out, int value, int previous) {
+    int delta = value - previous;
+    return WriteVarint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+}
+
+// returns NULL if the varint runs past end
+static const uint8_t *ReadVarint(const uint8_t *in, const uint8_t *end, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; in < end && shift < 35; shift += 7) {
+        uint8_t byte = *in++;
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return in;
+    }
+    return NULL;
+}
+
+static const uint8_t *ReadDelta(const uint8_t *in, const uint8_t *end, uint16_t *value) {
+    uint32_t zigzag;
+    in = ReadVarint(in, end, &zigzag);
+    int delta = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+    *value = (uint16_t)(*value + delta);
+    return in;
+}
+
+static uint32_t PackColor(Color color) {
+    return (uint32_t)color.r | (uint32_t)color.g << 8 | (uint32_t)color.b << 16 | (uint32_t)color.a << 24;
+}
+
+static bool IsAttributeChanged(int i, int previousCount, uint16_t radius, uint32_t color) {
+    return i >= previousCount || radius != recordFrame.radius[i] || color != recordFrame.color[i];
+}
+
+static void *WriterMain(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&recordMutex);
+    for (;;) {
+        while (queueCount == 0 && !stopWriter) {
+            pthread_cond_wait(&recordCond, &recordMutex);
+        }
+        if (queueCount == 0) break;
+        FrameBuffer *buffer = &buffers[queueStart];
+        pthread_mutex_unlock(&recordMutex);
+
+        bool ok = fwrite(buffer->data, 1, buffer->size, recordFile) == buffer->size;
+
+        pthread_mutex_lock(&recordMutex);
+        if (!ok) writeFailed = true;
+        queueStart = (queueStart + 1) % RECORD_BUFFERS;
+        queueCount--;
+    }
+    pthread_mutex_unlock(&recordMutex);
+    return NULL;
+}
+
+// positions are quantised over bounds, objects outside it are clamped
+bool StartRecording(const char *path, Rectangle bounds) {
+    if (recordFile != NULL) return false;
+    recordFile = fopen(path, "wb");
+    if (recordFile == NULL) return false;
+
+    float size = bounds.width > bounds.height? bounds.width: bounds.height;
+    recordHeader = (RecordHeader){
+        .version = RECORD_VERSION,
+        .originX = bounds.x,
+        .originY = bounds.y,
+        .step = size > 0? size/65535.0f: 1.0f,
+    };
+    memcpy(recordHeader.magic, RECORD_MAGIC, 4);
+    recordFrame.count = 0;
+    queueStart = 0;
+    queueCount = 0;
+    stopWriter = false;
+    writeFailed = fwrite(&recordHeader, sizeof(recordHeader), 1, recordFile) != 1;
+    // the first frame is always a keyframe
+    framesSinceKeyframe = KEYFRAME_INTERVAL;
+    droppedFrames = 0;
+
+    if (writeFailed || pthread_create(&writerThread, NULL, WriterMain, NULL) != 0) {
+        fclose(recordFile);
+        recordFile = NULL;
+        return false;
+    }
+    return true;
+}
+
+// waits for the writer to drain the queue, returns false if any write failed
+bool StopRecording(void) {
+    if (recordFile == NULL) return false;
+    pthread_mutex_lock(&recordMutex);
+    stopWriter = true;
+    pthread_cond_signal(&recordCond);
+    pthread_mutex_unlock(&recordMutex);
+    pthread_join(writerThread, NULL);
+
+    bool ok = fclose(recordFile) == 0 && !writeFailed;
+    recordFile = NULL;
+    for (int i = 0; i < RECORD_BUFFERS; i++) {
+        free(buffers[i].data);
+        buffers[i] = (FrameBuffer){ 0 };
+    }
+    FreeQuantisedFrame(&recordFrame);
+    return ok;
+}
+
+bool IsRecording(void) {
+    return recordFile != NULL;
+}
+
+int GetDroppedFrames(void) {
+    return droppedFrames;
+}
+
+// encode one frame and queue it for the writer. duration is the simulated
+// time the frame covers, replay uses it to keep the original pace
+void RecordFrame(const float *x, const float *y, const float *radius, const Color *colors,
+        int count, float duration) {
+    if (recordFile == NULL) return;
+
+    pthread_mutex_lock(&recordMutex);
+    bool full = queueCount == RECORD_BUFFERS;
+    int slot = (queueStart + queueCount) % RECORD_BUFFERS;
+    pthread_mutex_unlock(&recordMutex);
+
+    // the slot past the queue belongs to this thread until it is queued
+    FrameBuffer *buffer = &buffers[slot];
+    size_t needed = MAX_FRAME_HEADER_BYTES + (size_t)count*MAX_OBJECT_BYTES;
+    if (!full && needed > buffer->capacity) {
+        uint8_t *data = realloc(buffer->data, needed);
+        if (data != NULL) {
+            buffer->data = data;
+            buffer->capacity = needed;
+        }
+    }
+    if (full || needed > buffer->capacity || !ReserveQuantisedFrame(&recordFrame, count)) {
+        // the decoder never sees this frame, so restart the deltas
+        droppedFrames++;
+        framesSinceKeyframe = KEYFRAME_INTERVAL;
+        return;
+    }
+
+    bool keyframe = framesSinceKeyframe >= KEYFRAME_INTERVAL;
+    framesSinceKeyframe = keyframe? 1: framesSinceKeyframe + 1;
+    int previousCount = keyframe? 0: recordFrame.count;
+
+    uint8_t *out = buffer->data + 4;
+    memcpy(out, &duration, sizeof(float));
+    out = WriteVarint(out + sizeof(float), (uint32_t)count);
+    *out++ = keyframe;
+    // objects past the previous count are new, they delta against zero
+    for (int i = 0; i < count; i++) {
+        bool known = i < previousCount;
+        uint16_t qx = Quantise(x[i], recordHeader.originX, recordHeader.step);
+        uint16_t qy = Quantise(y[i], recordHeader.originY, recordHeader.step);
+        out = WriteDelta(out, qx, known? recordFrame.x[i]: 0);
+        out = WriteDelta(out, qy, known? recordFrame.y[i]: 0);
+        recordFrame.x[i] = qx;
+        recordFrame.y[i] = qy;
+    }
+
+    // radius and colour changes, counted first since the count leads
+    int numChanged = 0;
+    for (int i = 0; i < count; i++) {
+        numChanged += IsAttributeChanged(i, previousCount,
+                Quantise(radius[i], 0, 1.0f/RADIUS_STEPS), PackColor(colors[i]));
+    }
+    out = WriteVarint(out, (uint32_t)numChanged);
+    int lastChanged = -1;
+    for (int i = 0; i < count; i++) {
+        uint16_t qr = Quantise(radius[i], 0, 1.0f/RADIUS_STEPS);
+        uint32_t color = PackColor(colors[i]);
+        if (!IsAttributeChanged(i, previousCount, qr, color)) continue;
+        bool known = i < previousCount;
+        out = WriteVarint(out, (uint32_t)(i - lastChanged - 1));
+        out = WriteDelta(out, qr, known? recordFrame.radius[i]: 0);
+        out = WriteVarint(out, color ^ (known? recordFrame.color[i]: 0));
+        recordFrame.radius[i] = qr;
+        recordFrame.color[i] = color;
+        lastChanged = i;
+    }
+    recordFrame.count = count;
+
+    uint32_t payloadSize = (uint32_t)(out - buffer->data - 4);
+    memcpy(buffer->data, &payloadSize, sizeof(uint32_t));
+    buffer->size = (size_t)(out - buffer->data);
+
+    pthread_mutex_lock(&recordMutex);
+    queueCount++;
+    pthread_cond_signal(&recordCond);
+    pthread_mutex_unlock(&recordMutex);
+}
+
+bool StartReplay(const char *path) {
+    if (replayFile != NULL) return false;
+    replayFile = fopen(path, "rb");
+    if (replayFile == NULL) return false;
+    if (fread(&replayHeader, sizeof(replayHeader), 1, replayFile) != 1 ||
+            memcmp(replayHeader.magic, RECORD_MAGIC, 4) != 0 ||
+            replayHeader.version != RECORD_VERSION) {
+        fclose(replayFile);
+        replayFile = NULL;
+        return false;
+    }
+    replayFrame.count = 0;
+    return true;
+}
+
+void StopReplay(void) {
+    if (replayFile == NULL) return;
+    fclose(replayFile);
+    replayFile = NULL;
+    free(replayData);
+    free(replayX);
+    free(replayY);
+    free(replayRadius);
+    free(replayColors);
+    replayData = NULL;
+    replayCapacity = 0;
+    replayX = NULL;
+    replayY = NULL;
+    replayRadius = NULL;
+    replayColors = NULL;
+    FreeQuantisedFrame(&replayFrame);
+}
+
+bool IsReplaying(void) {
+    return replayFile != NULL;
+}
+
+// decode a payload into replayFrame, false if it is malformed
+static bool DecodeReplayFrame(const uint8_t *in, const uint8_t *end, float *duration) {
+    uint32_t count;
+    if (end - in < (long)sizeof(float)) return false;
+    memcpy(duration, in, sizeof(float));
+    in = ReadVarint(in + sizeof(float), end, &count);
+    if (in == NULL || in >= end || count > INT32_MAX/2) return false;
+    bool keyframe = *in++ != 0;
+    // a delta frame can't follow a dropped or missing frame
+    if (!keyframe && replayFrame.capacity == 0) return false;
+    int previousCount = keyframe? 0: replayFrame.count;
+    if (!ReserveQuantisedFrame(&replayFrame, (int)count)) return false;
+
+    for (int i = 0; i < (int)count; i++) {
+        if (i >= previousCount) {
+            replayFrame.x[i] = 0;
+            replayFrame.y[i] = 0;
+            replayFrame.radius[i] = 0;
+            replayFrame.color[i] = 0;
+        }
+        if ((in = ReadDelta(in, end, &replayFrame.x[i])) == NULL ||
+                (in = ReadDelta(in, end, &replayFrame.y[i])) == NULL) {
+            return false;
+        }
+    }
+
+    uint32_t numChanged;
+    if ((in = ReadVarint(in, end, &numChanged)) == NULL || numChanged > count) return false;
+    uint32_t i = (uint32_t)-1;
+    for (uint32_t k = 0; k < numChanged; k++) {
+        uint32_t gap;
+        uint32_t color;
+        if ((in = ReadVarint(in, end, &gap)) == NULL || gap >= count - i - 1) return false;
+        i += gap + 1;
+        if ((in = ReadDelta(in, end, &replayFrame.radius[i])) == NULL ||
+                (in = ReadVarint(in, end, &color)) == NULL) {
+            return false;
+        }
+        replayFrame.color[i] ^= color;
+    }
+    replayFrame.count = (int)count;
+    return in == end;
+}
+
+// Read and decode the next frame, going back to the start at the end of
+// the file. Returns false if the file is unreadable or corrupt
+bool ReadReplayFrame(float *duration) {
+    if (replayFile == NULL) return false;
+    uint32_t payloadSize;
+    if (fread(&payloadSize, sizeof(uint32_t), 1, replayFile) != 1) {
+        // loop, the first frame is always a keyframe
+        if (fseek(replayFile, sizeof(RecordHeader), SEEK_SET) != 0 ||
+                fread(&payloadSize, sizeof(uint32_t), 1, replayFile) != 1) {
+            return false;
+        }
+    }
+    if (payloadSize > replayCapacity) {
+        uint8_t *data = realloc(replayData, payloadSize);
+        if (data == NULL) return false;
+        replayData = data;
+        replayCapacity = payloadSize;
+    }
+    if (fread(replayData, 1, payloadSize, replayFile) != payloadSize ||
+            !DecodeReplayFrame(replayData, replayData + payloadSize, duration)) {
+        return false;
+    }
+
+    int count = replayFrame.count;
+    float *x = realloc(replayX, sizeof(float)*(count + 1));
+    if (x != NULL) replayX = x;
+    float *y = realloc(replayY, sizeof(float)*(count + 1));
+    if (y != NULL) replayY = y;
+    float *radius = realloc(replayRadius, sizeof(float)*(count + 1));
+    if (radius != NULL) replayRadius = radius;
+    Color *colors = realloc(replayColors, sizeof(Color)*(count + 1));
+    if (colors != NULL) replayColors = colors;
+    if (x == NULL || y == NULL || radius == NULL || colors == NULL) return false;
+
+    for (int i = 0; i < count; i++) {
+        uint32_t color = replayFrame.color[i];
+        replayX[i] = replayHeader.originX + replayFrame.x[i]*replayHeader.step;
+        replayY[i] = replayHeader.originY + replayFrame.y[i]*replayHeader.step;
+        replayRadius[i] = replayFrame.radius[i]/RADIUS_STEPS;
+        replayColors[i] = (Color){ color & 0xFF, (color >> 8) & 0xFF, (color >> 16) & 0xFF, color >> 24 };
+    }
+    return true;
+}
+
+// objects of the last frame read, valid until the next ReadReplayFrame()
+int GetReplayObjects(const float **x, const float **y, const float **radius, const Color **colors) {
+    *x = replayX;
+    *y = replayY;
+    *radius = replayRadius;
+    *colors = replayColors;
+    return replayFrame.count;
+}
@@ -0,0 +1,454 @@
+// Batched renderer. With OpenGL 3.3 or newer every circle is drawn by one
+// instanced call that reads the solver's position, radius and colour arrays
+// straight from vertex buffers, and every link is expanded into one buffer
+// of quads drawn by a single call. Other GL versions report the batch as
+// unavailable and the caller falls back to raylib's immediate mode shapes.
+// Objects too small to see are summed into a texture of density tiles
+// instead, with any GL version.
+#include <stdlib.h>
+#include <string.h>
+#include "raylib.h"
+#include "raymath.h"
+#include "rlgl.h"
+#include "common.h"
+
+#define MIN_BATCH_CAPACITY 4096
+// screen pixels along each side of a density tile
+#define DENSITY_TILE_SIZE 2
+
+static const char *circleVertexShader =
+    "#version 330\n"
+    "in vec2 vertexPosition;\n"
+    "in float instanceX;\n"
+    "in float instanceY;\n"
+    "in float instanceOldX;\n"
+    "in float instanceOldY;\n"
+    "in float instanceRadius;\n"
+    "in vec4 instanceColor;\n"
+    "uniform mat4 mvp;\n"
+    "uniform float alpha;\n"
+    "out vec2 fragOffset;\n"
+    "out vec4 fragColor;\n"
+    "void main() {\n"
+    "    fragOffset = vertexPosition;\n"
+    "    fragColor = instanceColor;\n"
+    "    vec2 center = mix(vec2(instanceOldX, instanceOldY), vec2(instanceX, instanceY), alpha);\n"
+    "    vec2 pos = center + vertexPosition*instanceRadius;\n"
+    "    gl_Position = mvp*vec4(pos, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *circleFragmentShader =
+    "#version 330\n"
+    "in vec2 fragOffset;\n"
+    "in vec4 fragColor;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    float dist = length(fragOffset);\n"
+    "    float edge = fwidth(dist);\n"
+    "    float alpha = 1.0 - smoothstep(1.0 - edge, 1.0, dist);\n"
+    "    if (alpha <= 0.0) discard;\n"
+    "    finalColor = vec4(fragColor.rgb, fragColor.a*alpha);\n"
+    "}\n";
+
+static const char *lineVertexShader =
+    "#version 330\n"
+    "in vec2 vertexPosition;\n"
+    "uniform mat4 mvp;\n"
+    "void main() {\n"
+    "    gl_Position = mvp*vec4(vertexPosition, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *lineFragmentShader =
+    "#version 330\n"
+    "uniform vec4 lineColor;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    finalColor = lineColor;\n"
+    "}\n";
+
+// two triangles covering the unit circle's bounding square
+static const float unitQuad[] = {
+    -1, -1,  1, -1,  1, 1,
+    -1, -1,  1,  1, -1, 1
+};
+
+typedef struct CircleBatch {
+    Shader shader;
+    int mvpLoc;
+    int alphaLoc;
+    unsigned int vao;
+    unsigned int quadBuffer;
+    // one buffer per solver array so they can be uploaded without repacking
+    unsigned int xBuffer;
+    unsigned int yBuffer;
+    unsigned int oldXBuffer;
+    unsigned int oldYBuffer;
+    unsigned int radiusBuffer;
+    unsigned int colorBuffer;
+    int capacity;
+} CircleBatch;
+
+typedef struct LineBatch {
+    Shader shader;
+    int mvpLoc;
+    int colorLoc;
+    unsigned int vao;
+    unsigned int vertexBuffer;
+    float *vertices;
+    int capacity;
+    int count;
+} LineBatch;
+
+// circles gathered one at a time and drawn by a single instanced call
+typedef struct CircleList {
+    float *x;
+    float *y;
+    float *radius;
+    Color *colors;
+    int capacity;
+    int count;
+} CircleList;
+
+// A tile shows the average colour of the objects in it, with the share of
+// its area they cover as alpha. Object positions are mapped to tiles by
+// the camera's transform, taken apart into an origin and two axes
+typedef struct DensityTiles {
+    Texture2D texture;
+    Color *pixels;
+    // per tile the colour channels weighted by coverage, then the coverage
+    float *sums;
+    int width;
+    int height;
+    bool used;
+    Camera2D camera;
+    Vector2 origin;
+    Vector2 axisX;
+    Vector2 axisY;
+    // the share of a tile covered by a disc of radius 1
+    float unitCoverage;
+} DensityTiles;
+
+static bool batchSupported = false;
+static CircleBatch circles = { 0 };
+static LineBatch lines = { 0 };
+static CircleList circleList = { 0 };
+static DensityTiles density = { 0 };
+
+static unsigned int LoadInstanceBuffer(int location, int size, int type, bool normalized, int bytes) {
+    unsigned int buffer = rlLoadVertexBuffer(NULL, bytes, true);
+    rlSetVertexAttribute(location, size, type, normalized, 0, 0);
+    rlEnableVertexAttribute(location);
+    rlSetVertexAttributeDivisor(location, 1);
+    return buffer;
+}
+
+static void UnloadCircleBuffers(void) {
+    if (circles.vao == 0) return;
+    rlUnloadVertexBuffer(circles.quadBuffer);
+    rlUnloadVertexBuffer(circles.xBuffer);
+    rlUnloadVertexBuffer(circles.yBuffer);
+    rlUnloadVertexBuffer(circles.oldXBuffer);
+    rlUnloadVertexBuffer(circles.oldYBuffer);
+    rlUnloadVertexBuffer(circles.radiusBuffer);
+    rlUnloadVertexBuffer(circles.colorBuffer);
+    rlUnloadVertexArray(circles.vao);
+    circles.vao = 0;
+}
+
+// (re)create the circle vertex array with room for capacity instances
+static void LoadCircleBuffers(int capacity) {
+    UnloadCircleBuffers();
+    Shader shader = circles.shader;
+    circles.capacity = capacity;
+    circles.vao = rlLoadVertexArray();
+    rlEnableVertexArray(circles.vao);
+
+    int positionLoc = GetShaderLocationAttrib(shader, "vertexPosition");
+    circles.quadBuffer = rlLoadVertexBuffer(unitQuad, sizeof(unitQuad), false);
+    rlSetVertexAttribute(positionLoc, 2, RL_FLOAT, false, 0, 0);
+    rlEnableVertexAttribute(positionLoc);
+
+    circles.xBuffer = LoadInstanceBuffer(GetShaderLocationAttrib(shader, "instanceX"),
+            1, RL_FLOAT, false, capacity*sizeof(float));
+    circles.yBuffer = LoadInstanceBuffer(GetShaderLocationAttrib(shader, "instanceY"),
+            1, RL_FLOAT, false, capacity*sizeof(float));
+    circles.oldXBuffer = LoadInstanceBuffer(GetShaderLocationAttrib(shader, "instanceOldX"),
+            1, RL_FLOAT, false, capacity*sizeof(float));
+    circles.oldYBuffer = LoadInstanceBuffer(GetShaderLocationAttrib(shader, "instanceOldY"),
+            1, RL_FLOAT, false, capacity*sizeof(float));
+    circles.radiusBuffer = LoadInstanceBuffer(GetShaderLocationAttrib(shader, "instanceRadius"),
+            1, RL_FLOAT, false, capacity*sizeof(float));
+    circles.colorBuffer = LoadInstanceBuffer(GetShaderLocationAttrib(shader, "instanceColor"),
+            4, RL_UNSIGNED_BYTE, true, capacity*sizeof(Color));
+    rlDisableVertexArray();
+}
+
+static void UnloadLineBuffers(void) {
+    if (lines.vao == 0) return;
+    rlUnloadVertexBuffer(lines.vertexBuffer);
+    rlUnloadVertexArray(lines.vao);
+    lines.vao = 0;
+}
+
+// (re)create the line vertex array with room for capacity links,
+// six vertices each
+static bool LoadLineBuffers(int capacity) {
+    float *vertices = realloc(lines.vertices, sizeof(float)*12*capacity);
+    if (vertices == NULL) return false;
+    lines.vertices = vertices;
+
+    UnloadLineBuffers();
+    lines.capacity = capacity;
+    lines.vao = rlLoadVertexArray();
+    rlEnableVertexArray(lines.vao);
+    int positionLoc = GetShaderLocationAttrib(lines.shader, "vertexPosition");
+    lines.vertexBuffer = rlLoadVertexBuffer(NULL, sizeof(float)*12*capacity, true);
+    rlSetVertexAttribute(positionLoc, 2, RL_FLOAT, false, 0, 0);
+    rlEnableVertexAttribute(positionLoc);
+    rlDisableVertexArray();
+    return true;
+}
+
+static int GrowCapacity(int capacity, int count) {
+    if (capacity < MIN_BATCH_CAPACITY) capacity = MIN_BATCH_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    return capacity;
+}
+
+// one tile texture for the whole screen, left unloaded if out of memory
+static void LoadDensityTiles(void) {
+    int width = (g_screenWidth + DENSITY_TILE_SIZE - 1)/DENSITY_TILE_SIZE;
+    int height = (g_screenHeight + DENSITY_TILE_SIZE - 1)/DENSITY_TILE_SIZE;
+    density.pixels = calloc(width*height, sizeof(Color));
+    density.sums = malloc(sizeof(float)*4*width*height);
+    if (density.pixels != NULL && density.sums != NULL) {
+        Image image = { density.pixels, width, height, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 };
+        density.texture = LoadTextureFromImage(image);
+        density.width = width;
+        density.height = height;
+    }
+    if (density.texture.id == 0) {
+        free(density.pixels);
+        free(density.sums);
+        density.pixels = NULL;
+        density.sums = NULL;
+    }
+}
+
+// must be called after InitWindow
+void InitRenderer(void) {
+    LoadDensityTiles();
+    int version = rlGetVersion();
+    if (version != RL_OPENGL_33 && version != RL_OPENGL_43) return;
+
+    circles.shader = LoadShaderFromMemory(circleVertexShader, circleFragmentShader);
+    lines.shader = LoadShaderFromMemory(lineVertexShader, lineFragmentShader);
+    // raylib hands back its default shader when compiling fails
+    if (GetShaderLocationAttrib(circles.shader, "instanceX") < 0 ||
+            GetShaderLocationAttrib(lines.shader, "vertexPosition") < 0) {
+        return;
+    }
+    circles.mvpLoc = GetShaderLocation(circles.shader, "mvp");
+    circles.alphaLoc = GetShaderLocation(circles.shader, "alpha");
+    lines.mvpLoc = GetShaderLocation(lines.shader, "mvp");
+    lines.colorLoc = GetShaderLocation(lines.shader, "lineColor");
+
+    LoadCircleBuffers(MIN_BATCH_CAPACITY);
+    if (!LoadLineBuffers(MIN_BATCH_CAPACITY)) return;
+    batchSupported = true;
+}
+
+void CloseRenderer(void) {
+    if (density.texture.id != 0) {
+        UnloadTexture(density.texture);
+        density.texture.id = 0;
+    }
+    free(density.pixels);
+    free(density.sums);
+    density.pixels = NULL;
+    density.sums = NULL;
+    free(circleList.x);
+    free(circleList.y);
+    free(circleList.radius);
+    free(circleList.colors);
+    circleList = (CircleList){ 0 };
+    if (!batchSupported) return;
+    UnloadCircleBuffers();
+    UnloadLineBuffers();
+    free(lines.vertices);
+    lines.vertices = NULL;
+    UnloadShader(circles.shader);
+    UnloadShader(lines.shader);
+    batchSupported = false;
+}
+
+bool IsBatchRenderingSupported(void) {
+    return batchSupported;
+}
+
+static Matrix GetModelViewProjection(void) {
+    return MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+}
+
+// draw count circles from the solver arrays with a single instanced call,
+// placing each alpha of the way from its old position to its current one
+bool DrawCirclesBatched(const float *x, const float *y, const float *oldX, const float *oldY,
+        float alpha, const float *radius, const Color *colors, int count) {
+    if (!batchSupported) return false;
+    if (count == 0) return true;
+    if (count > circles.capacity) {
+        LoadCircleBuffers(GrowCapacity(circles.capacity, count));
+    }
+    rlUpdateVertexBuffer(circles.xBuffer, x, count*sizeof(float), 0);
+    rlUpdateVertexBuffer(circles.yBuffer, y, count*sizeof(float), 0);
+    rlUpdateVertexBuffer(circles.oldXBuffer, oldX, count*sizeof(float), 0);
+    rlUpdateVertexBuffer(circles.oldYBuffer, oldY, count*sizeof(float), 0);
+    rlUpdateVertexBuffer(circles.radiusBuffer, radius, count*sizeof(float), 0);
+    rlUpdateVertexBuffer(circles.colorBuffer, colors, count*sizeof(Color), 0);
+
+    // flush raylib's own batch so draw order is preserved
+    rlDrawRenderBatchActive();
+    rlEnableShader(circles.shader.id);
+    rlSetUniformMatrix(circles.mvpLoc, GetModelViewProjection());
+    rlSetUniform(circles.alphaLoc, &alpha, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlEnableVertexArray(circles.vao);
+    rlDrawVertexArrayInstanced(0, 6, count);
+    rlDisableVertexArray();
+    rlDisableShader();
+    return true;
+}
+
+// start collecting up to count lines, returns false if batching is off
+bool BeginLineBatch(int count) {
+    if (!batchSupported) return false;
+    if (count > lines.capacity && !LoadLineBuffers(GrowCapacity(lines.capacity, count))) {
+        return false;
+    }
+    lines.count = 0;
+    return true;
+}
+
+// expand the segment into a quad of the given thickness
+void AddLineToBatch(Vector2 start, Vector2 end, float thick) {
+    Vector2 delta = { end.x - start.x, end.y - start.y };
+    float length = sqrtf(delta.x*delta.x + delta.y*delta.y);
+    if (length < 0.0001f) return;
+    Vector2 side = { -delta.y*thick*0.5f/length, delta.x*thick*0.5f/length };
+
+    float *v = lines.vertices + 12*lines.count;
+    v[0] = start.x - side.x; v[1] = start.y - side.y;
+    v[2] = start.x + side.x; v[3] = start.y + side.y;
+    v[4] = end.x + side.x;   v[5] = end.y + side.y;
+    v[6] = start.x - side.x; v[7] = start.y - side.y;
+    v[8] = end.x + side.x;   v[9] = end.y + side.y;
+    v[10] = end.x - side.x;  v[11] = end.y - side.y;
+    lines.count++;
+}
+
+void EndLineBatch(Color color) {
+    if (lines.count == 0) return;
+    rlUpdateVertexBuffer(lines.vertexBuffer, lines.vertices, lines.count*12*sizeof(float), 0);
+
+    float lineColor[4] = { color.r/255.0f, color.g/255.0f, color.b/255.0f, color.a/255.0f };
+    rlDrawRenderBatchActive();
+    rlEnableShader(lines.shader.id);
+    rlSetUniformMatrix(lines.mvpLoc, GetModelViewProjection());
+    rlSetUniform(lines.colorLoc, lineColor, RL_SHADER_UNIFORM_VEC4, 1);
+    rlEnableVertexArray(lines.vao);
+    rlDrawVertexArray(0, lines.count*6);
+    rlDisableVertexArray();
+    rlDisableShader();
+}
+
+// start collecting up to count circles, returns false if batching is off
+bool BeginCircleBatch(int count) {
+    if (!batchSupported) return false;
+    if (count > circleList.capacity) {
+        int capacity = GrowCapacity(circleList.capacity, count);
+        float *x = realloc(circleList.x, sizeof(float)*capacity);
+        if (x != NULL) circleList.x = x;
+        float *y = realloc(circleList.y, sizeof(float)*capacity);
+        if (y != NULL) circleList.y = y;
+        float *radius = realloc(circleList.radius, sizeof(float)*capacity);
+        if (radius != NULL) circleList.radius = radius;
+        Color *colors = realloc(circleList.colors, sizeof(Color)*capacity);
+        if (colors != NULL) circleList.colors = colors;
+        if (x == NULL || y == NULL || radius == NULL || colors == NULL) return false;
+        circleList.capacity = capacity;
+    }
+    circleList.count = 0;
+    return true;
+}
+
+void AddCircleToBatch(Vector2 pos, float radius, Color color) {
+    circleList.x[circleList.count] = pos.x;
+    circleList.y[circleList.count] = pos.y;
+    circleList.radius[circleList.count] = radius;
+    circleList.colors[circleList.count] = color;
+    circleList.count++;
+}
+
+void EndCircleBatch(void) {
+    DrawCirclesBatched(circleList.x, circleList.y, circleList.x, circleList.y, 1.0f, circleList.radius,
+            circleList.colors, circleList.count);
+}
+
+// start summing objects into tiles for the camera, returns false if there
+// is no tile texture
+bool BeginDensityTiles(Camera2D camera) {
+    if (density.texture.id == 0) return false;
+    Vector2 origin = GetWorldToScreen2D((Vector2){ 0, 0 }, camera);
+    Vector2 unitX = GetWorldToScreen2D((Vector2){ 1, 0 }, camera);
+    Vector2 unitY = GetWorldToScreen2D((Vector2){ 0, 1 }, camera);
+    float scale = 1.0f/DENSITY_TILE_SIZE;
+    density.origin = (Vector2){ origin.x*scale, origin.y*scale };
+    density.axisX = (Vector2){ (unitX.x - origin.x)*scale, (unitX.y - origin.y)*scale };
+    density.axisY = (Vector2){ (unitY.x - origin.x)*scale, (unitY.y - origin.y)*scale };
+    density.unitCoverage = PI*camera.zoom*camera.zoom*scale*scale;
+    density.camera = camera;
+    density.used = false;
+    return true;
+}
+
+// the tiles are only cleared once something is added to them
+void AddToDensityTiles(Vector2 pos, float radius, Color color) {
+    if (!density.used) {
+        memset(density.sums, 0, sizeof(float)*4*density.width*density.height);
+        density.used = true;
+    }
+    float x = density.origin.x + pos.x*density.axisX.x + pos.y*density.axisY.x;
+    float y = density.origin.y + pos.x*density.axisX.y + pos.y*density.axisY.y;
+    if (!(x >= 0 && y >= 0 && x < density.width && y < density.height)) return;
+    float *sum = density.sums + 4*((int)y*density.width + (int)x);
+    float coverage = density.unitCoverage*radius*radius*color.a/255.0f;
+    sum[0] += color.r*coverage;
+    sum[1] += color.g*coverage;
+    sum[2] += color.b*coverage;
+    sum[3] += coverage;
+}
+
+// Draw the tiles, if anything was added to them. They are laid over the
+// screen, so in the world they are turned back by the camera's rotation
+void EndDensityTiles(void) {
+    if (!density.used) return;
+    for (int t = 0; t < density.width*density.height; t++) {
+        const float *sum = density.sums + 4*t;
+        if (sum[3] > 0) {
+            density.pixels[t] = (Color){
+                (unsigned char)(sum[0]/sum[3]), (unsigned char)(sum[1]/sum[3]), (unsigned char)(sum[2]/sum[3]),
+                (unsigned char)(sum[3] < 1? 255*sum[3]: 255)
+            };
+        }
+        else {
+            density.pixels[t] = BLANK;
+        }
+    }
+    UpdateTexture(density.texture, density.pixels);
+    float zoom = density.camera.zoom;
+    Vector2 corner = GetScreenToWorld2D((Vector2){ 0, 0 }, density.camera);
+    Rectangle source = { 0, 0, (float)density.width, (float)density.height };
+    Rectangle dest = {
+        corner.x, corner.y, density.width*DENSITY_TILE_SIZE/zoom, density.height*DENSITY_TILE_SIZE/zoom
+    };
+    DrawTexturePro(density.texture, source, dest, (Vector2){ 0, 0 }, -density.camera.rotation, WHITE);
+}
@@ -0,0 +1,197 @@
+// Small fixed-size thread pool with work stealing. RunTasks() splits the
+// task indices into one range per thread. The workers and the calling
+// thread run their own range from the front, and once it is empty steal
+// the back half of what is left in another thread's range, so tasks of
+// very different cost still keep every thread busy. Taking a task and
+// stealing are each a single compare and swap on a range, poolMutex is
+// only taken to start a job and to wait for its end.
+// RunTasks() must only be called from one thread at a time. A task that
+// calls RunTasks() itself runs the nested tasks inline.
+#include <pthread.h>
+#include "common.h"
+
+#define MAX_THREADS 64
+#define CACHE_LINE 64
+
+// the next task in the upper 32 bits and the end in the lower 32, a line
+// each so threads taking from their own range don't contend
+typedef struct TaskRange {
+    uint64_t bounds;
+    char padding[CACHE_LINE - sizeof(uint64_t)];
+} TaskRange;
+
+static pthread_t workers[MAX_THREADS];
+static int numWorkers = 0;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static bool shuttingDown = false;
+
+// the job currently being run, set up under poolMutex. tasksDone is
+// counted atomically, activeWorkers are the workers inside the job
+static TaskFunc jobFunc;
+static void *jobData;
+static int jobTasks = 0;
+static int jobThreads = 0;
+static int tasksDone = 0;
+static int activeWorkers = 0;
+static unsigned int jobGeneration = 0;
+static TaskRange ranges[MAX_THREADS];
+
+static __thread bool insideTask = false;
+
+static uint64_t PackRange(uint32_t next, uint32_t end) {
+    return (uint64_t)next << 32 | end;
+}
+
+static bool TakeTask(TaskRange *range, int *task) {
+    uint64_t bounds = __atomic_load_n(&range->bounds, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t next = (uint32_t)(bounds >> 32);
+        uint32_t end = (uint32_t)bounds;
+        if (next >= end) return false;
+        if (__atomic_compare_exchange_n(&range->bounds, &bounds, PackRange(next + 1, end), false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *task = (int)next;
+            return true;
+        }
+    }
+}
+
+// Move the back half of another thread's range into the empty range of
+// thread self, trying the threads after it in turn. Returns false once
+// every range was found empty. Nothing refills a range once it is empty
+// but its owner stealing, so a thief can't lose tasks to a stale range
+static bool StealTasks(int self) {
+    for (int k = 1; k < jobThreads; k++) {
+        TaskRange *victim = &ranges[(self + k) % jobThreads];
+        uint64_t bounds = __atomic_load_n(&victim->bounds, __ATOMIC_ACQUIRE);
+        for (;;) {
+            uint32_t next = (uint32_t)(bounds >> 32);
+            uint32_t end = (uint32_t)bounds;
+            if (next >= end) break;
+            uint32_t middle = end - (end - next + 1)/2;
+            if (__atomic_compare_exchange_n(&victim->bounds, &bounds, PackRange(next, middle), false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&ranges[self].bounds, PackRange(middle, end), __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// run tasks as thread self until there are none left to take or steal
+static void RunJobTasks(int self) {
+    insideTask = true;
+    int task;
+    do {
+        while (TakeTask(&ranges[self], &task)) {
+            jobFunc(task, jobData);
+            if (__atomic_add_fetch(&tasksDone, 1, __ATOMIC_ACQ_REL) == jobTasks) {
+                pthread_mutex_lock(&poolMutex);
+                pthread_cond_signal(&doneCond);
+                pthread_mutex_unlock(&poolMutex);
+            }
+        }
+    } while (StealTasks(self));
+    insideTask = false;
+}
+
+static void *WorkerMain(void *arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned int seenGeneration = 0;
+    pthread_mutex_lock(&poolMutex);
+    seenGeneration = jobGeneration;
+    for (;;) {
+        while (!shuttingDown && jobGeneration == seenGeneration) {
+            pthread_cond_wait(&workCond, &poolMutex);
+        }
+        if (shuttingDown) break;
+        seenGeneration = jobGeneration;
+        // a worker waking after the job finished stays out of it, the
+        // next job may already be setting up the ranges
+        if (__atomic_load_n(&tasksDone, __ATOMIC_ACQUIRE) == jobTasks) continue;
+        activeWorkers++;
+        pthread_mutex_unlock(&poolMutex);
+        RunJobTasks(self);
+        pthread_mutex_lock(&poolMutex);
+        if (--activeWorkers == 0) {
+            pthread_cond_signal(&doneCond);
+        }
+    }
+    pthread_mutex_unlock(&poolMutex);
+    return NULL;
+}
+
+static void StopWorkers(void) {
+    pthread_mutex_lock(&poolMutex);
+    shuttingDown = true;
+    pthread_cond_broadcast(&workCond);
+    pthread_mutex_unlock(&poolMutex);
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    numWorkers = 0;
+    shuttingDown = false;
+}
+
+// numThreads counts the calling thread, so 1 runs everything inline.
+// If the platform cannot create threads the pool keeps what it got.
+void SetNumThreads(int numThreads) {
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > MAX_THREADS) numThreads = MAX_THREADS;
+    if (numThreads == numWorkers + 1) return;
+
+    StopWorkers();
+    for (int i = 0; i < numThreads - 1; i++) {
+        // range 0 is the calling thread's
+        void *self = (void *)(intptr_t)(numWorkers + 1);
+        if (pthread_create(&workers[numWorkers], NULL, WorkerMain, self) != 0) break;
+        numWorkers++;
+    }
+}
+
+int GetNumThreads(void) {
+    return numWorkers + 1;
+}
+
+bool IsInsideTask(void) {
+    return insideTask;
+}
+
+void RunTasks(TaskFunc func, int numTasks, void *data) {
+    if (numWorkers == 0 || numTasks <= 1 || insideTask) {
+        for (int i = 0; i < numTasks; i++) {
+            func(i, data);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&poolMutex);
+    jobFunc = func;
+    jobData = data;
+    jobTasks = numTasks;
+    jobThreads = numWorkers + 1;
+    for (int t = 0; t < jobThreads; t++) {
+        uint32_t start = (uint32_t)((int64_t)numTasks*t/jobThreads);
+        uint32_t end = (uint32_t)((int64_t)numTasks*(t + 1)/jobThreads);
+        __atomic_store_n(&ranges[t].bounds, PackRange(start, end), __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&tasksDone, 0, __ATOMIC_RELAXED);
+    jobGeneration++;
+    pthread_cond_broadcast(&workCond);
+    pthread_mutex_unlock(&poolMutex);
+
+    RunJobTasks(0);
+    pthread_mutex_lock(&poolMutex);
+    while (__atomic_load_n(&tasksDone, __ATOMIC_ACQUIRE) < jobTasks || activeWorkers > 0) {
+        pthread_cond_wait(&doneCond, &poolMutex);
+    }
+    pthread_mutex_unlock(&poolMutex);
+}
+
+void ShutdownThreads(void) {
+    StopWorkers();
+}
@@ -1,11 +1,17 @@
 // TODO: add a hide UI button
 // TODO: add 2 buttons, left and right arrows that switch between
 // spawning modes
+#include <math.h>
 #include "raylib.h"
+#include "raymath.h"
 #include "common.h"
 
 #define MAX_BUTTONS 32
 #define UNIT_SIZE 20
+// how far the camera zooms out and in, and by how much per wheel notch
+#define MIN_ZOOM 0.02f
+#define MAX_ZOOM 20.0f
+#define ZOOM_STEP 1.2f
 
 typedef struct Button {
     Rectangle rect;
@@ -31,10 +37,14 @@ static int sliderFocused = -1;
 
 // global variables to be affected by UI
 Vector2 g_mousePos;
+Camera2D g_camera = { { 0, 0 }, { 0, 0 }, 0, 1 };
+Vector2 g_mouseWorldPos;
 bool g_buttonPressed0 = false;
 float g_spawnRadius = 10;
 float g_spawnRate = 10;
 float g_gravity = 1000;
+float g_numThreads = 1;
+float g_physicsRate = TARGET_FPS*PHYSICS_SUBSTEPS;
 
 float g_red = 127;
 float g_green = 127;
@@ -42,6 +52,20 @@ float g_blue = 127;
 
 int g_structType;
 bool g_applyConstraint = true;
+bool g_batchRendering = true;
+bool g_jacobiLinks = false;
+bool g_adaptiveSteps = true;
+bool g_showProfiler = false;
+bool g_toggleTrace = false;
+bool g_showLevel = false;
+bool g_toggleLevel = false;
+bool g_spawnVolume = false;
+bool g_spawnVortex = false;
+bool g_clearFields = false;
+bool g_saveSnapshot = false;
+bool g_loadSnapshot = false;
+bool g_toggleRecording = false;
+bool g_toggleReplay = false;
 
 void CreateButton(Rectangle rect, char *label) {
     if (numButtons >= MAX_BUTTONS) return;
@@ -91,6 +115,10 @@ void InitUI(void) {
         "Green", &g_green, (Vector2){ 0, 255 });
     CreateSlider((Rectangle){ g_screenWidth - 230, 380, 200, 60 },
         "Blue", &g_blue, (Vector2){ 0, 255 });
+    CreateSlider((Rectangle){ g_screenWidth - 230, 480, 200, 60 },
+        "Threads", &g_numThreads, (Vector2){ 1, 16 });
+    CreateSlider((Rectangle){ g_screenWidth - 230, 580, 200, 60 },
+        "Physics Rate", &g_physicsRate, (Vector2){ 120, 960 });
 }
 
 void UpdateSlider(int sliderNum) {
@@ -151,6 +179,65 @@ void UpdateUI(void) {
             sliderFocused = buttonMouseHover - MAX_BUTTONS;
         }
     }
+    // hotkeys
+    if (IsKeyPressed(KEY_B)) {
+        g_batchRendering = !g_batchRendering;
+    }
+    if (IsKeyPressed(KEY_J)) {
+        g_jacobiLinks = !g_jacobiLinks;
+    }
+    if (IsKeyPressed(KEY_A)) {
+        g_adaptiveSteps = !g_adaptiveSteps;
+    }
+    if (IsKeyPressed(KEY_F5)) {
+        g_saveSnapshot = true;
+    }
+    if (IsKeyPressed(KEY_F9)) {
+        g_loadSnapshot = true;
+    }
+    if (IsKeyPressed(KEY_F6)) {
+        g_toggleRecording = true;
+    }
+    if (IsKeyPressed(KEY_F7)) {
+        g_toggleReplay = true;
+    }
+    if (IsKeyPressed(KEY_F3)) {
+        g_showProfiler = !g_showProfiler;
+    }
+    if (IsKeyPressed(KEY_F4)) {
+        g_toggleTrace = true;
+    }
+    if (IsKeyPressed(KEY_L)) {
+        g_showLevel = !g_showLevel;
+        g_toggleLevel = true;
+    }
+    if (IsKeyPressed(KEY_G)) {
+        g_spawnVolume = true;
+    }
+    if (IsKeyPressed(KEY_V)) {
+        g_spawnVortex = true;
+    }
+    if (IsKeyPressed(KEY_C)) {
+        g_clearFields = true;
+    }
+    // camera: the wheel zooms about the mouse, the middle button pans and
+    // Home goes back to the start
+    float wheel = GetMouseWheelMove();
+    if (wheel != 0 && !IsMouseOnUI()) {
+        Vector2 anchor = GetScreenToWorld2D(g_mousePos, g_camera);
+        g_camera.zoom = Clamp(g_camera.zoom*powf(ZOOM_STEP, wheel), MIN_ZOOM, MAX_ZOOM);
+        g_camera.offset = g_mousePos;
+        g_camera.target = anchor;
+    }
+    if (IsMouseButtonDown(MOUSE_BUTTON_MIDDLE)) {
+        Vector2 delta = GetMouseDelta();
+        g_camera.target.x -= delta.x/g_camera.zoom;
+        g_camera.target.y -= delta.y/g_camera.zoom;
+    }
+    if (IsKeyPressed(KEY_HOME)) {
+        g_camera = (Camera2D){ { 0, 0 }, { 0, 0 }, 0, 1 };
+    }
+    g_mouseWorldPos = GetScreenToWorld2D(g_mousePos, g_camera);
     if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
         sliderFocused = - 1;
     }
@@ -209,14 +296,61 @@ bool IsMouseOnUI(void) {
     return buttonMouseHover >= 0 || sliderFocused >= 0;
 }
 
-void DrawUI(void) {
+// per zone time per frame over the recent frames, and the counters of the
+// last frame
+void DrawProfiler(void) {
+    int x = g_screenWidth/2 - 200;
+    int y = 10;
+    DrawRectangle(x - 10, y - 5, 420, 20*(NUM_PROFILE_ZONES + NUM_PROFILE_COUNTERS + 2) + 10,
+            (Color){ 0, 0, 0, 160 });
+    DrawText(IsProfileTracing()? "Profile (F3), tracing (F4)": "Profile (F3), trace (F4)",
+            x, y, 16, IsProfileTracing()? RED: RAYWHITE);
+    DrawText("p50 ms     p99 ms", x + 240, y, 16, RAYWHITE);
+    y += 20;
+    for (int z = 0; z < NUM_PROFILE_ZONES; z++) {
+        DrawText(GetProfileZoneName(z), x, y, 16, RAYWHITE);
+        DrawText(TextFormat("%6.2f     %6.2f", GetProfilePercentile(z, 0.5f)*1000.0,
+                GetProfilePercentile(z, 0.99f)*1000.0), x + 240, y, 16, RAYWHITE);
+        y += 20;
+    }
+    y += 20;
+    for (int c = 0; c < NUM_PROFILE_COUNTERS; c++) {
+        DrawText(GetProfileCounterName(c), x, y, 16, RAYWHITE);
+        DrawText(TextFormat("%d", GetProfileCount(c)), x + 240, y, 16, RAYWHITE);
+        y += 20;
+    }
+}
+
+// the solver's numbers come from the state it last published
+void DrawUI(const PhysicsState *state) {
     DrawButtons();
     DrawSliders();
-    DrawText(TextFormat("Num Objects: %d", GetNumObjects()), 40, 680, 20, RAYWHITE);
+    DrawText(TextFormat("Num Objects: %d (%d asleep)", state->numObjects, state->numSleeping),
+            40, 680, 20, RAYWHITE);
+    DrawText(TextFormat("Threads: %d%s", state->numThreads, IsPhysicsThreaded()? " + physics": ""),
+            40, 710, 20, RAYWHITE);
+    // the slider sets the rate at PHYSICS_SUBSTEPS, the solver picks the rest
+    int substeps = state->substeps;
+    DrawText(TextFormat("Physics (A): %d Hz, %d x %d%s", (int)g_physicsRate/PHYSICS_SUBSTEPS*substeps,
+            substeps, state->iterations, g_adaptiveSteps? " adaptive": ""), 40, 770, 20, RAYWHITE);
+    DrawText(g_jacobiLinks? "Links (J): Jacobi": "Links (J): Gauss-Seidel", 40, 800, 20, RAYWHITE);
+    if (IsReplaying()) {
+        DrawText("Replaying (F7)", 40, 830, 20, RAYWHITE);
+    }
+    else if (state->recording) {
+        DrawText(TextFormat("Recording (F6), %d dropped", state->droppedFrames), 40, 830, 20, RED);
+    }
+    DrawText(g_batchRendering && IsBatchRenderingSupported()?
+            "Renderer (B): batched": "Renderer (B): immediate", 40, 740, 20, RAYWHITE);
     DrawRectangleRec((Rectangle){ g_screenWidth - 230, 40, 200, 100 }, (Color){ (int)g_red, (int)g_green, (int)g_blue, 255 });
     DrawText(g_structType == 0?
             "Ball": g_structType == 1?
             "Rope": g_structType == 2?
-            "Cloth":
+            "Cloth": g_structType == 3?
+            "Ring": g_structType == 4?
+            "Square":
             "N/A", g_structType == 0? 110: 100, 500, 20, RAYWHITE);
+    if (g_showProfiler) {
+        DrawProfiler();
+    }
 }
@@ -1,308 +1,2997 @@
 #include "raylib.h"
 #include "raymath.h"
 #include "common.h"
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define MAX_OBJECTS 4096
-#define MAX_LINKS 8192
+#define MIN_CAPACITY 1024
+#define MAX_GRID_CELLS 65536
+#define COLLISION_STRIP_WIDTH 2
+// links sharing no object get the same colour, links that find all
+// colours taken at both ends go to one extra group solved serially
+#define MAX_LINK_COLORS 32
+#define LINK_CHUNK_SIZE 512
+// a multiple of 32 so that no two chunks of a bulk spawn share a bitset word
+#define SPAWN_CHUNK_SIZE 4096
+// pressure bodies per task of the pressure pass
+#define BODY_CHUNK_SIZE 64
+// bodies squashed flatter than this fraction of their rest area push no
+// harder, so a crushed body can't blow up
+#define MIN_BODY_AREA 0.1f
+// default air pressure of the ready-made bodies, per pixel of perimeter
+#define SOFT_BODY_PRESSURE 4000.0f
+#define SOFT_BODY_COMPLIANCE 0.0001f
 
-static Vector2 gravity = { 0, 1000 };
+// frames between spatial sorts of the object arrays, the sort itself is
+// spread over SORT_STAGES frames
+#define SORT_INTERVAL 120
+#define SORT_RADIX_BITS 8
+#define SORT_STAGES (1 + 32/SORT_RADIX_BITS + 1)
 
-// TODO: Air pressure for hollow objects
-// TODO: maybe let joints be either in tension or compression
-typedef struct VerletObject {
-    Vector2 currentPos;
-    Vector2 oldPos;
-    Vector2 acceleration;
-    float radius;
-    Color color;
-    bool isStatic;
-    bool isColliding;
-} VerletObject;
+// objects moving slower than SLEEP_SPEED pixels per second for SLEEP_FRAMES
+// frames may fall asleep. Objects closer than SLEEP_MARGIN count as touching
+#define SLEEP_SPEED 20.0f
+// weight of the newest frame in the smoothed motion
+#define SLEEP_SMOOTHING 0.1f
+#define SLEEP_FRAMES 30
+#define SLEEP_MARGIN 1.0f
+#define ISLAND_WAKE 1
+#define ISLAND_RESTLESS 2
+
+// deepest overlap or largest link stretch, relative to the distance kept,
+// above which a step asks for more substeps and below which it gives one
+// back. Deep piles always keep some overlap, so these are generous
+#define ERROR_HIGH 0.25f
+#define ERROR_LOW 0.1f
+
+// Neighbour lists hold the pairs closer than their radii plus a skin of
+// NEIGHBOUR_SKIN times the largest radius, NEIGHBOUR_CAPACITY per object
+#define NEIGHBOUR_SKIN 0.3f
+#define NEIGHBOUR_CAPACITY 16
+#define NEIGHBOUR_CHUNK_SIZE 1024
+#define NEIGHBOUR_BACKOFF 8
+// the grid a published state bins its objects into for drawing, its cells
+// double in size until the grid fits in MAX_DRAW_CELLS
+#define DRAW_CELL_SIZE 64.0f
+#define MAX_DRAW_CELLS 65536
+// Force field grid: node spacing, doubled until the grid fits in the
+// node limit, and the rows built and objects sampled per task
+#define FIELD_CELL_SIZE 16.0f
+#define FIELD_MAX_NODES (1 << 18)
+#define FIELD_ROW_CHUNK 16
+#define FIELD_CHUNK_SIZE 4096
+// objects are swept once they move further than their radius in a
+// substep, and objects smaller than this once they move further than this
+#define SWEEP_MIN_TRAVEL 1.0f
+// passes of fast objects against each other, each settles one more object
+// of a chain that arrives together
+#define SWEEP_PASSES 4
+
+// 64 bit FNV-1a, applied to whole 32 bit words of the state
+#define STATE_HASH_BASIS 0xCBF29CE484222325ull
+#define STATE_HASH_PRIME 0x100000001B3ull
+
+#define SNAPSHOT_MAGIC "VRLT"
+#define SNAPSHOT_VERSION 3
+
+// what each collision strip found in the last pass
+typedef struct CollisionStats {
+    float overlap;
+    int pairTests;
+    int contacts;
+} CollisionStats;
+
+// Everything one simulation owns. Nothing in here is shared between
+// worlds, so separate worlds can be stepped on separate threads
+struct VerletWorld {
+    Vector2 gravity;
+
+    // Objects are stored as a structure of arrays so the integration, gravity
+    // and constraint passes only stream the fields they use. All arrays grow
+    // together in ReserveObjects()
+    float *posX;
+    float *posY;
+    float *oldX;
+    float *oldY;
+    // where the objects were when the last step began, drawing interpolates
+    // from here over the whole step rather than over its last substep
+    float *stepStartX;
+    float *stepStartY;
+    float *accX;
+    float *accY;
+    float *radii;
+    Color *colors;
+    uint32_t *staticBits;
+    // static or asleep, the solver passes leave these objects where they are
+    uint32_t *frozenBits;
+    uint32_t *collidingBits;
+    uint32_t *removedBits;
+    int *objectRemap;
+    int numObjects;
+    int numRemoved;
+    int objectCapacity;
+
+    // Sleeping: objects whose smoothed motion stayed low for SLEEP_FRAMES
+    // frames, together with everything they touch or are linked to, are
+    // frozen until something awake comes near them. islandId is the object
+    // the sleeping island was rooted at, islandParent is the union-find
+    // forest rebuilt every frame
+    uint32_t *sleepingBits;
+    uint8_t *quietFrames;
+    float *motion;
+    int *islandParent;
+    int *islandId;
+    uint8_t *islandFlags;
+    int numSleeping;
+    bool sleepEnabled;
+    bool wakeAll;
+
+    // per object link colours in use and Jacobi accumulators
+    uint32_t *objectLinkColors;
+    float *jacobiX;
+    float *jacobiY;
+    float *jacobiCount;
+
+    // Links are a structure of arrays as well, kept sorted by colour so each
+    // colour group is a contiguous range whose links share no object
+    int *linkObject1;
+    int *linkObject2;
+    float *linkDistance;
+    float *linkCompliance;
+    // a LinkMode, an int so snapshots keep every field 4 bytes wide
+    int *linkMode;
+    // XPBD multipliers of the substep in progress
+    float *linkLambda;
+    // scratch space for regrouping and for Jacobi corrections
+    int *linkOrder;
+    int *linkScratch1;
+    int *linkScratch2;
+    float *linkScratchDistance;
+    float *linkScratchCompliance;
+    int *linkScratchMode;
+    float *linkCorrectionX;
+    float *linkCorrectionY;
+    int numLinks;
+    int linkCapacity;
+    bool linksDirty;
+    int linkColorStart[MAX_LINK_COLORS + 2];
+    LinkSolver linkSolver;
+
+    // Pressure bodies: closed loops of objects with air inside. Body b lists
+    // its perimeter in order in bodyObjects from bodyStart[b], all bodies in
+    // one array. bodyArea is the area the last pressure pass measured, which
+    // the next pass pushes with, so each pass is a single sweep per body
+    int *bodyObjects;
+    int numBodyObjects;
+    int bodyObjectCapacity;
+    int *bodyStart;
+    int *bodyCount;
+    float *bodyRestArea;
+    float *bodyPressure;
+    float *bodyArea;
+    int numBodies;
+    int bodyCapacity;
+
+    float responseCoef;
+
+    // Force fields, slots of removed fields are reused. They are summed
+    // into a grid over their bounds, clipped to the world bounds, with an
+    // empty border so objects outside sample nothing. The grid is rebuilt
+    // the first substep after a field or the bounds changed
+    ForceField *fields;
+    bool *fieldUsed;
+    int numFieldSlots;
+    int numFields;
+    int fieldCapacity;
+    // four floats a node, the acceleration, the drag and one unused
+    float *fieldNodes;
+    int fieldNodeCapacity;
+    int fieldWidth;
+    int fieldHeight;
+    float fieldCellSize;
+    Vector2 fieldOrigin;
+    bool fieldsDirty;
+
+    // world settings, driven by the UI through the physics thread
+    bool constraintEnabled;
+    Vector2 constraintCenter;
+    float constraintRadius;
+    bool attractorActive;
+    Vector2 attractorPos;
+    // objects leaving these bounds are removed at the end of the frame
+    Rectangle worldBounds;
 
-typedef struct Link {
-    VerletObject *object1;
-    VerletObject *object2;
-    float target_distance;
-} Link;
+    // accumulated time spent in each solver pass since the last reset
+    double passTimes[NUM_SOLVER_PASSES];
+    int numSubsteps;
+    float lastStepTime;
 
-static VerletObject objects[MAX_OBJECTS];
-static int numObjects = 0;
+    // Adaptive substepping: every step passed to UpdateVerlet() is split into
+    // stepSubsteps substeps, each running the collision and link passes
+    // stepIterations times. AdaptSubsteps() moves both counts within their
+    // ranges from the error left after each step and the time it took
+    int minSubsteps;
+    int maxSubsteps;
+    int minIterations;
+    int maxIterations;
+    double stepBudget;
+    int stepSubsteps;
+    int stepIterations;
+    float stepError;
+
+    // Objects are periodically reordered along a Z-order curve over the grid
+    // cells, so objects close in space are close in memory. The radix sort of
+    // the first sortCount objects runs one stage per frame, see SortObjectsStep()
+    uint32_t *sortKeys;
+    uint32_t *sortKeysScratch;
+    int *sortOrder;
+    int *sortOrderScratch;
+    uint32_t *sortScratch;
+    int sortCount;
+    int sortStage;
+    int framesSinceSort;
+
+    // uniform grid broad phase, rebuilt before every collision pass. The
+    // cell table grows with the grid up to MAX_GRID_CELLS, so a small world
+    // only pays for the cells it covers
+    int *gridCellStart;
+    int gridCellCapacity;
+    int *gridCellObjects;
+    int *objectCell;
+    int gridWidth;
+    int gridHeight;
+    float gridCellSize;
+    Vector2 gridOrigin;
+    CollisionStats *stripStats;
+
+    // Verlet neighbour lists: each pair within reach is listed once, at its
+    // lower index, and the lists and grid are reused until an object has moved
+    // half the skin from where it was at the build. Objects with more pairs
+    // than fit have a count of -1 and search the grid cells instead
+    int *neighbours;
+    int *neighbourCount;
+    float *buildX;
+    float *buildY;
+    float neighbourSkin;
+    float gridSkin;
+    bool neighboursValid;
+    int neighbourObjects;
+    int neighbourPasses;
+    int neighbourBackoff;
+    int numRebuilds;
+    int numCollisionPasses;
+
+    // fast objects are swept along their path after every integration,
+    // sweepObjects lists the ones found in the substep
+    int *sweepObjects;
+    bool sweepEnabled;
+
+    // whether the passes are reported to the profiler and the frames to the
+    // recorder, both of which only follow one world at a time
+    bool profiled;
+    bool recorded;
+
+    // Deterministic mode: the passes run in a fixed order whatever the
+    // thread count, the step budget is ignored and every frame folds a hash
+    // of the state into stateHash
+    bool deterministic;
+    uint64_t stateHash;
+};
+
+// grow an array to newCapacity elements, zeroing the new part. The array
+// is left untouched if the allocation fails
+bool GrowArray(void **array, size_t elementSize, int oldCapacity, int newCapacity) {
+    void *grown = realloc(*array, elementSize*newCapacity);
+    if (grown == NULL) return false;
+    memset((char *)grown + elementSize*oldCapacity, 0, elementSize*(newCapacity - oldCapacity));
+    *array = grown;
+    return true;
+}
+
+// An empty world with the demo's settings: gravity pulling down, the
+// constraint circle in the middle of the screen and one substep per step.
+// Its arrays are allocated by the first spawn. Returns NULL if out of memory
+VerletWorld *CreateVerletWorld(void) {
+    VerletWorld *world = calloc(1, sizeof(VerletWorld));
+    if (world == NULL) return NULL;
+    world->gravity = (Vector2){ 0, 1000 };
+    world->sleepEnabled = true;
+    world->linkSolver = LINK_SOLVER_GAUSS_SEIDEL;
+    world->responseCoef = 1.0;
+    world->constraintEnabled = true;
+    world->constraintCenter = (Vector2){ (float)g_screenWidth/2, (float)g_screenHeight/2 };
+    world->constraintRadius = 400;
+    world->worldBounds = (Rectangle){
+        -g_screenWidth, -g_screenHeight, 3*g_screenWidth, 3*g_screenHeight
+    };
+    world->minSubsteps = 1;
+    world->maxSubsteps = 1;
+    world->minIterations = 1;
+    world->maxIterations = 1;
+    world->stepSubsteps = 1;
+    world->stepIterations = 1;
+    world->gridCellSize = 1;
+    world->neighbourSkin = NEIGHBOUR_SKIN;
+    world->sweepEnabled = true;
+    world->stateHash = STATE_HASH_BASIS;
+    return world;
+}
+
+void DestroyVerletWorld(VerletWorld *world) {
+    if (world == NULL) return;
+    void *arrays[] = {
+        world->posX, world->posY, world->oldX, world->oldY, world->stepStartX,
+        world->stepStartY, world->accX, world->accY, world->radii, world->colors, world->staticBits, world->frozenBits,
+        world->collidingBits, world->removedBits, world->objectRemap, world->sleepingBits,
+        world->quietFrames, world->motion, world->islandParent, world->islandId,
+        world->islandFlags, world->objectLinkColors, world->jacobiX, world->jacobiY,
+        world->jacobiCount, world->linkObject1, world->linkObject2, world->linkDistance,
+        world->linkCompliance, world->linkMode, world->linkLambda, world->linkOrder,
+        world->linkScratch1, world->linkScratch2, world->linkScratchDistance,
+        world->linkScratchCompliance, world->linkScratchMode, world->linkCorrectionX,
+        world->linkCorrectionY, world->bodyObjects, world->bodyStart, world->bodyCount,
+        world->bodyRestArea, world->bodyPressure, world->bodyArea, world->sortKeys,
+        world->sortKeysScratch, world->sortOrder, world->sortOrderScratch, world->sortScratch,
+        world->gridCellStart, world->gridCellObjects, world->objectCell, world->stripStats,
+        world->neighbours, world->neighbourCount, world->buildX, world->buildY, world->sweepObjects,
+        world->fields, world->fieldUsed, world->fieldNodes,
+    };
+    for (size_t i = 0; i < sizeof(arrays)/sizeof(arrays[0]); i++) {
+        free(arrays[i]);
+    }
+    free(world);
+}
+
+// make room for at least count objects, returns false if out of memory
+bool ReserveObjects(VerletWorld *world, int count) {
+    if (count <= world->objectCapacity) return true;
+    int capacity = world->objectCapacity > 0? world->objectCapacity: MIN_CAPACITY;
+    while (capacity < count) capacity *= 2;
+
+    int oldWords = BIT_WORDS(world->objectCapacity);
+    int words = BIT_WORDS(capacity);
+    bool ok =
+        GrowArray((void **)&world->posX, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->posY, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->oldX, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->oldY, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->stepStartX, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->stepStartY, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->accX, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->accY, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->radii, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->colors, sizeof(Color), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->objectRemap, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->gridCellObjects, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->objectCell, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->objectLinkColors, sizeof(uint32_t), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->jacobiX, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->jacobiY, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->jacobiCount, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->quietFrames, sizeof(uint8_t), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->motion, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->islandParent, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->islandId, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->islandFlags, sizeof(uint8_t), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->sortKeys, sizeof(uint32_t), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->sortKeysScratch, sizeof(uint32_t), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->sortOrder, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->sortOrderScratch, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->sortScratch, sizeof(uint32_t), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->neighbours, sizeof(int)*NEIGHBOUR_CAPACITY,
+                world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->neighbourCount, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->buildX, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->buildY, sizeof(float), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->sweepObjects, sizeof(int), world->objectCapacity, capacity) &&
+        GrowArray((void **)&world->staticBits, sizeof(uint32_t), oldWords, words) &&
+        GrowArray((void **)&world->collidingBits, sizeof(uint32_t), oldWords, words) &&
+        GrowArray((void **)&world->frozenBits, sizeof(uint32_t), oldWords, words) &&
+        GrowArray((void **)&world->sleepingBits, sizeof(uint32_t), oldWords, words) &&
+        GrowArray((void **)&world->removedBits, sizeof(uint32_t), oldWords, words);
+    // arrays that did grow keep their new size, only the capacity that
+    // every array reached is recorded
+    if (ok) world->objectCapacity = capacity;
+    return ok;
+}
 
-static Link links[MAX_LINKS];
-static int numLinks = 0;
+bool ReserveLinks(VerletWorld *world, int count) {
+    if (count <= world->linkCapacity) return true;
+    int capacity = world->linkCapacity > 0? world->linkCapacity: MIN_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    bool ok =
+        GrowArray((void **)&world->linkObject1, sizeof(int), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkObject2, sizeof(int), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkDistance, sizeof(float), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkCompliance, sizeof(float), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkMode, sizeof(int), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkLambda, sizeof(float), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkOrder, sizeof(int), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkScratch1, sizeof(int), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkScratch2, sizeof(int), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkScratchDistance, sizeof(float), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkScratchCompliance, sizeof(float), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkScratchMode, sizeof(int), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkCorrectionX, sizeof(float), world->linkCapacity, capacity) &&
+        GrowArray((void **)&world->linkCorrectionY, sizeof(float), world->linkCapacity, capacity);
+    if (ok) world->linkCapacity = capacity;
+    return ok;
+}
 
-static float responseCoef = 1.0;
+void AddLink(VerletWorld *world, int object1, int object2, float distance, float compliance,
+        LinkMode mode) {
+    world->linkObject1[world->numLinks] = object1;
+    world->linkObject2[world->numLinks] = object2;
+    world->linkDistance[world->numLinks] = distance;
+    world->linkCompliance[world->numLinks] = compliance;
+    world->linkMode[world->numLinks] = mode;
+    world->linkLambda[world->numLinks] = 0;
+    world->numLinks++;
+    world->linksDirty = true;
+}
 
 // generate a link between the given positions starting from the
 // end of the objects array
 // Must be done before spawning verlet objects
-void SpawnLink(int pos1, int pos2, float distance) {
-        links[numLinks] = (Link) {
-            &objects[numObjects + pos1],
-            &objects[numObjects + pos2],
-            distance
-        };
-        numLinks++;
-}
-
-void SpawnVerletObject(Vector2 position, float radius, Color color) {
-    if (numObjects >= MAX_OBJECTS) return;
-    VerletObject *ball = &objects[numObjects];
-    ball->currentPos = position;
-    ball->oldPos = position;
-    ball->radius = radius;
-    ball->color = color;
-    ball->isStatic = false;
-    ball->isColliding = true;
-    numObjects++;
-}
-
-void SpawnVerletObjectStatic(Vector2 position, float radius, Color color) {
-    if (numObjects >= MAX_OBJECTS) return;
-    VerletObject *ball = &objects[numObjects];
-    ball->currentPos = position;
-    ball->oldPos = position;
-    ball->radius = radius;
-    ball->color = color;
-    ball->isStatic = true;
-    ball->isColliding = true;
-    numObjects++;
-}
-
-void SpawnVerletObjectNonColliding(Vector2 position, float radius, Color color) {
-    if (numObjects >= MAX_OBJECTS) return;
-    VerletObject *ball = &objects[numObjects];
-    ball->currentPos = position;
-    ball->oldPos = position;
-    ball->radius = radius;
-    ball->color = color;
-    ball->isStatic = false;
-    ball->isColliding = false;
-    numObjects++;
-}
-
-void SpawnStructureRope(Vector2 pos, int numJoints, float distance,
+void SpawnLink(VerletWorld *world, int pos1, int pos2, float distance, float compliance, LinkMode mode) {
+    if (!ReserveLinks(world, world->numLinks + 1)) return;
+    AddLink(world, world->numObjects + pos1, world->numObjects + pos2, distance, compliance, mode);
+}
+
+// link two existing objects at the distance they are at now
+bool SpawnVerletLink(VerletWorld *world, int object1, int object2, float compliance, LinkMode mode) {
+    if (object1 < 0 || object1 >= world->numObjects) return false;
+    if (object2 < 0 || object2 >= world->numObjects) return false;
+    if (object1 == object2 || compliance < 0 || (mode & LINK_BOTH) == 0) return false;
+    if (!ReserveLinks(world, world->numLinks + 1)) return false;
+    float dx = world->posX[object1] - world->posX[object2];
+    float dy = world->posY[object1] - world->posY[object2];
+    AddLink(world, object1, object2, sqrtf(dx*dx + dy*dy), compliance, mode & LINK_BOTH);
+    // a sleeping island gains a link it has to settle
+    world->wakeAll = world->wakeAll ||
+        TEST_BIT(world->sleepingBits, object1) || TEST_BIT(world->sleepingBits, object2);
+    return true;
+}
+
+// fill slot i, which must already be reserved
+void WriteObject(VerletWorld *world, int i, const VerletObjectDesc *object) {
+    world->posX[i] = object->pos.x;
+    world->posY[i] = object->pos.y;
+    world->oldX[i] = object->pos.x;
+    world->oldY[i] = object->pos.y;
+    world->stepStartX[i] = object->pos.x;
+    world->stepStartY[i] = object->pos.y;
+    world->accX[i] = 0;
+    world->accY[i] = 0;
+    world->radii[i] = object->radius;
+    world->colors[i] = object->color;
+    WRITE_BIT(world->staticBits, i, object->isStatic);
+    WRITE_BIT(world->collidingBits, i, object->isColliding);
+    WRITE_BIT(world->removedBits, i, false);
+    WRITE_BIT(world->sleepingBits, i, false);
+    world->quietFrames[i] = 0;
+}
+
+void SpawnObject(VerletWorld *world, Vector2 position, float radius, Color color,
+        bool isStatic, bool isColliding) {
+    if (!ReserveObjects(world, world->numObjects + 1)) return;
+    VerletObjectDesc object = { position, radius, color, isStatic, isColliding };
+    WriteObject(world, world->numObjects, &object);
+    world->numObjects++;
+}
+
+void SpawnVerletObject(VerletWorld *world, Vector2 position, float radius, Color color) {
+    SpawnObject(world, position, radius, color, false, true);
+}
+
+void SpawnVerletObjectStatic(VerletWorld *world, Vector2 position, float radius, Color color) {
+    SpawnObject(world, position, radius, color, true, true);
+}
+
+void SpawnVerletObjectNonColliding(VerletWorld *world, Vector2 position, float radius, Color color) {
+    SpawnObject(world, position, radius, color, false, false);
+}
+
+bool ReserveVerlet(VerletWorld *world, int objects, int links) {
+    if (objects < 0 || links < 0 || objects > INT32_MAX/2 - world->numObjects ||
+            links > INT32_MAX/2 - world->numLinks) {
+        return false;
+    }
+    return ReserveObjects(world, world->numObjects + objects) && ReserveLinks(world, world->numLinks + links);
+}
+
+// one bulk spawn in progress, first and count are the slots being filled
+typedef struct SpawnBatch {
+    VerletWorld *world;
+    ObjectGenerator objectGenerator;
+    LinkGenerator linkGenerator;
+    void *data;
+    int first;
+    int count;
+    int firstObject;
+} SpawnBatch;
+
+// Chunks start at multiples of SPAWN_CHUNK_SIZE counted from the bitset
+// word the batch starts in, so each bitset word belongs to a single chunk
+int CountSpawnChunks(const SpawnBatch *batch) {
+    int base = batch->first & ~31;
+    return (batch->first + batch->count - base + SPAWN_CHUNK_SIZE - 1)/SPAWN_CHUNK_SIZE;
+}
+
+void GenerateObjectChunk(int task, void *data) {
+    SpawnBatch *batch = data;
+    VerletWorld *world = batch->world;
+    int base = (batch->first & ~31) + task*SPAWN_CHUNK_SIZE;
+    int start = base > batch->first? base: batch->first;
+    int end = base + SPAWN_CHUNK_SIZE < batch->first + batch->count?
+        base + SPAWN_CHUNK_SIZE: batch->first + batch->count;
+    for (int i = start; i < end; i++) {
+        VerletObjectDesc object = { { 0, 0 }, 0, BLANK, false, true };
+        batch->objectGenerator(i - batch->first, batch->data, &object);
+        WriteObject(world, i, &object);
+    }
+}
+
+int GenerateVerletObjects(VerletWorld *world, ObjectGenerator generator, void *data, int count) {
+    if (count <= 0) return world->numObjects;
+    if (!ReserveVerlet(world, count, 0)) return -1;
+    SpawnBatch batch = { world, generator, NULL, data, world->numObjects, count, 0 };
+    RunTasks(GenerateObjectChunk, CountSpawnChunks(&batch), &batch);
+    world->numObjects += count;
+    return batch.first;
+}
+
+void CopyObjectDesc(int index, void *data, VerletObjectDesc *object) {
+    *object = ((const VerletObjectDesc *)data)[index];
+}
+
+int SpawnVerletObjects(VerletWorld *world, const VerletObjectDesc *objects, int count) {
+    return GenerateVerletObjects(world, CopyObjectDesc, (void *)objects, count);
+}
+
+// links that don't fit the objects are written with mode 0 and dropped
+// afterwards, a negative distance takes the distance the objects are at
+void GenerateLinkChunk(int task, void *data) {
+    SpawnBatch *batch = data;
+    VerletWorld *world = batch->world;
+    int start = batch->first + task*SPAWN_CHUNK_SIZE;
+    int end = start + SPAWN_CHUNK_SIZE < batch->first + batch->count?
+        start + SPAWN_CHUNK_SIZE: batch->first + batch->count;
+    for (int l = start; l < end; l++) {
+        VerletLinkDesc link = { 0, 0, -1, 0, LINK_TENSION };
+        batch->linkGenerator(l - batch->first, batch->data, &link);
+        int obj1 = batch->firstObject + link.object1;
+        int obj2 = batch->firstObject + link.object2;
+        bool valid = link.object1 >= 0 && link.object2 >= 0 && link.object1 != link.object2 &&
+            obj1 < world->numObjects && obj2 < world->numObjects && link.compliance >= 0;
+        float distance = link.distance;
+        if (valid && distance < 0) {
+            float dx = world->posX[obj1] - world->posX[obj2];
+            float dy = world->posY[obj1] - world->posY[obj2];
+            distance = sqrtf(dx*dx + dy*dy);
+        }
+        world->linkObject1[l] = valid? obj1: 0;
+        world->linkObject2[l] = valid? obj2: 0;
+        world->linkDistance[l] = distance;
+        world->linkCompliance[l] = link.compliance;
+        world->linkMode[l] = valid? link.mode & LINK_BOTH: 0;
+        world->linkLambda[l] = 0;
+    }
+}
+
+int GenerateVerletLinks(VerletWorld *world, LinkGenerator generator, void *data, int count,
+        int firstObject) {
+    if (count <= 0 || firstObject < 0 || firstObject > world->numObjects) return 0;
+    if (!ReserveVerlet(world, 0, count)) return 0;
+    SpawnBatch batch = { world, NULL, generator, data, world->numLinks, count, firstObject };
+    RunTasks(GenerateLinkChunk, (count + SPAWN_CHUNK_SIZE - 1)/SPAWN_CHUNK_SIZE, &batch);
+    int kept = world->numLinks;
+    bool wake = false;
+    for (int l = world->numLinks; l < world->numLinks + count; l++) {
+        if (world->linkMode[l] == 0) continue;
+        // a sleeping island gains a link it has to settle
+        wake = wake || TEST_BIT(world->sleepingBits, world->linkObject1[l]) ||
+            TEST_BIT(world->sleepingBits, world->linkObject2[l]);
+        world->linkObject1[kept] = world->linkObject1[l];
+        world->linkObject2[kept] = world->linkObject2[l];
+        world->linkDistance[kept] = world->linkDistance[l];
+        world->linkCompliance[kept] = world->linkCompliance[l];
+        world->linkMode[kept] = world->linkMode[l];
+        kept++;
+    }
+    int spawned = kept - world->numLinks;
+    world->numLinks = kept;
+    world->linksDirty = world->linksDirty || spawned > 0;
+    world->wakeAll = world->wakeAll || wake;
+    return spawned;
+}
+
+void CopyLinkDesc(int index, void *data, VerletLinkDesc *link) {
+    *link = ((const VerletLinkDesc *)data)[index];
+}
+
+int SpawnVerletLinks(VerletWorld *world, const VerletLinkDesc *links, int count, int firstObject) {
+    return GenerateVerletLinks(world, CopyLinkDesc, (void *)links, count, firstObject);
+}
+
+void SpawnStructureRope(VerletWorld *world, Vector2 pos, int numJoints, float distance,
         float radius, Anchoring anchoring, Color color) {
-    if (numObjects + numJoints >= MAX_OBJECTS) return;
-    if (numLinks + numJoints - 1 >= MAX_LINKS) return;
+    if (!ReserveObjects(world, world->numObjects + numJoints)) return;
+    if (!ReserveLinks(world, world->numLinks + numJoints - 1)) return;
     // joints are too big
     if (radius > distance/2) return;
 
     // creating links
     for (int i = 0; i < numJoints - 1; i++) {
-        SpawnLink(i, i + 1, distance);
+        SpawnLink(world, i, i + 1, distance, 0, LINK_TENSION);
     }
 
     // spawning objects for rope
     if (anchoring == FIRST || anchoring == BOTH) {
-        SpawnVerletObjectStatic(pos, radius, color);
+        SpawnVerletObjectStatic(world, pos, radius, color);
     }
     else {
-        SpawnVerletObject(pos, radius, color);
+        SpawnVerletObject(world, pos, radius, color);
     }
     for (int i = 1; i < numJoints - 1; i++) {
-        SpawnVerletObject((Vector2){ pos.x + i*distance, pos.y }, radius, color);
+        SpawnVerletObject(world, (Vector2){ pos.x + i*distance, pos.y }, radius, color);
     }
     if (anchoring == LAST || anchoring == BOTH) {
-        SpawnVerletObjectStatic(
+        SpawnVerletObjectStatic(world,
                 (Vector2){ pos.x + (numJoints - 1)*distance, pos.y },
                 radius, color);
     }
     else {
-        SpawnVerletObject(
+        SpawnVerletObject(world,
                 (Vector2){ pos.x + (numJoints - 1)*distance, pos.y },
                 radius, color);
     }
 }
 
-int XYToNum(int x, int y, int width) {
-    return y*width + x;
+typedef struct ClothDesc {
+    Vector2 pos;
+    int numSideJoints;
+    float distance;
+    float radius;
+    Color color;
+} ClothDesc;
+
+// joints row by row, the two top corners anchored
+void GenerateClothJoint(int index, void *data, VerletObjectDesc *object) {
+    const ClothDesc *cloth = data;
+    int row = index/cloth->numSideJoints;
+    int column = index % cloth->numSideJoints;
+    bool anchored = row == 0 && (column == 0 || column == cloth->numSideJoints - 1);
+    object->pos = (Vector2){
+        cloth->pos.x + column*cloth->distance - (anchored? 5: 0),
+        cloth->pos.y + row*cloth->distance
+    };
+    object->radius = cloth->radius;
+    object->color = cloth->color;
+    object->isStatic = anchored;
+    object->isColliding = anchored;
+}
+
+// n*(n - 1) links along the rows, then as many down the columns
+void GenerateClothLink(int index, void *data, VerletLinkDesc *link) {
+    const ClothDesc *cloth = data;
+    int n = cloth->numSideJoints;
+    int half = n*(n - 1);
+    if (index < half) {
+        link->object1 = index/(n - 1)*n + index % (n - 1);
+        link->object2 = link->object1 + 1;
+    }
+    else {
+        link->object1 = index - half;
+        link->object2 = link->object1 + n;
+    }
+    link->distance = cloth->distance;
+    link->compliance = 0;
+    link->mode = LINK_TENSION;
 }
 
-void SpawnStructureCloth(Vector2 pos, int numSideJoints, float distance,
+void SpawnStructureCloth(VerletWorld *world, Vector2 pos, int numSideJoints, float distance,
         float radius, Color color) {
-    if (numObjects + numSideJoints*numSideJoints >= MAX_OBJECTS) return;
-    if (numLinks + numSideJoints*numSideJoints*2 >= MAX_LINKS) return;
-
-    for (int i = 0; i < numSideJoints; i++) {
-        for (int j = 0; j < numSideJoints; j++) {
-            if (i < numSideJoints - 1) {
-                SpawnLink(
-                        XYToNum(i, j, numSideJoints),
-                        XYToNum(i + 1, j, numSideJoints),
-                        distance);
-            }
-            if (j < numSideJoints - 1) {
-                SpawnLink(
-                        XYToNum(i, j, numSideJoints),
-                        XYToNum(i, j + 1, numSideJoints),
-                        distance);
-            }
+    if (numSideJoints < 2) return;
+    int numJoints = numSideJoints*numSideJoints;
+    if (!ReserveVerlet(world, numJoints, 2*numSideJoints*(numSideJoints - 1))) return;
+    ClothDesc cloth = { pos, numSideJoints, distance, radius, color };
+    int first = GenerateVerletObjects(world, GenerateClothJoint, &cloth, numJoints);
+    GenerateVerletLinks(world, GenerateClothLink, &cloth, 2*numSideJoints*(numSideJoints - 1), first);
+}
+
+bool ReserveBodies(VerletWorld *world, int bodies, int objects) {
+    if (bodies > world->bodyCapacity) {
+        int capacity = world->bodyCapacity > 0? world->bodyCapacity: MIN_CAPACITY;
+        while (capacity < bodies) capacity *= 2;
+        bool ok =
+            GrowArray((void **)&world->bodyStart, sizeof(int), world->bodyCapacity, capacity) &&
+            GrowArray((void **)&world->bodyCount, sizeof(int), world->bodyCapacity, capacity) &&
+            GrowArray((void **)&world->bodyRestArea, sizeof(float), world->bodyCapacity, capacity) &&
+            GrowArray((void **)&world->bodyPressure, sizeof(float), world->bodyCapacity, capacity) &&
+            GrowArray((void **)&world->bodyArea, sizeof(float), world->bodyCapacity, capacity);
+        if (!ok) return false;
+        world->bodyCapacity = capacity;
+    }
+    if (objects > world->bodyObjectCapacity) {
+        int capacity = world->bodyObjectCapacity > 0? world->bodyObjectCapacity: MIN_CAPACITY;
+        while (capacity < objects) capacity *= 2;
+        bool ok = GrowArray((void **)&world->bodyObjects, sizeof(int),
+                world->bodyObjectCapacity, capacity);
+        if (!ok) return false;
+        world->bodyObjectCapacity = capacity;
+    }
+    return true;
+}
+
+// signed area of body b, positive if its loop runs the way the pressure
+// pass takes as outward
+float MeasureBodyArea(VerletWorld *world, int b) {
+    const int *objects = world->bodyObjects + world->bodyStart[b];
+    int count = world->bodyCount[b];
+    float area = 0;
+    for (int k = 0; k < count; k++) {
+        int i = objects[k];
+        int next = objects[k < count - 1? k + 1: 0];
+        area += world->posX[i]*world->posY[next] - world->posX[next]*world->posY[i];
+    }
+    return area/2;
+}
+
+typedef struct SoftBodyDesc {
+    const Vector2 *points;
+    int count;
+    float radius;
+    float compliance;
+    Color color;
+} SoftBodyDesc;
+
+void GenerateSoftBodyJoint(int index, void *data, VerletObjectDesc *object) {
+    const SoftBodyDesc *body = data;
+    object->pos = body->points[index];
+    object->radius = body->radius;
+    object->color = body->color;
+}
+
+void GenerateSoftBodyLink(int index, void *data, VerletLinkDesc *link) {
+    const SoftBodyDesc *body = data;
+    link->object1 = index;
+    link->object2 = index < body->count - 1? index + 1: 0;
+    link->compliance = body->compliance;
+    link->mode = LINK_BOTH;
+}
+
+int SpawnSoftBody(VerletWorld *world, const Vector2 *points, int count, float radius, float pressure,
+        float compliance, Color color) {
+    if (count < 3 || compliance < 0) return -1;
+    if (!ReserveVerlet(world, count, count)) return -1;
+    if (!ReserveBodies(world, world->numBodies + 1, world->numBodyObjects + count)) return -1;
+    SoftBodyDesc body = { points, count, radius, compliance, color };
+    int first = GenerateVerletObjects(world, GenerateSoftBodyJoint, &body, count);
+    if (first < 0) return -1;
+    GenerateVerletLinks(world, GenerateSoftBodyLink, &body, count, first);
+
+    int b = world->numBodies++;
+    world->bodyStart[b] = world->numBodyObjects;
+    world->bodyCount[b] = count;
+    for (int k = 0; k < count; k++) {
+        world->bodyObjects[world->numBodyObjects++] = first + k;
+    }
+    world->bodyArea[b] = MeasureBodyArea(world, b);
+    world->bodyRestArea[b] = world->bodyArea[b];
+    world->bodyPressure[b] = pressure;
+    return first;
+}
+
+// the perimeter of a body is kept on the stack up to this many joints
+#define MAX_SHAPE_JOINTS 256
+
+void SpawnStructureRing(VerletWorld *world, Vector2 center, float ringRadius, int numJoints,
+        float radius, float pressure, Color color) {
+    if (numJoints < 3 || numJoints > MAX_SHAPE_JOINTS) return;
+    Vector2 points[MAX_SHAPE_JOINTS];
+    for (int k = 0; k < numJoints; k++) {
+        float angle = 2*PI*k/numJoints;
+        points[k] = (Vector2){ center.x + ringRadius*cosf(angle), center.y + ringRadius*sinf(angle) };
+    }
+    SpawnSoftBody(world, points, numJoints, radius, pressure, SOFT_BODY_COMPLIANCE, color);
+}
+
+// joints about two radii apart around a square with its top left at pos
+void SpawnStructureSquare(VerletWorld *world, Vector2 pos, float length, float radius, Color color) {
+    int perSide = (int)(length/(2*radius + 1));
+    if (perSide < 1) perSide = 1;
+    if (4*perSide > MAX_SHAPE_JOINTS) perSide = MAX_SHAPE_JOINTS/4;
+    float spacing = length/perSide;
+    Vector2 points[MAX_SHAPE_JOINTS];
+    for (int k = 0; k < perSide; k++) {
+        points[k] = (Vector2){ pos.x + k*spacing, pos.y };
+        points[perSide + k] = (Vector2){ pos.x + length, pos.y + k*spacing };
+        points[2*perSide + k] = (Vector2){ pos.x + length - k*spacing, pos.y + length };
+        points[3*perSide + k] = (Vector2){ pos.x, pos.y + length - k*spacing };
+    }
+    SpawnSoftBody(world, points, 4*perSide, radius, SOFT_BODY_PRESSURE, SOFT_BODY_COMPLIANCE, color);
+}
+
+// a ring whose radius wobbles by a few random waves around it
+void SpawnStructureBlob(VerletWorld *world, Vector2 center, float size, float radius, float pressure,
+        Color color, unsigned int seed) {
+    int numJoints = (int)(2*PI*size/(2*radius + 1));
+    if (numJoints < 3) numJoints = 3;
+    if (numJoints > MAX_SHAPE_JOINTS) numJoints = MAX_SHAPE_JOINTS;
+    unsigned int state = seed? seed: 1;
+    float phases[3];
+    for (int w = 0; w < 3; w++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        phases[w] = 2*PI*(float)(state & 0xFFFF)/0xFFFF;
+    }
+    Vector2 points[MAX_SHAPE_JOINTS];
+    for (int k = 0; k < numJoints; k++) {
+        float angle = 2*PI*k/numJoints;
+        float r = size*(1 + 0.15f*sinf(2*angle + phases[0]) + 0.1f*sinf(3*angle + phases[1])
+                + 0.05f*sinf(5*angle + phases[2]));
+        points[k] = (Vector2){ center.x + r*cosf(angle), center.y + r*sinf(angle) };
+    }
+    SpawnSoftBody(world, points, numJoints, radius, pressure, SOFT_BODY_COMPLIANCE, color);
+}
+
+int GetNumSoftBodies(VerletWorld *world) {
+    return world->numBodies;
+}
+
+// Greedy graph colouring: every link takes the lowest colour not yet used
+// by a link at either of its objects. The links are then counting sorted
+// by colour, so each colour is a contiguous range of independent links
+void ColorLinks(VerletWorld *world) {
+    int counts[MAX_LINK_COLORS + 1] = { 0 };
+    memset(world->objectLinkColors, 0, sizeof(uint32_t)*world->numObjects);
+    for (int l = 0; l < world->numLinks; l++) {
+        uint32_t used = world->objectLinkColors[world->linkObject1[l]] |
+            world->objectLinkColors[world->linkObject2[l]];
+        int color = 0;
+        while (color < MAX_LINK_COLORS && (used & (1u << color))) color++;
+        if (color < MAX_LINK_COLORS) {
+            world->objectLinkColors[world->linkObject1[l]] |= 1u << color;
+            world->objectLinkColors[world->linkObject2[l]] |= 1u << color;
         }
+        world->linkOrder[l] = color;
+        counts[color]++;
     }
 
-    for (int i = 0; i < numSideJoints; i++) {
-        for (int j = 0; j < numSideJoints; j++) {
-            // anchor the two top corners
-            if ((i == 0 && j == 0) || (i == 0 && j == numSideJoints - 1)) {
-                SpawnVerletObjectStatic(
-                        (Vector2){ pos.x + j*distance - 5, pos.y + i*distance },
-                        radius, color);
-            }
-            else {
-                SpawnVerletObjectNonColliding(
-                        (Vector2){ pos.x + j*distance, pos.y + i*distance },
-                        radius, color);
+    world->linkColorStart[0] = 0;
+    for (int c = 0; c <= MAX_LINK_COLORS; c++) {
+        world->linkColorStart[c + 1] = world->linkColorStart[c] + counts[c];
+        counts[c] = world->linkColorStart[c];
+    }
+    for (int l = 0; l < world->numLinks; l++) {
+        int dst = counts[world->linkOrder[l]]++;
+        world->linkScratch1[dst] = world->linkObject1[l];
+        world->linkScratch2[dst] = world->linkObject2[l];
+        world->linkScratchDistance[dst] = world->linkDistance[l];
+        world->linkScratchCompliance[dst] = world->linkCompliance[l];
+        world->linkScratchMode[dst] = world->linkMode[l];
+    }
+
+    int *swapObjects = world->linkObject1;
+    world->linkObject1 = world->linkScratch1;
+    world->linkScratch1 = swapObjects;
+    swapObjects = world->linkObject2;
+    world->linkObject2 = world->linkScratch2;
+    world->linkScratch2 = swapObjects;
+    float *swapDistance = world->linkDistance;
+    world->linkDistance = world->linkScratchDistance;
+    world->linkScratchDistance = swapDistance;
+    swapDistance = world->linkCompliance;
+    world->linkCompliance = world->linkScratchCompliance;
+    world->linkScratchCompliance = swapDistance;
+    int *swapMode = world->linkMode;
+    world->linkMode = world->linkScratchMode;
+    world->linkScratchMode = swapMode;
+}
+
+// alphaScale is 1/dt^2 of the substep, see SolveLinksScalar()
+typedef struct LinkRange {
+    VerletWorld *world;
+    int start;
+    int end;
+    float alphaScale;
+} LinkRange;
+
+LinkArrays GetLinkArrays(VerletWorld *world) {
+    return (LinkArrays){
+        world->linkObject1, world->linkObject2, world->linkDistance,
+        world->linkCompliance, world->linkMode, world->linkLambda
+    };
+}
+
+void SolveLinkChunk(int task, void *data) {
+    LinkRange *range = data;
+    VerletWorld *world = range->world;
+    int start = range->start + task*LINK_CHUNK_SIZE;
+    int end = start + LINK_CHUNK_SIZE < range->end? start + LINK_CHUNK_SIZE: range->end;
+    SolveLinksKernel(world->posX, world->posY, world->radii, world->frozenBits, GetLinkArrays(world),
+            start, end, range->alphaScale);
+}
+
+int CountLinkChunks(LinkRange range) {
+    return (range.end - range.start + LINK_CHUNK_SIZE - 1)/LINK_CHUNK_SIZE;
+}
+
+void ComputeLinkCorrectionsChunk(int task, void *data) {
+    LinkRange *range = data;
+    VerletWorld *world = range->world;
+    int start = range->start + task*LINK_CHUNK_SIZE;
+    int end = start + LINK_CHUNK_SIZE < range->end? start + LINK_CHUNK_SIZE: range->end;
+    LinkCorrectionsKernel(world->posX, world->posY, world->radii, world->frozenBits, GetLinkArrays(world),
+            world->linkCorrectionX, world->linkCorrectionY, start, end, range->alphaScale);
+}
+
+// links of one colour share no object, so their corrections can be
+// summed into the objects in parallel, each end weighted by its mass
+void AccumulateLinkChunk(int task, void *data) {
+    LinkRange *range = data;
+    VerletWorld *world = range->world;
+    int start = range->start + task*LINK_CHUNK_SIZE;
+    int end = start + LINK_CHUNK_SIZE < range->end? start + LINK_CHUNK_SIZE: range->end;
+    for (int l = start; l < end; l++) {
+        if (world->linkCorrectionX[l] == 0 && world->linkCorrectionY[l] == 0) continue;
+        int obj1 = world->linkObject1[l];
+        int obj2 = world->linkObject2[l];
+        float w1 = GetInverseMass(world->radii[obj1]);
+        float w2 = GetInverseMass(world->radii[obj2]);
+        world->jacobiX[obj1] += w1*world->linkCorrectionX[l];
+        world->jacobiY[obj1] += w1*world->linkCorrectionY[l];
+        world->jacobiCount[obj1] += 1;
+        world->jacobiX[obj2] -= w2*world->linkCorrectionX[l];
+        world->jacobiY[obj2] -= w2*world->linkCorrectionY[l];
+        world->jacobiCount[obj2] += 1;
+    }
+}
+
+// Jacobi with averaging: every link computes its correction from the same
+// positions, then each object moves by the mean of its corrections
+void ApplyLinksJacobi(VerletWorld *world, float alphaScale) {
+    LinkRange all = { world, 0, world->numLinks, alphaScale };
+    RunTasks(ComputeLinkCorrectionsChunk, CountLinkChunks(all), &all);
+
+    memset(world->jacobiX, 0, sizeof(float)*world->numObjects);
+    memset(world->jacobiY, 0, sizeof(float)*world->numObjects);
+    memset(world->jacobiCount, 0, sizeof(float)*world->numObjects);
+    for (int c = 0; c < MAX_LINK_COLORS; c++) {
+        LinkRange range = { world, world->linkColorStart[c], world->linkColorStart[c + 1], alphaScale };
+        RunTasks(AccumulateLinkChunk, CountLinkChunks(range), &range);
+    }
+    LinkRange overflow = { world, world->linkColorStart[MAX_LINK_COLORS], world->numLinks, alphaScale };
+    for (int task = 0; task < CountLinkChunks(overflow); task++) {
+        AccumulateLinkChunk(task, &overflow);
+    }
+
+    for (int i = 0; i < world->numObjects; i++) {
+        if (world->jacobiCount[i] == 0 || TEST_BIT(world->frozenBits, i)) continue;
+        world->posX[i] += world->jacobiX[i]/world->jacobiCount[i];
+        world->posY[i] += world->jacobiY[i]/world->jacobiCount[i];
+    }
+}
+
+// Gauss-Seidel over the colour groups: links within a group are
+// independent, so each group is solved in parallel chunks with SIMD.
+// dt is the substep the links are solved in, it sets how far compliant
+// links give
+void ApplyLinks(VerletWorld *world, float dt) {
+    if (world->linksDirty) {
+        ColorLinks(world);
+        world->linksDirty = false;
+    }
+    float alphaScale = 1/(dt*dt);
+    if (world->linkSolver == LINK_SOLVER_JACOBI) {
+        ApplyLinksJacobi(world, alphaScale);
+        return;
+    }
+    for (int c = 0; c < MAX_LINK_COLORS; c++) {
+        LinkRange range = { world, world->linkColorStart[c], world->linkColorStart[c + 1], alphaScale };
+        RunTasks(SolveLinkChunk, CountLinkChunks(range), &range);
+    }
+    SolveLinksScalar(world->posX, world->posY, world->radii, world->frozenBits, GetLinkArrays(world),
+            world->linkColorStart[MAX_LINK_COLORS], world->numLinks, alphaScale);
+}
+
+// adds the time elapsed since start to the given pass and returns the
+// current time so the next pass can be timed from it
+double RecordPassTime(VerletWorld *world, SolverPass pass, double start) {
+    double now = world->profiled? EndProfileZone((ProfileZone)pass, start): GetHighResTime();
+    world->passTimes[pass] += now - start;
+    return now;
+}
+
+void RecordCount(VerletWorld *world, ProfileCounter counter, int amount) {
+    if (world->profiled) AddProfileCount(counter, amount);
+}
+
+// Largest error of a link as a fraction of its length, stretch for links
+// in tension and squash for links in compression. Links between two frozen
+// objects can't be corrected and are left out. Compliant links are meant
+// to give, their error is only what they give beyond the force they carry,
+// so they are measured the same way. The links still off their length in
+// a direction they act in are counted for the profiler
+float MeasureLinkStretch(VerletWorld *world) {
+    float stretch = 0;
+    int stretched = 0;
+    for (int l = 0; l < world->numLinks; l++) {
+        int obj1 = world->linkObject1[l];
+        int obj2 = world->linkObject2[l];
+        if (world->linkDistance[l] <= 0) continue;
+        if (TEST_BIT(world->frozenBits, obj1) && TEST_BIT(world->frozenBits, obj2)) continue;
+        float dx = world->posX[obj1] - world->posX[obj2];
+        float dy = world->posY[obj1] - world->posY[obj2];
+        float dist = sqrtf(dx*dx + dy*dy);
+        float error = dist/world->linkDistance[l] - 1;
+        if (!(world->linkMode[l] & LINK_TENSION)) error = fminf(error, 0);
+        if (!(world->linkMode[l] & LINK_COMPRESSION)) error = fmaxf(error, 0);
+        stretch = fmaxf(stretch, fabsf(error));
+        stretched += error != 0;
+    }
+    RecordCount(world, COUNTER_LINKS_STRETCHED, stretched);
+    return stretch;
+}
+
+void ApplyAcceleration(VerletWorld *world, Vector2 vector) {
+    if (vector.x != 0) AddAccelerationKernel(world->accX, vector.x, world->numObjects);
+    AddAccelerationKernel(world->accY, vector.y, world->numObjects);
+}
+
+void AccelerateToPoint(VerletWorld *world, Vector2 vector, float strength) {
+    for (int i = 0; i < world->numObjects; i++) {
+        Vector2 toPoint = { vector.x - world->posX[i], vector.y - world->posY[i] };
+        float distance = Vector2Length(toPoint);
+        if (distance < 0.0001f) continue;
+        // toPoint = Vector2Normalize(toPoint);
+        world->accX[i] += toPoint.x*strength/distance;
+        world->accY[i] += toPoint.y*strength/distance;
+    }
+}
+
+// Each body pushes with the area the previous pass measured and measures
+// the area for the next one as it goes
+void ApplyPressureChunk(int task, void *data) {
+    VerletWorld *world = data;
+    int start = task*BODY_CHUNK_SIZE;
+    int end = start + BODY_CHUNK_SIZE < world->numBodies? start + BODY_CHUNK_SIZE: world->numBodies;
+    for (int b = start; b < end; b++) {
+        float rest = fabsf(world->bodyRestArea[b]);
+        float area = fmaxf(fabsf(world->bodyArea[b]), MIN_BODY_AREA*rest);
+        float pressure = world->bodyPressure[b]*(rest/area - 1);
+        float scale = world->bodyRestArea[b] < 0? -pressure/2: pressure/2;
+        world->bodyArea[b] = PressureKernel(world->posX, world->posY, world->accX, world->accY,
+                world->radii, world->frozenBits,
+                world->bodyObjects + world->bodyStart[b], world->bodyCount[b], scale)/2;
+    }
+}
+
+void ApplyPressure(VerletWorld *world) {
+    RunTasks(ApplyPressureChunk, (world->numBodies + BODY_CHUNK_SIZE - 1)/BODY_CHUNK_SIZE, world);
+}
+
+Rectangle GetFieldBounds(const ForceField *field) {
+    if (field->type == FIELD_WIND || field->type == FIELD_DRAG) return field->area;
+    return (Rectangle){
+        field->center.x - field->radius, field->center.y - field->radius, 2*field->radius, 2*field->radius
+    };
+}
+
+// add what one field does at p to the node's acceleration and drag
+void SampleForceField(const ForceField *field, Vector2 p, float *accX, float *accY, float *drag) {
+    if (field->type == FIELD_WIND) {
+        *accX += field->wind.x;
+        *accY += field->wind.y;
+        return;
+    }
+    if (field->type == FIELD_DRAG) {
+        *drag += field->strength;
+        return;
+    }
+    float dx = field->center.x - p.x;
+    float dy = field->center.y - p.y;
+    float distance = sqrtf(dx*dx + dy*dy);
+    if (!(distance > 0) || distance >= field->radius) return;
+    float scale = field->strength*(1 - distance/field->radius)/distance;
+    if (field->type == FIELD_ATTRACTOR) {
+        *accX += dx*scale;
+        *accY += dy*scale;
+    }
+    else {
+        *accX += dy*scale;
+        *accY -= dx*scale;
+    }
+}
+
+// Each field adds itself to the nodes inside its bounds, in field order,
+// so every node sums its fields the same way whichever task builds it
+void BuildFieldRows(int task, void *data) {
+    VerletWorld *world = data;
+    int rowStart = task*FIELD_ROW_CHUNK;
+    int rowEnd = rowStart + FIELD_ROW_CHUNK < world->fieldHeight? rowStart + FIELD_ROW_CHUNK: world->fieldHeight;
+    float cell = world->fieldCellSize;
+    for (int f = 0; f < world->numFieldSlots; f++) {
+        if (!world->fieldUsed[f]) continue;
+        const ForceField *field = &world->fields[f];
+        Rectangle bounds = GetFieldBounds(field);
+        int x0 = (int)fmaxf(ceilf((bounds.x - world->fieldOrigin.x)/cell), 0);
+        int x1 = (int)fminf(floorf((bounds.x + bounds.width - world->fieldOrigin.x)/cell), world->fieldWidth - 1);
+        int y0 = (int)fmaxf(ceilf((bounds.y - world->fieldOrigin.y)/cell), rowStart);
+        int y1 = (int)fminf(floorf((bounds.y + bounds.height - world->fieldOrigin.y)/cell), rowEnd - 1);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                float *node = world->fieldNodes + 4*(y*world->fieldWidth + x);
+                Vector2 p = { world->fieldOrigin.x + x*cell, world->fieldOrigin.y + y*cell };
+                SampleForceField(field, p, &node[0], &node[1], &node[2]);
             }
         }
     }
 }
 
-void ApplyLinks() {
-    for (int i = 0; i < numLinks; i++) {
-        VerletObject *obj1 = links[i].object1;
-        VerletObject *obj2 = links[i].object2;
+// Lay the grid over the fields' bounds with a node of empty border all
+// round and sum the fields into it. A grid with no fields inside the world
+// has no nodes. Returns false if out of memory, the grid is retried then
+bool BuildFieldGrid(VerletWorld *world) {
+    Vector2 min = { FLT_MAX, FLT_MAX };
+    Vector2 max = { -FLT_MAX, -FLT_MAX };
+    for (int f = 0; f < world->numFieldSlots; f++) {
+        if (!world->fieldUsed[f]) continue;
+        Rectangle bounds = GetFieldBounds(&world->fields[f]);
+        min = (Vector2){ fminf(min.x, bounds.x), fminf(min.y, bounds.y) };
+        max = (Vector2){ fmaxf(max.x, bounds.x + bounds.width), fmaxf(max.y, bounds.y + bounds.height) };
+    }
+    Rectangle limits = world->worldBounds;
+    min = (Vector2){ fmaxf(min.x, limits.x), fmaxf(min.y, limits.y) };
+    max = (Vector2){ fminf(max.x, limits.x + limits.width), fminf(max.y, limits.y + limits.height) };
+    world->fieldWidth = 0;
+    world->fieldHeight = 0;
+    if (!(max.x >= min.x && max.y >= min.y)) {
+        world->fieldsDirty = false;
+        return true;
+    }
+
+    float cell = FIELD_CELL_SIZE;
+    int width;
+    int height;
+    for (;;) {
+        width = (int)fminf(ceilf((max.x - min.x)/cell), FIELD_MAX_NODES) + 3;
+        height = (int)fminf(ceilf((max.y - min.y)/cell), FIELD_MAX_NODES) + 3;
+        if ((long)width*height <= FIELD_MAX_NODES) break;
+        cell *= 2;
+    }
+    int nodes = width*height;
+    if (nodes > world->fieldNodeCapacity) {
+        if (!GrowArray((void **)&world->fieldNodes, 4*sizeof(float), world->fieldNodeCapacity, nodes)) {
+            return false;
+        }
+        world->fieldNodeCapacity = nodes;
+    }
+    memset(world->fieldNodes, 0, 4*sizeof(float)*nodes);
+    world->fieldWidth = width;
+    world->fieldHeight = height;
+    world->fieldCellSize = cell;
+    world->fieldOrigin = (Vector2){ min.x - cell, min.y - cell };
+    RunTasks(BuildFieldRows, (height + FIELD_ROW_CHUNK - 1)/FIELD_ROW_CHUNK, world);
+    world->fieldsDirty = false;
+    return true;
+}
+
+typedef struct FieldPass {
+    VerletWorld *world;
+    FieldGrid grid;
+    float invDt;
+} FieldPass;
+
+void ApplyFieldChunk(int task, void *data) {
+    FieldPass *pass = data;
+    VerletWorld *world = pass->world;
+    int start = task*FIELD_CHUNK_SIZE;
+    int end = start + FIELD_CHUNK_SIZE < world->numObjects? start + FIELD_CHUNK_SIZE: world->numObjects;
+    ForceFieldKernel(world->posX, world->posY, world->oldX, world->oldY, world->accX, world->accY,
+            start, end, pass->grid, world->gravity, pass->invDt);
+}
+
+// Gravity and every field in one pass over the objects, however many
+// fields there are. dt is the substep, drag works on the velocity over it
+void ApplyForceFields(VerletWorld *world, float dt) {
+    if (world->fieldsDirty) BuildFieldGrid(world);
+    if (world->fieldWidth == 0) {
+        ApplyAcceleration(world, world->gravity);
+        return;
+    }
+    FieldPass pass = {
+        world,
+        {
+            world->fieldNodes, world->fieldWidth, world->fieldHeight, world->fieldOrigin,
+            1/world->fieldCellSize
+        },
+        1/dt
+    };
+    RunTasks(ApplyFieldChunk, (world->numObjects + FIELD_CHUNK_SIZE - 1)/FIELD_CHUNK_SIZE, &pass);
+}
+
+void ApplyConstraintCircle(VerletWorld *world, Vector2 constraintPos, float radius) {
+    ConstrainCircleKernel(world->posX, world->posY, world->radii, world->numObjects,
+            constraintPos, radius);
+}
+
+// cell index along one axis, written so a NaN position lands in cell 0
+// instead of turning into an out of range index
+int GridCoordinate(VerletWorld *world, float position, float origin, int numCells) {
+    float cell = (position - origin)/world->gridCellSize;
+    if (!(cell > 0)) return 0;
+    if (cell >= numCells - 1) return numCells - 1;
+    return (int)cell;
+}
+
+// bin every colliding object into a uniform grid whose cells are as wide
+// as the largest possible contact distance, so overlapping pairs can only
+// be found in the 3x3 block of cells around an object. With a skin of
+// skinFraction times the largest radius the cells are wider by the skin
+// and by SLEEP_MARGIN, so contacts are still found while the grid ages
+void BuildCollisionGrid(VerletWorld *world, float skinFraction) {
+    float maxRadius = 0;
+    Vector2 min = { FLT_MAX, FLT_MAX };
+    Vector2 max = { -FLT_MAX, -FLT_MAX };
+    for (int i = 0; i < world->numObjects; i++) {
+        if (!TEST_BIT(world->collidingBits, i)) continue;
+        if (world->radii[i] > maxRadius) maxRadius = world->radii[i];
+        if (world->posX[i] < min.x) min.x = world->posX[i];
+        if (world->posY[i] < min.y) min.y = world->posY[i];
+        if (world->posX[i] > max.x) max.x = world->posX[i];
+        if (world->posY[i] > max.y) max.y = world->posY[i];
+    }
+    if (max.x < min.x) {
+        world->gridWidth = 0;
+        world->gridHeight = 0;
+        return;
+    }
+
+    // objects of radius 0 still get a skin of a pixel
+    world->gridSkin = skinFraction > 0? fmaxf(skinFraction*maxRadius, 1): 0;
+    world->gridCellSize = 2*maxRadius + (world->gridSkin > 0? world->gridSkin + SLEEP_MARGIN: 0);
+    if (world->gridCellSize < 1) world->gridCellSize = 1;
+    world->gridOrigin = min;
+    // objects that fall out of the world stretch the grid, so the cells
+    // grow until the whole grid fits in the cell table
+    for (;;) {
+        world->gridWidth = (int)fminf((max.x - min.x)/world->gridCellSize, MAX_GRID_CELLS) + 1;
+        world->gridHeight = (int)fminf((max.y - min.y)/world->gridCellSize, MAX_GRID_CELLS) + 1;
+        if ((long)world->gridWidth*world->gridHeight <= MAX_GRID_CELLS) break;
+        world->gridCellSize *= 2;
+    }
+
+    // counting sort of the objects by cell, walking backwards so each
+    // cell lists its objects in ascending order
+    int numCells = world->gridWidth*world->gridHeight;
+    if (numCells > world->gridCellCapacity) {
+        int capacity = world->gridCellCapacity > 0? 2*world->gridCellCapacity: MIN_CAPACITY;
+        while (capacity < numCells) capacity *= 2;
+        if (capacity > MAX_GRID_CELLS) capacity = MAX_GRID_CELLS;
+        // a strip covers at least COLLISION_STRIP_WIDTH cells
+        bool ok =
+            GrowArray((void **)&world->gridCellStart, sizeof(int),
+                    world->gridCellCapacity + 1, capacity + 1) &&
+            GrowArray((void **)&world->stripStats, sizeof(CollisionStats),
+                    world->gridCellCapacity/COLLISION_STRIP_WIDTH + 1, capacity/COLLISION_STRIP_WIDTH + 1);
+        if (!ok) {
+            world->gridWidth = 0;
+            world->gridHeight = 0;
+            return;
+        }
+        world->gridCellCapacity = capacity;
+    }
+    memset(world->gridCellStart, 0, sizeof(int)*(numCells + 1));
+    for (int i = 0; i < world->numObjects; i++) {
+        if (!TEST_BIT(world->collidingBits, i)) {
+            world->objectCell[i] = -1;
+            continue;
+        }
+        world->objectCell[i] =
+            GridCoordinate(world, world->posY[i], world->gridOrigin.y, world->gridHeight)*world->gridWidth
+            + GridCoordinate(world, world->posX[i], world->gridOrigin.x, world->gridWidth);
+        world->gridCellStart[world->objectCell[i]]++;
+    }
+    for (int c = 1; c <= numCells; c++) {
+        world->gridCellStart[c] += world->gridCellStart[c - 1];
+    }
+    for (int i = world->numObjects - 1; i >= 0; i--) {
+        if (world->objectCell[i] < 0) continue;
+        world->gridCellObjects[--world->gridCellStart[world->objectCell[i]]] = i;
+    }
+}
 
-        Vector2 axis = Vector2Subtract(obj1->currentPos, obj2->currentPos);
-        float dist = Vector2Length(axis);
-        Vector2 n = { axis.x/dist, axis.y/dist };
-        float delta = links[i].target_distance - dist;
+// returns how deep the pair overlapped as a fraction of the distance they
+// should keep, 0 if they did not touch
+float SolveCollisionPair(VerletWorld *world, int object1, int object2) {
+    Vector2 v = {
+        world->posX[object1] - world->posX[object2], world->posY[object1] - world->posY[object2]
+    };
+    float dist2 = v.x * v.x + v.y * v.y;
+    float min_dist = world->radii[object1] + world->radii[object2];
+    // Check overlapping
+    if (dist2 < min_dist * min_dist) {
+        float dist  = sqrt(dist2);
+        // objects on exactly the same spot, e.g. after both were projected
+        // onto the constraint circle, are pushed apart along x
+        Vector2 n = dist > 0? (Vector2){ v.x/dist, v.y/dist }: (Vector2){ 1, 0 };
+        float massRatio1 = world->radii[object1] / (world->radii[object1] + world->radii[object2]);
+        float massRatio2 = world->radii[object2] / (world->radii[object1] + world->radii[object2]);
+        float delta = 0.5f * world->responseCoef * (dist - min_dist);
+        // Update positions
+        if (!TEST_BIT(world->frozenBits, object1)) {
+            world->posX[object1] -= n.x * (massRatio2 * delta);
+            world->posY[object1] -= n.y * (massRatio2 * delta);
+        }
+        if (!TEST_BIT(world->frozenBits, object2)) {
+            world->posX[object2] += n.x * (massRatio1 * delta);
+            world->posY[object2] += n.y * (massRatio1 * delta);
+        }
+        return 1 - dist/min_dist;
+    }
+    return 0;
+}
 
-        // only apply forces if in tension
-        if (delta < 0) {
-            if (!obj1->isStatic) {
-                obj1->currentPos.x += 0.5f*delta*n.x;
-                obj1->currentPos.y += 0.5f*delta*n.y;
+// resolve every pair (i, j) with j > i found in the cells around object i.
+// Sleeping objects are skipped and pairs of two of them are never solved.
+// The neighbouring cell lists are merged so j is visited in ascending order,
+// giving the same pair order as testing every object against every other.
+// The pairs tested, contacts and deepest overlap are added to stats
+void SolveCollisionsForObject(VerletWorld *world, int i, CollisionStats *stats) {
+    if (TEST_BIT(world->sleepingBits, i)) return;
+    float overlap = 0;
+    int pairTests = 0;
+    int contacts = 0;
+    int cursor[9];
+    int end[9];
+    int numRanges = 0;
+    int cx = world->objectCell[i] % world->gridWidth;
+    int cy = world->objectCell[i] / world->gridWidth;
+    for (int y = cy - 1; y <= cy + 1; y++) {
+        if (y < 0 || y >= world->gridHeight) continue;
+        for (int x = cx - 1; x <= cx + 1; x++) {
+            if (x < 0 || x >= world->gridWidth) continue;
+            int cell = y*world->gridWidth + x;
+            int k = world->gridCellStart[cell];
+            for (; k < world->gridCellStart[cell + 1] && world->gridCellObjects[k] <= i; k++) {
+                // sleeping objects skip their own turn, so their pairs
+                // with the awake objects above them are solved here
+                int j = world->gridCellObjects[k];
+                if (world->numSleeping > 0 && j < i && TEST_BIT(world->sleepingBits, j)) {
+                    float pairOverlap = SolveCollisionPair(world, i, j);
+                    overlap = fmaxf(overlap, pairOverlap);
+                    pairTests++;
+                    contacts += pairOverlap > 0;
+                }
             }
-            if (!obj2->isStatic) {
-                obj2->currentPos.x -= 0.5f*delta*n.x;
-                obj2->currentPos.y -= 0.5f*delta*n.y;
+            if (k == world->gridCellStart[cell + 1]) continue;
+            cursor[numRanges] = k;
+            end[numRanges] = world->gridCellStart[cell + 1];
+            numRanges++;
+        }
+    }
+
+    while (numRanges > 0) {
+        int next = 0;
+        for (int r = 1; r < numRanges; r++) {
+            if (world->gridCellObjects[cursor[r]] < world->gridCellObjects[cursor[next]]) next = r;
+        }
+        float pairOverlap = SolveCollisionPair(world, i, world->gridCellObjects[cursor[next]]);
+        overlap = fmaxf(overlap, pairOverlap);
+        pairTests++;
+        contacts += pairOverlap > 0;
+        if (++cursor[next] == end[next]) {
+            numRanges--;
+            cursor[next] = cursor[numRanges];
+            end[next] = end[numRanges];
+        }
+    }
+    stats->overlap = fmaxf(stats->overlap, overlap);
+    stats->pairTests += pairTests;
+    stats->contacts += contacts;
+}
+
+// List the pairs of the objects in this chunk with the higher objects in
+// reach, from the grid just built
+void BuildNeighbourChunk(int task, void *data) {
+    VerletWorld *world = data;
+    int start = task*NEIGHBOUR_CHUNK_SIZE;
+    int end = start + NEIGHBOUR_CHUNK_SIZE < world->numObjects?
+        start + NEIGHBOUR_CHUNK_SIZE: world->numObjects;
+    for (int i = start; i < end; i++) {
+        world->buildX[i] = world->posX[i];
+        world->buildY[i] = world->posY[i];
+        world->neighbourCount[i] = 0;
+        if (world->objectCell[i] < 0) continue;
+        int *list = &world->neighbours[i*NEIGHBOUR_CAPACITY];
+        int count = 0;
+        int cx = world->objectCell[i] % world->gridWidth;
+        int cy = world->objectCell[i] / world->gridWidth;
+        for (int y = cy - 1; y <= cy + 1 && count >= 0; y++) {
+            if (y < 0 || y >= world->gridHeight) continue;
+            for (int x = cx - 1; x <= cx + 1 && count >= 0; x++) {
+                if (x < 0 || x >= world->gridWidth) continue;
+                int cell = y*world->gridWidth + x;
+                for (int k = world->gridCellStart[cell]; k < world->gridCellStart[cell + 1]; k++) {
+                    int j = world->gridCellObjects[k];
+                    if (j <= i) continue;
+                    float dx = world->posX[i] - world->posX[j];
+                    float dy = world->posY[i] - world->posY[j];
+                    float reach = world->radii[i] + world->radii[j] + world->gridSkin;
+                    if (dx*dx + dy*dy >= reach*reach) continue;
+                    if (count == NEIGHBOUR_CAPACITY) {
+                        count = -1;
+                        break;
+                    }
+                    list[count++] = j;
+                }
             }
         }
+        world->neighbourCount[i] = count;
     }
 }
 
-void ApplyAcceleration(Vector2 vector) {
-    for (int i = 0; i < numObjects; i++) {
-        VerletObject *object = &objects[i];
-        object->acceleration.y += vector.y;
+void BuildNeighbourLists(VerletWorld *world) {
+    BuildCollisionGrid(world, world->neighbourSkin);
+    int numChunks = (world->numObjects + NEIGHBOUR_CHUNK_SIZE - 1)/NEIGHBOUR_CHUNK_SIZE;
+    if (world->gridWidth > 0) {
+        RunTasks(BuildNeighbourChunk, numChunks, world);
     }
+    world->neighboursValid = true;
+    world->neighbourObjects = world->numObjects;
 }
 
-void AccelerateToPoint(Vector2 vector, float strength) {
-    for (int i = 0; i < numObjects; i++) {
-        VerletObject *object = &objects[i];
-        Vector2 toPoint = Vector2Subtract(vector, object->currentPos);
-        float distance = Vector2Length(toPoint);
-        if (distance < 0.0001f) continue;
-        // toPoint = Vector2Normalize(toPoint);
-        object->acceleration.x += toPoint.x*strength/distance;
-        object->acceleration.y += toPoint.y*strength/distance;
-    }
-}
-
-void ApplyConstraintCircle(Vector2 constraintPos, float radius) {
-    for (int i = 0; i < numObjects; i++) {
-        VerletObject *object = &objects[i];
-        Vector2 toObj = Vector2Subtract(object->currentPos, constraintPos);
-        float constraintDistance = Vector2Length(toObj);
-        if (constraintDistance > radius - object->radius) {
-            Vector2 n = (Vector2){
-                toObj.x/constraintDistance,
-                    toObj.y/constraintDistance
-            };
-            object->currentPos.x = constraintPos.x + n.x * (radius - object->radius);
-            object->currentPos.y = constraintPos.y + n.y * (radius - object->radius);
-        }
-    }
-}
-
-void SolveCollisions(void) {
-    for (int i = 0; i < numObjects; i++) {
-        VerletObject *object1 = &objects[i];
-        if (!object1->isColliding) continue;
-
-        for (int j = i + 1; j < numObjects; j++) {
-            VerletObject *object2 = &objects[j];
-            if (!object2->isColliding) continue;
-
-            Vector2 v = Vector2Subtract(object1->currentPos, object2->currentPos);
-            float dist2 = v.x * v.x + v.y * v.y;
-            float min_dist = object1->radius + object2->radius;
-            // Check overlapping
-            if (dist2 < min_dist * min_dist) {
-                float dist  = sqrt(dist2);
-                Vector2 n = { v.x/dist, v.y/dist };
-                float massRatio1 = object1->radius / (object1->radius + object2->radius);
-                float massRatio2 = object2->radius / (object1->radius + object2->radius);
-                float delta = 0.5f * responseCoef * (dist - min_dist);
-                // Update positions
-                if (!object1->isStatic) {
-                    object1->currentPos.x -= n.x * (massRatio2 * delta);
-                    object1->currentPos.y -= n.y * (massRatio2 * delta);
-                }
-                if (!object2->isStatic) {
-                    object2->currentPos.x += n.x * (massRatio1 * delta);
-                    object2->currentPos.y += n.y * (massRatio1 * delta);
+// true once an object has moved far enough that a pair the lists left out
+// may have come into reach
+bool NeighboursMoved(VerletWorld *world) {
+    float limit = 0.25f*world->gridSkin*world->gridSkin;
+    for (int i = 0; i < world->numObjects; i++) {
+        float dx = world->posX[i] - world->buildX[i];
+        float dy = world->posY[i] - world->buildY[i];
+        if (dx*dx + dy*dy > limit) return true;
+    }
+    return false;
+}
+
+// resolve the pairs listed at object i, pairs of two sleeping objects are
+// left alone. The grid is as old as the lists, but its cells were sized
+// for the skin, so they still hold every pair the lists would
+void SolveNeighbours(VerletWorld *world, int i, CollisionStats *stats) {
+    bool asleep = TEST_BIT(world->sleepingBits, i);
+    float overlap = 0;
+    int pairTests = 0;
+    int contacts = 0;
+    if (world->neighbourCount[i] >= 0) {
+        const int *list = &world->neighbours[i*NEIGHBOUR_CAPACITY];
+        for (int k = 0; k < world->neighbourCount[i]; k++) {
+            int j = list[k];
+            if (asleep && TEST_BIT(world->sleepingBits, j)) continue;
+            float pairOverlap = SolveCollisionPair(world, i, j);
+            overlap = fmaxf(overlap, pairOverlap);
+            pairTests++;
+            contacts += pairOverlap > 0;
+        }
+    }
+    else {
+        int cx = world->objectCell[i] % world->gridWidth;
+        int cy = world->objectCell[i] / world->gridWidth;
+        for (int y = cy - 1; y <= cy + 1; y++) {
+            if (y < 0 || y >= world->gridHeight) continue;
+            for (int x = cx - 1; x <= cx + 1; x++) {
+                if (x < 0 || x >= world->gridWidth) continue;
+                int cell = y*world->gridWidth + x;
+                for (int k = world->gridCellStart[cell]; k < world->gridCellStart[cell + 1]; k++) {
+                    int j = world->gridCellObjects[k];
+                    if (j <= i || (asleep && TEST_BIT(world->sleepingBits, j))) continue;
+                    float pairOverlap = SolveCollisionPair(world, i, j);
+                    overlap = fmaxf(overlap, pairOverlap);
+                    pairTests++;
+                    contacts += pairOverlap > 0;
                 }
             }
         }
     }
+    stats->overlap = fmaxf(stats->overlap, overlap);
+    stats->pairTests += pairTests;
+    stats->contacts += contacts;
 }
 
-void UpdatePositions(float dt) {
-    for (int i = 0; i < numObjects; i++) {
-        VerletObject *object = &objects[i];
+// Strips are COLLISION_STRIP_WIDTH cells across the longer grid axis. An
+// object only touches objects in the neighbouring cells, so strips with two
+// strips between them never write the same object and one parity of strips
+// can be solved in parallel while the other waits for the next phase
+typedef struct StripPhase {
+    VerletWorld *world;
+    int phase;
+} StripPhase;
 
-        Vector2 displacement = {
-            object->currentPos.x - object->oldPos.x,
-            object->currentPos.y - object->oldPos.y
-        };
-        if (!object->isStatic) {
-            object->oldPos = object->currentPos;
-            object->currentPos.x = object->currentPos.x + displacement.x + object->acceleration.x*dt*dt;
-            object->currentPos.y = object->currentPos.y + displacement.y + object->acceleration.y*dt*dt;
-            object->acceleration = (Vector2){ 0 };
+void SolveCollisionStrip(int task, void *data) {
+    StripPhase *pass = data;
+    VerletWorld *world = pass->world;
+    int strip = 2*task + pass->phase;
+    bool alongX = world->gridWidth >= world->gridHeight;
+    int stripStart = strip*COLLISION_STRIP_WIDTH;
+    int stripEnd = stripStart + COLLISION_STRIP_WIDTH;
+    int stripLimit = alongX? world->gridWidth: world->gridHeight;
+    int length = alongX? world->gridHeight: world->gridWidth;
+    if (stripEnd > stripLimit) stripEnd = stripLimit;
+
+    CollisionStats stats = { 0 };
+    for (int a = 0; a < length; a++) {
+        for (int b = stripStart; b < stripEnd; b++) {
+            int cell = alongX? a*world->gridWidth + b: b*world->gridWidth + a;
+            for (int k = world->gridCellStart[cell]; k < world->gridCellStart[cell + 1]; k++) {
+                if (world->neighboursValid) SolveNeighbours(world, world->gridCellObjects[k], &stats);
+                else SolveCollisionsForObject(world, world->gridCellObjects[k], &stats);
+            }
         }
     }
+    world->stripStats[strip] = stats;
 }
 
-void UpdateVerlet(float dt) {
-    // reacting to UI signals
-    if (g_buttonPressed0) {
-        numObjects = 0;
-        numLinks = 0;
-        g_buttonPressed0 = false;
+// returns the deepest overlap the pass found, see SolveCollisionPair(world),
+// and counts the pairs tested and contacts for the profiler. Without a
+// skin the grid is rebuilt and searched every pass
+float SolveCollisions(VerletWorld *world) {
+    world->numCollisionPasses++;
+    bool moved = world->neighboursValid && world->numObjects == world->neighbourObjects
+        && world->gridWidth > 0 && NeighboursMoved(world);
+    // lists that were outrun within a pass cost more than they save, so
+    // the grid goes on alone for NEIGHBOUR_BACKOFF passes
+    if (moved && world->neighbourPasses <= 1) world->neighbourBackoff = NEIGHBOUR_BACKOFF;
+    if (world->neighbourSkin <= 0 || world->neighbourBackoff > 0) {
+        if (world->neighbourBackoff > 0) world->neighbourBackoff--;
+        world->neighboursValid = false;
+        BuildCollisionGrid(world, 0);
+        world->numRebuilds++;
+        RecordCount(world, COUNTER_NEIGHBOUR_REBUILDS, 1);
     }
-    gravity.y = (int)(g_gravity/100)*100;
-    Vector2 center = { (float)g_screenWidth/2, (float)g_screenHeight/2 };
+    else if (moved || !world->neighboursValid || world->numObjects != world->neighbourObjects) {
+        BuildNeighbourLists(world);
+        world->neighbourPasses = 0;
+        world->numRebuilds++;
+        RecordCount(world, COUNTER_NEIGHBOUR_REBUILDS, 1);
+    }
+    world->neighbourPasses++;
+    if (world->gridWidth == 0) return 0;
+    CollisionStats stats = { 0 };
+    // a deterministic world always takes the strip order, a single thread
+    // runs the strips inline
+    if (world->deterministic || (GetNumThreads() > 1 && !IsInsideTask())) {
+        int stripLimit = world->gridWidth >= world->gridHeight? world->gridWidth: world->gridHeight;
+        int numStrips = (stripLimit + COLLISION_STRIP_WIDTH - 1)/COLLISION_STRIP_WIDTH;
+        for (int phase = 0; phase < 2; phase++) {
+            StripPhase pass = { world, phase };
+            RunTasks(SolveCollisionStrip, (numStrips - phase + 1)/2, &pass);
+        }
+        for (int strip = 0; strip < numStrips; strip++) {
+            stats.overlap = fmaxf(stats.overlap, world->stripStats[strip].overlap);
+            stats.pairTests += world->stripStats[strip].pairTests;
+            stats.contacts += world->stripStats[strip].contacts;
+        }
+    }
+    else {
+        for (int i = 0; i < world->numObjects; i++) {
+            if (world->objectCell[i] < 0) continue;
+            if (world->neighboursValid) SolveNeighbours(world, i, &stats);
+            else SolveCollisionsForObject(world, i, &stats);
+        }
+    }
+    RecordCount(world, COUNTER_PAIR_TESTS, stats.pairTests);
+    RecordCount(world, COUNTER_CONTACTS, stats.contacts);
+    return stats.overlap;
+}
 
-    // TODO: Swap delete for fallen objects
-    // (Swapping must occur in the links array to maintain links)
-    for (int k = 0; k < PHYSICS_SUBSTEPS; k++) {
-        ApplyAcceleration(gravity);
-        if (IsMouseButtonDown(MOUSE_BUTTON_RIGHT) && !IsMouseOnUI()) {
-            AccelerateToPoint(g_mousePos, 2000);
+void UpdatePositions(VerletWorld *world, float dt) {
+    IntegrateKernel(world->posX, world->posY, world->oldX, world->oldY, world->accX, world->accY,
+            world->frozenBits, world->numObjects, dt);
+}
+
+// Sweep object i from where it started the substep to where it ended,
+// either against what stays put (frozen objects, the constraint circle and
+// the colliders) or against the other objects moving along their own
+// paths. At the first one it meets the object loses the part of its
+// velocity going into it and slides on from the contact for the rest of
+// the substep. The grid may be as old as the neighbour lists, so the cells
+// one further out than the path are searched as well. Returns whether
+// the object met anything
+bool SweepObject(VerletWorld *world, int i, bool moving) {
+    Vector2 from = { world->oldX[i], world->oldY[i] };
+    Vector2 move = { world->posX[i] - from.x, world->posY[i] - from.y };
+    float radius = world->radii[i];
+    float time = 1;
+    Vector2 normal = { 0, 0 };
+    Vector2 obstacleMove = { 0, 0 };
+    bool hit = false;
+
+    if (world->gridWidth > 0) {
+        float margin = radius + world->gridCellSize;
+        Vector2 min = { fminf(from.x, world->posX[i]) - margin, fminf(from.y, world->posY[i]) - margin };
+        Vector2 max = { fmaxf(from.x, world->posX[i]) + margin, fmaxf(from.y, world->posY[i]) + margin };
+        int x0 = GridCoordinate(world, min.x, world->gridOrigin.x, world->gridWidth);
+        int x1 = GridCoordinate(world, max.x, world->gridOrigin.x, world->gridWidth);
+        int y0 = GridCoordinate(world, min.y, world->gridOrigin.y, world->gridHeight);
+        int y1 = GridCoordinate(world, max.y, world->gridOrigin.y, world->gridHeight);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                int cell = y*world->gridWidth + x;
+                for (int k = world->gridCellStart[cell]; k < world->gridCellStart[cell + 1]; k++) {
+                    int j = world->gridCellObjects[k];
+                    if (j == i || TEST_BIT(world->frozenBits, j) == moving) continue;
+                    Vector2 start = moving?
+                        (Vector2){ world->oldX[j], world->oldY[j] }: (Vector2){ world->posX[j], world->posY[j] };
+                    Vector2 moveJ = { world->posX[j] - start.x, world->posY[j] - start.y };
+                    Vector2 offset = { from.x - start.x, from.y - start.y };
+                    Vector2 relative = { move.x - moveJ.x, move.y - moveJ.y };
+                    if (!SweepDisc(offset, relative, radius + world->radii[j], &time)) continue;
+                    Vector2 apart = { offset.x + time*relative.x, offset.y + time*relative.y };
+                    float distance = sqrtf(apart.x*apart.x + apart.y*apart.y);
+                    if (!(distance > 0)) continue;
+                    normal = (Vector2){ apart.x/distance, apart.y/distance };
+                    obstacleMove = moveJ;
+                    hit = true;
+                }
+            }
         }
-        if (g_applyConstraint) {
-            ApplyConstraintCircle(center, 400);
+    }
+
+    // leaving the circle, the far root of the same quadratic. An object
+    // already outside is met at once if it moves further out
+    float limit = world->constraintRadius - radius;
+    if (!moving && world->constraintEnabled && limit > 0) {
+        Vector2 offset = { from.x - world->constraintCenter.x, from.y - world->constraintCenter.y };
+        float a = move.x*move.x + move.y*move.y;
+        float b = offset.x*move.x + offset.y*move.y;
+        float c = offset.x*offset.x + offset.y*offset.y - limit*limit;
+        float t = 1;
+        if (c < 0 && a > 0) t = (-b + sqrtf(b*b - a*c))/a;
+        else if (b > 0) t = 0;
+        Vector2 out = { offset.x + t*move.x, offset.y + t*move.y };
+        float distance = sqrtf(out.x*out.x + out.y*out.y);
+        if (t < time && distance > 0) {
+            time = t;
+            normal = (Vector2){ -out.x/distance, -out.y/distance };
+            obstacleMove = (Vector2){ 0, 0 };
+            hit = true;
         }
-        SolveCollisions();
-        ApplyLinks();
-        UpdatePositions(dt);
     }
+
+    if (!moving && SweepColliders(from, move, radius, &time, &normal)) {
+        obstacleMove = (Vector2){ 0, 0 };
+        hit = true;
+    }
+    if (!hit) return false;
+
+    Vector2 velocity = move;
+    float approach = (move.x - obstacleMove.x)*normal.x + (move.y - obstacleMove.y)*normal.y;
+    if (approach < 0) {
+        velocity.x -= approach*normal.x;
+        velocity.y -= approach*normal.y;
+    }
+    world->posX[i] = from.x + time*move.x + (1 - time)*velocity.x;
+    world->posY[i] = from.y + time*move.y + (1 - time)*velocity.y;
+    world->oldX[i] = world->posX[i] - velocity.x;
+    world->oldY[i] = world->posY[i] - velocity.y;
+    return true;
 }
 
-void DrawVerlet(void) {
-    for (int i = 0; i < numLinks; i++) {
-        DrawLineEx(links[i].object1->currentPos, links[i].object2->currentPos, 2.0f,
-                (Color){ g_red, g_green, g_blue, 255 });
+// Only objects that moved further than their radius can have skipped past
+// something, everything slower is left to the collision passes. The fast
+// objects are swept against what stays put first, so the ones it stopped
+// are in place when the others are swept against them. Objects are swept
+// one after another in index order, the cost grows with the number of
+// fast objects and not with the scene
+void SweepFastObjects(VerletWorld *world) {
+    int count = 0;
+    for (int i = 0; i < world->numObjects; i++) {
+        if (!TEST_BIT(world->collidingBits, i) || TEST_BIT(world->frozenBits, i)) continue;
+        float dx = world->posX[i] - world->oldX[i];
+        float dy = world->posY[i] - world->oldY[i];
+        float travel = fmaxf(world->radii[i], SWEEP_MIN_TRAVEL);
+        if (dx*dx + dy*dy > travel*travel) world->sweepObjects[count++] = i;
+    }
+    RecordCount(world, COUNTER_SWEPT_OBJECTS, count);
+    for (int k = 0; k < count; k++) {
+        SweepObject(world, world->sweepObjects[k], false);
     }
-    for (int i = 0; i < numObjects; i++) {
-        DrawCircleV(objects[i].currentPos, objects[i].radius, objects[i].color);
+    bool met = count > 1;
+    for (int pass = 0; pass < SWEEP_PASSES && met; pass++) {
+        met = false;
+        for (int k = 0; k < count; k++) {
+            met = SweepObject(world, world->sweepObjects[k], true) || met;
+        }
+    }
+}
+
+// Objects wake up at rest. While frozen they still collect acceleration
+// that never gets integrated, and the constraint may have nudged them
+void WakeObject(VerletWorld *world, int i) {
+    WRITE_BIT(world->sleepingBits, i, false);
+    world->quietFrames[i] = 0;
+    world->oldX[i] = world->posX[i];
+    world->oldY[i] = world->posY[i];
+    world->accX[i] = 0;
+    world->accY[i] = 0;
+}
+
+int FindIsland(VerletWorld *world, int i) {
+    while (world->islandParent[i] != i) {
+        world->islandParent[i] = world->islandParent[world->islandParent[i]];
+        i = world->islandParent[i];
+    }
+    return i;
+}
+
+void UniteIslands(VerletWorld *world, int a, int b) {
+    a = FindIsland(world, a);
+    b = FindIsland(world, b);
+    // the lower index becomes the root so islands are labelled the same
+    // way every run
+    if (a < b) world->islandParent[b] = a;
+    else if (b < a) world->islandParent[a] = b;
+}
+
+// an awake object met the sleeping object i, so i's island wakes and the
+// awake object stays up until they have settled together
+void TouchSleeping(VerletWorld *world, int i) {
+    world->islandFlags[world->islandId[i]] |= ISLAND_WAKE;
+}
+
+// unite awake object i with the awake objects it touches
+void UniteContacts(VerletWorld *world, int i) {
+    int cx = world->objectCell[i] % world->gridWidth;
+    int cy = world->objectCell[i] / world->gridWidth;
+    for (int y = cy - 1; y <= cy + 1; y++) {
+        if (y < 0 || y >= world->gridHeight) continue;
+        for (int x = cx - 1; x <= cx + 1; x++) {
+            if (x < 0 || x >= world->gridWidth) continue;
+            int cell = y*world->gridWidth + x;
+            for (int k = world->gridCellStart[cell]; k < world->gridCellStart[cell + 1]; k++) {
+                int j = world->gridCellObjects[k];
+                if (j == i || TEST_BIT(world->staticBits, j)) continue;
+                float dx = world->posX[i] - world->posX[j];
+                float dy = world->posY[i] - world->posY[j];
+                float reach = world->radii[i] + world->radii[j] + SLEEP_MARGIN;
+                if (dx*dx + dy*dy >= reach*reach) continue;
+                if (TEST_BIT(world->sleepingBits, j)) {
+                    TouchSleeping(world, j);
+                    world->quietFrames[i] = 0;
+                }
+                else {
+                    UniteIslands(world, i, j);
+                }
+            }
+        }
+    }
+}
+
+// Once per frame, after the substeps and while the grid still matches the
+// object indices. Awake objects are grouped into islands through contacts
+// and links. An island falls asleep once all of its objects have been
+// quiet for SLEEP_FRAMES frames, and a sleeping island wakes as soon as an
+// awake object touches it or is linked to it
+void UpdateSleep(VerletWorld *world, float dt) {
+    if (world->wakeAll || !world->sleepEnabled) {
+        for (int i = 0; i < world->numObjects; i++) {
+            if (TEST_BIT(world->sleepingBits, i)) WakeObject(world, i);
+            world->quietFrames[i] = 0;
+        }
+        world->wakeAll = false;
+        if (!world->sleepEnabled) return;
+    }
+
+    // The last integration added gravity on top of whatever the object was
+    // doing, so that part is taken out. A pile under pressure still trembles
+    // in short spikes, especially when solved in parallel strips, so the
+    // displacement is smoothed over frames before it is compared
+    for (int i = 0; i < world->numObjects; i++) {
+        world->islandParent[i] = i;
+        world->islandFlags[i] = 0;
+        if (TEST_BIT(world->frozenBits, i)) continue;
+        float dx = world->posX[i] - world->oldX[i] - world->gravity.x*dt*dt;
+        float dy = world->posY[i] - world->oldY[i] - world->gravity.y*dt*dt;
+        float speed = sqrtf(dx*dx + dy*dy)/dt;
+        world->motion[i] = world->quietFrames[i] == 0?
+            speed: world->motion[i] + (speed - world->motion[i])*SLEEP_SMOOTHING;
+        if (world->motion[i] > SLEEP_SPEED) world->quietFrames[i] = 0;
+        else if (world->quietFrames[i] < 255) world->quietFrames[i]++;
+    }
+
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->frozenBits, i) || world->gridWidth == 0 || world->objectCell[i] < 0) continue;
+        UniteContacts(world, i);
+    }
+    for (int l = 0; l < world->numLinks; l++) {
+        int obj1 = world->linkObject1[l];
+        int obj2 = world->linkObject2[l];
+        if (TEST_BIT(world->staticBits, obj1) || TEST_BIT(world->staticBits, obj2)) continue;
+        bool asleep1 = TEST_BIT(world->sleepingBits, obj1);
+        bool asleep2 = TEST_BIT(world->sleepingBits, obj2);
+        if (asleep1 != asleep2) {
+            TouchSleeping(world, asleep1? obj1: obj2);
+            world->quietFrames[asleep1? obj2: obj1] = 0;
+        }
+        else if (!asleep1) {
+            UniteIslands(world, obj1, obj2);
+        }
+    }
+
+    // woken objects are still frozen this frame and join islands next frame
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->sleepingBits, i) && (world->islandFlags[world->islandId[i]] & ISLAND_WAKE)) {
+            WakeObject(world, i);
+        }
+    }
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->frozenBits, i) || world->quietFrames[i] >= SLEEP_FRAMES) continue;
+        world->islandFlags[FindIsland(world, i)] |= ISLAND_RESTLESS;
+    }
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->frozenBits, i)) continue;
+        int root = FindIsland(world, i);
+        if (world->islandFlags[root] & ISLAND_RESTLESS) continue;
+        WRITE_BIT(world->sleepingBits, i, true);
+        world->islandId[i] = root;
+    }
+}
+
+// copy every field of object src over object dst
+void MoveObject(VerletWorld *world, int src, int dst) {
+    world->posX[dst] = world->posX[src];
+    world->posY[dst] = world->posY[src];
+    world->oldX[dst] = world->oldX[src];
+    world->oldY[dst] = world->oldY[src];
+    world->stepStartX[dst] = world->stepStartX[src];
+    world->stepStartY[dst] = world->stepStartY[src];
+    world->accX[dst] = world->accX[src];
+    world->accY[dst] = world->accY[src];
+    world->radii[dst] = world->radii[src];
+    world->colors[dst] = world->colors[src];
+    WRITE_BIT(world->staticBits, dst, TEST_BIT(world->staticBits, src));
+    WRITE_BIT(world->collidingBits, dst, TEST_BIT(world->collidingBits, src));
+    WRITE_BIT(world->removedBits, dst, TEST_BIT(world->removedBits, src));
+    WRITE_BIT(world->sleepingBits, dst, TEST_BIT(world->sleepingBits, src));
+    world->quietFrames[dst] = world->quietFrames[src];
+    world->motion[dst] = world->motion[src];
+    world->islandId[dst] = world->islandId[src];
+}
+
+// mark an object for removal at the end of the frame
+void RemoveVerletObject(VerletWorld *world, int index) {
+    if (index < 0 || index >= world->numObjects || TEST_BIT(world->removedBits, index)) return;
+    WRITE_BIT(world->removedBits, index, true);
+    world->numRemoved++;
+}
+
+void CullObjects(VerletWorld *world) {
+    Rectangle bounds = world->worldBounds;
+    for (int i = 0; i < world->numObjects; i++) {
+        // written so that objects with NaN positions are culled too
+        bool inside =
+            world->posX[i] >= bounds.x && world->posX[i] <= bounds.x + bounds.width &&
+            world->posY[i] >= bounds.y && world->posY[i] <= bounds.y + bounds.height;
+        if (!inside) {
+            RemoveVerletObject(world, i);
+        }
+    }
+}
+
+// swap delete every removed object, filling each hole with the last live
+// object, then rewrite the links through the resulting index remap and
+// drop the links that lost an end
+void FlushRemovedObjects(VerletWorld *world) {
+    if (world->numRemoved == 0) return;
+    for (int i = 0; i < world->numObjects; i++) {
+        world->objectRemap[i] = i;
+        if (TEST_BIT(world->sleepingBits, i)) world->islandFlags[world->islandId[i]] &= ~ISLAND_WAKE;
+    }
+    // the flags sit at the islands' roots, which are still where they were
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->removedBits, i) && TEST_BIT(world->sleepingBits, i)) {
+            world->islandFlags[world->islandId[i]] |= ISLAND_WAKE;
+        }
+    }
+
+    int count = world->numObjects;
+    int i = 0;
+    while (i < count) {
+        if (!TEST_BIT(world->removedBits, i)) {
+            i++;
+            continue;
+        }
+        world->objectRemap[i] = -1;
+        count--;
+        while (count > i && TEST_BIT(world->removedBits, count)) {
+            world->objectRemap[count] = -1;
+            count--;
+        }
+        if (count > i) {
+            MoveObject(world, count, i);
+            world->objectRemap[count] = i;
+            i++;
+        }
+    }
+    world->numObjects = count;
+    world->numRemoved = 0;
+    // objects moved, so a sort in progress starts over
+    world->sortStage = 0;
+    world->neighboursValid = false;
+    // a sleeping island that lost a member, its root or any other, wakes
+    // so nothing is left resting on an object that is gone
+    for (int i = 0; i < world->numObjects; i++) {
+        if (!TEST_BIT(world->sleepingBits, i)) continue;
+        bool lostMember = world->islandFlags[world->islandId[i]] & ISLAND_WAKE;
+        world->islandId[i] = world->objectRemap[world->islandId[i]];
+        if (lostMember) WakeObject(world, i);
+    }
+
+    int l = 0;
+    while (l < world->numLinks) {
+        int obj1 = world->objectRemap[world->linkObject1[l]];
+        int obj2 = world->objectRemap[world->linkObject2[l]];
+        if (obj1 < 0 || obj2 < 0) {
+            world->numLinks--;
+            world->linkObject1[l] = world->linkObject1[world->numLinks];
+            world->linkObject2[l] = world->linkObject2[world->numLinks];
+            world->linkDistance[l] = world->linkDistance[world->numLinks];
+            world->linkCompliance[l] = world->linkCompliance[world->numLinks];
+            world->linkMode[l] = world->linkMode[world->numLinks];
+            world->linksDirty = true;
+            continue;
+        }
+        world->linkObject1[l] = obj1;
+        world->linkObject2[l] = obj2;
+        l++;
+    }
+
+    // a body that lost a joint has a hole in it and goes, its other
+    // joints stay as a loose chain
+    int kept = 0;
+    int keptObjects = 0;
+    for (int b = 0; b < world->numBodies; b++) {
+        const int *objects = world->bodyObjects + world->bodyStart[b];
+        bool whole = true;
+        for (int k = 0; k < world->bodyCount[b] && whole; k++) {
+            whole = world->objectRemap[objects[k]] >= 0;
+        }
+        if (!whole) continue;
+        for (int k = 0; k < world->bodyCount[b]; k++) {
+            world->bodyObjects[keptObjects + k] = world->objectRemap[objects[k]];
+        }
+        world->bodyStart[kept] = keptObjects;
+        world->bodyCount[kept] = world->bodyCount[b];
+        world->bodyRestArea[kept] = world->bodyRestArea[b];
+        world->bodyPressure[kept] = world->bodyPressure[b];
+        world->bodyArea[kept] = world->bodyArea[b];
+        keptObjects += world->bodyCount[b];
+        kept++;
+    }
+    world->numBodies = kept;
+    world->numBodyObjects = keptObjects;
+}
+
+// spread the bits of a 16 bit value out to the even bits
+uint32_t SpreadBits(uint32_t v) {
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// reorder the first sortCount 4 byte elements of array by sortOrder
+void PermuteObjectArray(VerletWorld *world, void *array) {
+    uint32_t *elements = array;
+    for (int k = 0; k < world->sortCount; k++) {
+        world->sortScratch[k] = elements[world->sortOrder[k]];
+    }
+    memcpy(elements, world->sortScratch, sizeof(uint32_t)*world->sortCount);
+}
+
+void PermuteObjectBytes(VerletWorld *world, uint8_t *bytes) {
+    uint8_t *scratch = (uint8_t *)world->sortScratch;
+    for (int k = 0; k < world->sortCount; k++) {
+        scratch[k] = bytes[world->sortOrder[k]];
+    }
+    memcpy(bytes, scratch, world->sortCount);
+}
+
+void PermuteObjectBits(VerletWorld *world, uint32_t *bits) {
+    int words = BIT_WORDS(world->sortCount);
+    memset(world->sortScratch, 0, sizeof(uint32_t)*words);
+    for (int k = 0; k < world->sortCount; k++) {
+        WRITE_BIT(world->sortScratch, k, TEST_BIT(bits, world->sortOrder[k]));
+    }
+    // objects past sortCount share the last word and keep their bits
+    if (world->sortCount & 31) {
+        uint32_t tail = ~0u << (world->sortCount & 31);
+        world->sortScratch[words - 1] |= bits[words - 1] & tail;
+    }
+    memcpy(bits, world->sortScratch, sizeof(uint32_t)*words);
+}
+
+// move every object to its place in sortOrder and point the links and
+// bodies at the new indices. Links keep their colours since the link graph is the same
+void ApplyObjectOrder(VerletWorld *world) {
+    world->neighboursValid = false;
+    PermuteObjectArray(world, world->posX);
+    PermuteObjectArray(world, world->posY);
+    PermuteObjectArray(world, world->oldX);
+    PermuteObjectArray(world, world->oldY);
+    PermuteObjectArray(world, world->stepStartX);
+    PermuteObjectArray(world, world->stepStartY);
+    PermuteObjectArray(world, world->accX);
+    PermuteObjectArray(world, world->accY);
+    PermuteObjectArray(world, world->radii);
+    PermuteObjectArray(world, world->colors);
+    PermuteObjectBits(world, world->staticBits);
+    PermuteObjectBits(world, world->collidingBits);
+    PermuteObjectBits(world, world->removedBits);
+    PermuteObjectBits(world, world->sleepingBits);
+    PermuteObjectBytes(world, world->quietFrames);
+    PermuteObjectArray(world, world->motion);
+    PermuteObjectArray(world, world->islandId);
+
+    for (int k = 0; k < world->sortCount; k++) {
+        world->objectRemap[world->sortOrder[k]] = k;
+    }
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->sleepingBits, i) && world->islandId[i] < world->sortCount) {
+            world->islandId[i] = world->objectRemap[world->islandId[i]];
+        }
+    }
+    for (int l = 0; l < world->numLinks; l++) {
+        int obj1 = world->linkObject1[l];
+        int obj2 = world->linkObject2[l];
+        if (obj1 < world->sortCount) world->linkObject1[l] = world->objectRemap[obj1];
+        if (obj2 < world->sortCount) world->linkObject2[l] = world->objectRemap[obj2];
+    }
+    for (int k = 0; k < world->numBodyObjects; k++) {
+        int i = world->bodyObjects[k];
+        if (i < world->sortCount) world->bodyObjects[k] = world->objectRemap[i];
+    }
+}
+
+// Runs one stage of the spatial sort per call: the keys, then one LSD
+// radix pass per SORT_RADIX_BITS, then the reordering. Objects spawned
+// meanwhile sit past sortCount and are left alone, while removals restart
+// the sort. The keys are a few frames old by the time they are applied,
+// which only costs a little locality
+void SortObjectsStep(VerletWorld *world) {
+    if (world->sortStage == 0) {
+        if (++world->framesSinceSort < SORT_INTERVAL || world->gridWidth == 0) return;
+        world->framesSinceSort = 0;
+        world->sortCount = world->numObjects;
+        for (int i = 0; i < world->sortCount; i++) {
+            uint32_t x = GridCoordinate(world, world->posX[i], world->gridOrigin.x, 65536);
+            uint32_t y = GridCoordinate(world, world->posY[i], world->gridOrigin.y, 65536);
+            world->sortKeys[i] = SpreadBits(x) | (SpreadBits(y) << 1);
+            world->sortOrder[i] = i;
+        }
+        world->sortStage++;
+        return;
+    }
+
+    if (world->sortStage < SORT_STAGES - 1) {
+        int shift = (world->sortStage - 1)*SORT_RADIX_BITS;
+        int counts[1 << SORT_RADIX_BITS] = { 0 };
+        for (int k = 0; k < world->sortCount; k++) {
+            counts[(world->sortKeys[k] >> shift) & ((1 << SORT_RADIX_BITS) - 1)]++;
+        }
+        int sum = 0;
+        for (int b = 0; b < (1 << SORT_RADIX_BITS); b++) {
+            int count = counts[b];
+            counts[b] = sum;
+            sum += count;
+        }
+        for (int k = 0; k < world->sortCount; k++) {
+            int dst = counts[(world->sortKeys[k] >> shift) & ((1 << SORT_RADIX_BITS) - 1)]++;
+            world->sortKeysScratch[dst] = world->sortKeys[k];
+            world->sortOrderScratch[dst] = world->sortOrder[k];
+        }
+        uint32_t *swapKeys = world->sortKeys;
+        world->sortKeys = world->sortKeysScratch;
+        world->sortKeysScratch = swapKeys;
+        int *swapOrder = world->sortOrder;
+        world->sortOrder = world->sortOrderScratch;
+        world->sortOrderScratch = swapOrder;
+        world->sortStage++;
+        return;
+    }
+
+    ApplyObjectOrder(world);
+    world->sortStage = 0;
+}
+
+// Verlet velocity is implicit in (currentPos - oldPos), so when the step
+// time changes the old positions are moved to keep velocities the same
+void RescaleVelocities(VerletWorld *world, float ratio) {
+    for (int i = 0; i < world->numObjects; i++) {
+        world->oldX[i] = world->posX[i] - (world->posX[i] - world->oldX[i])*ratio;
+        world->oldY[i] = world->posY[i] - (world->posY[i] - world->oldY[i])*ratio;
+    }
+}
+
+// Pick the substeps and iterations of the next step. A step over budget or
+// with little error left gives up iterations first, then substeps. A step
+// with too much error takes more substeps first, since smaller steps
+// converge better than repeated passes, but only if the budget allows
+void AdaptSubsteps(VerletWorld *world, float error, double elapsed) {
+    bool overBudget = world->stepBudget > 0 && elapsed > world->stepBudget;
+    if (overBudget || error < ERROR_LOW) {
+        if (world->stepIterations > world->minIterations) world->stepIterations--;
+        else if (world->stepSubsteps > world->minSubsteps) world->stepSubsteps--;
+        return;
+    }
+    if (error > ERROR_HIGH) {
+        double passTime = elapsed/(world->stepSubsteps*world->stepIterations);
+        if (world->stepBudget > 0 && elapsed + passTime > world->stepBudget) return;
+        if (world->stepSubsteps < world->maxSubsteps) world->stepSubsteps++;
+        else if (world->stepIterations < world->maxIterations) world->stepIterations++;
+    }
+}
+
+uint64_t HashWord(uint64_t hash, uint32_t word) {
+    return (hash ^ word)*STATE_HASH_PRIME;
+}
+
+// floats are hashed by their bits, so -0 and 0 or two NaNs tell apart
+uint64_t HashFloats(uint64_t hash, const float *values, int count) {
+    for (int i = 0; i < count; i++) {
+        uint32_t word;
+        memcpy(&word, &values[i], sizeof(word));
+        hash = HashWord(hash, word);
+    }
+    return hash;
+}
+
+// Fold the positions, old positions and sleeping objects into the hash of
+// the frames before. Velocities are implicit in the old positions, so two
+// worlds with the same hash step on identically. Words are hashed by
+// value, the hash doesn't depend on the byte order
+void HashVerletState(VerletWorld *world) {
+    uint64_t hash = HashWord(world->stateHash, (uint32_t)world->numObjects);
+    hash = HashWord(hash, (uint32_t)world->numLinks);
+    hash = HashFloats(hash, world->posX, world->numObjects);
+    hash = HashFloats(hash, world->posY, world->numObjects);
+    hash = HashFloats(hash, world->oldX, world->numObjects);
+    hash = HashFloats(hash, world->oldY, world->numObjects);
+    for (int w = 0; w < BIT_WORDS(world->numObjects); w++) {
+        hash = HashWord(hash, world->sleepingBits[w]);
+    }
+    world->stateHash = hash;
+}
+
+// advance the simulation by steps fixed steps of dt seconds
+void UpdateVerlet(VerletWorld *world, float dt, int steps) {
+    for (int w = 0; w < BIT_WORDS(world->numObjects); w++) {
+        world->frozenBits[w] = world->staticBits[w] | world->sleepingBits[w];
+    }
+
+    for (int s = 0; s < steps; s++) {
+        double stepStart = GetHighResTime();
+        float substepTime = dt/world->stepSubsteps;
+        if (world->lastStepTime > 0 && substepTime != world->lastStepTime) {
+            RescaleVelocities(world, substepTime/world->lastStepTime);
+        }
+        world->lastStepTime = substepTime;
+        memcpy(world->stepStartX, world->posX, sizeof(float)*world->numObjects);
+        memcpy(world->stepStartY, world->posY, sizeof(float)*world->numObjects);
+
+        float worstOverlap = 0;
+        for (int k = 0; k < world->stepSubsteps; k++) {
+            double t = GetHighResTime();
+            if (world->numFields > 0) ApplyForceFields(world, substepTime);
+            else ApplyAcceleration(world, world->gravity);
+            if (world->attractorActive) {
+                AccelerateToPoint(world, world->attractorPos, 2000);
+            }
+            if (world->numBodies > 0) ApplyPressure(world);
+            t = RecordPassTime(world, PASS_ACCELERATION, t);
+            if (world->constraintEnabled) {
+                ApplyConstraintCircle(world, world->constraintCenter, world->constraintRadius);
+            }
+            t = RecordPassTime(world, PASS_CONSTRAINT, t);
+            ApplyColliders(world->posX, world->posY, world->radii, world->frozenBits, world->numObjects);
+            t = RecordPassTime(world, PASS_COLLIDERS, t);
+            // the multipliers add up over the iterations of one substep
+            if (world->numLinks > 0) memset(world->linkLambda, 0, sizeof(float)*world->numLinks);
+            float overlap = 0;
+            for (int it = 0; it < world->stepIterations; it++) {
+                overlap = SolveCollisions(world);
+                t = RecordPassTime(world, PASS_COLLISIONS, t);
+                ApplyLinks(world, substepTime);
+                t = RecordPassTime(world, PASS_LINKS, t);
+            }
+            // the last collision pass of a substep found what the passes
+            // before it left, and a spike in any substep counts
+            worstOverlap = fmaxf(worstOverlap, overlap);
+            if (k == world->stepSubsteps - 1) {
+                // the links are measured as they are now
+                world->stepError = fmaxf(worstOverlap, MeasureLinkStretch(world));
+                t = RecordPassTime(world, PASS_LINKS, t);
+            }
+            UpdatePositions(world, substepTime);
+            if (world->sweepEnabled) SweepFastObjects(world);
+            RecordPassTime(world, PASS_POSITIONS, t);
+        }
+        world->numSubsteps += world->stepSubsteps;
+        // a deterministic world adapts to the error alone, never to the clock
+        AdaptSubsteps(world, world->stepError, world->deterministic? 0: GetHighResTime() - stepStart);
+    }
+
+    if (steps > 0) {
+        double t = GetHighResTime();
+        UpdateSleep(world, world->lastStepTime);
+        if (world->profiled) EndProfileZone(ZONE_SLEEP, t);
+    }
+    CullObjects(world);
+    FlushRemovedObjects(world);
+    world->numSleeping = 0;
+    for (int i = 0; i < world->numObjects; i++) {
+        world->numSleeping += TEST_BIT(world->sleepingBits, i);
+    }
+    if (steps > 0) {
+        double t = GetHighResTime();
+        SortObjectsStep(world);
+        if (world->profiled) EndProfileZone(ZONE_SORT, t);
+        if (world->recorded) {
+            RecordFrame(world->posX, world->posY, world->radii, world->colors, world->numObjects, dt*steps);
+        }
+        if (world->deterministic) HashVerletState(world);
+    }
+}
+
+typedef struct WorldSteps {
+    VerletWorld **worlds;
+    float dt;
+    int steps;
+} WorldSteps;
+
+void StepWorldTask(int task, void *data) {
+    WorldSteps *job = data;
+    UpdateVerlet(job->worlds[task], job->dt, job->steps);
+}
+
+// One task per world, idle threads steal the worlds that are left so
+// worlds of different sizes still keep every thread busy. The passes
+// inside a world run inline on the thread stepping it, small worlds
+// gain nothing from splitting and their threads never wait on each other
+void StepVerletWorlds(VerletWorld **worlds, int count, float dt, int steps) {
+    UpdateColliderTree();
+    WorldSteps job = { worlds, dt, steps };
+    RunTasks(StepWorldTask, count, &job);
+}
+
+void ClearVerlet(VerletWorld *world) {
+    world->numObjects = 0;
+    world->numSleeping = 0;
+    world->numRemoved = 0;
+    world->sortStage = 0;
+    world->neighboursValid = false;
+    world->numLinks = 0;
+    world->linksDirty = true;
+    world->numBodies = 0;
+    world->numBodyObjects = 0;
+}
+
+// changing what pushes the objects wakes them all
+void SetVerletGravity(VerletWorld *world, Vector2 vector) {
+    if (vector.x != world->gravity.x || vector.y != world->gravity.y) world->wakeAll = true;
+    world->gravity = vector;
+}
+
+void SetVerletConstraint(VerletWorld *world, bool enabled) {
+    if (enabled != world->constraintEnabled) world->wakeAll = true;
+    world->constraintEnabled = enabled;
+}
+
+void SetVerletAttractor(VerletWorld *world, bool active, Vector2 point) {
+    if (active) world->wakeAll = true;
+    world->attractorActive = active;
+    world->attractorPos = point;
+}
+
+void WakeVerletObjects(VerletWorld *world) {
+    world->wakeAll = true;
+}
+
+void SetVerletSleeping(VerletWorld *world, bool enabled) {
+    world->sleepEnabled = enabled;
+}
+
+void SetVerletWorldBounds(VerletWorld *world, Rectangle bounds) {
+    world->worldBounds = bounds;
+    // the field grid is clipped to the bounds
+    world->fieldsDirty = true;
+}
+
+Rectangle GetVerletWorldBounds(VerletWorld *world) {
+    return world->worldBounds;
+}
+
+void SetVerletLinkSolver(VerletWorld *world, LinkSolver solver) {
+    world->linkSolver = solver;
+}
+
+Vector2 GetVerletGravity(VerletWorld *world) {
+    return world->gravity;
+}
+
+bool IsVerletConstraintEnabled(VerletWorld *world) {
+    return world->constraintEnabled;
+}
+
+// Snapshot files are this header followed by the object and link arrays
+// exactly as they sit in memory: posX, posY, oldX, oldY, radii and colors
+// for every object, then the static and colliding bitsets, then
+// linkObject1, linkObject2, linkDistance, linkCompliance and linkMode,
+// then bodyStart, bodyCount, bodyRestArea, bodyPressure and bodyObjects.
+// Every field is 4 bytes wide,
+// so each array stays aligned inside the mapped file. Little endian only
+typedef struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numObjects;
+    uint32_t numLinks;
+    uint32_t numBodies;
+    uint32_t numBodyObjects;
+    float gravityX;
+    float gravityY;
+    uint32_t constraintEnabled;
+    float constraintCenterX;
+    float constraintCenterY;
+    float constraintRadius;
+    // step the velocities in oldX/oldY were taken with
+    float stepTime;
+} SnapshotHeader;
+
+// an empty section writes nothing, its array may not even be allocated
+bool WriteSnapshotArray(const void *array, size_t elementSize, size_t count, FILE *file) {
+    return count == 0 || fwrite(array, elementSize, count, file) == count;
+}
+
+bool SaveVerletSnapshot(VerletWorld *world, const char *path) {
+    FlushRemovedObjects(world);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    SnapshotHeader header = {
+        .version = SNAPSHOT_VERSION,
+        .numObjects = (uint32_t)world->numObjects,
+        .numLinks = (uint32_t)world->numLinks,
+        .numBodies = (uint32_t)world->numBodies,
+        .numBodyObjects = (uint32_t)world->numBodyObjects,
+        .gravityX = world->gravity.x,
+        .gravityY = world->gravity.y,
+        .constraintEnabled = world->constraintEnabled,
+        .constraintCenterX = world->constraintCenter.x,
+        .constraintCenterY = world->constraintCenter.y,
+        .constraintRadius = world->constraintRadius,
+        .stepTime = world->lastStepTime,
+    };
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+
+    size_t n = (size_t)world->numObjects;
+    size_t words = (size_t)BIT_WORDS(world->numObjects);
+    size_t links = (size_t)world->numLinks;
+    size_t bodies = (size_t)world->numBodies;
+    size_t perimeter = (size_t)world->numBodyObjects;
+    bool ok =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        WriteSnapshotArray(world->posX, sizeof(float), n, file) &&
+        WriteSnapshotArray(world->posY, sizeof(float), n, file) &&
+        WriteSnapshotArray(world->oldX, sizeof(float), n, file) &&
+        WriteSnapshotArray(world->oldY, sizeof(float), n, file) &&
+        WriteSnapshotArray(world->radii, sizeof(float), n, file) &&
+        WriteSnapshotArray(world->colors, sizeof(Color), n, file) &&
+        WriteSnapshotArray(world->staticBits, sizeof(uint32_t), words, file) &&
+        WriteSnapshotArray(world->collidingBits, sizeof(uint32_t), words, file) &&
+        WriteSnapshotArray(world->linkObject1, sizeof(int), links, file) &&
+        WriteSnapshotArray(world->linkObject2, sizeof(int), links, file) &&
+        WriteSnapshotArray(world->linkDistance, sizeof(float), links, file) &&
+        WriteSnapshotArray(world->linkCompliance, sizeof(float), links, file) &&
+        WriteSnapshotArray(world->linkMode, sizeof(int), links, file) &&
+        WriteSnapshotArray(world->bodyStart, sizeof(int), bodies, file) &&
+        WriteSnapshotArray(world->bodyCount, sizeof(int), bodies, file) &&
+        WriteSnapshotArray(world->bodyRestArea, sizeof(float), bodies, file) &&
+        WriteSnapshotArray(world->bodyPressure, sizeof(float), bodies, file) &&
+        WriteSnapshotArray(world->bodyObjects, sizeof(int), perimeter, file);
+    return fclose(file) == 0 && ok;
+}
+
+// hand out the arrays of a mapped snapshot one after another
+const void *NextSnapshotArray(const char **cursor, size_t count, size_t elementSize) {
+    const void *array = *cursor;
+    *cursor += count*elementSize;
+    return array;
+}
+
+// Replaces the current scene with the snapshot. The file is mapped and
+// its arrays are copied into the pools in one block each, nothing is
+// parsed per object. Returns false and leaves the scene alone if the
+// file is missing, from another version or inconsistent
+bool LoadVerletSnapshot(VerletWorld *world, const char *path) {
+    size_t size = 0;
+    const char *data = MapFile(path, &size);
+    if (data == NULL) return false;
+
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    bool ok = size >= sizeof(SnapshotHeader) &&
+        memcmp(header->magic, SNAPSHOT_MAGIC, 4) == 0 &&
+        header->version == SNAPSHOT_VERSION &&
+        header->numObjects <= INT32_MAX/2 && header->numLinks <= INT32_MAX/2 &&
+        header->numBodies <= INT32_MAX/2 && header->numBodyObjects <= INT32_MAX/2;
+    size_t n = ok? header->numObjects: 0;
+    size_t words = BIT_WORDS(n);
+    size_t links = ok? header->numLinks: 0;
+    size_t bodies = ok? header->numBodies: 0;
+    size_t perimeter = ok? header->numBodyObjects: 0;
+    ok = ok && size == sizeof(SnapshotHeader) + 6*4*n + 2*4*words + 5*4*links + 4*4*bodies + 4*perimeter &&
+        ReserveObjects(world, (int)n) && ReserveLinks(world, (int)links) &&
+        ReserveBodies(world, (int)bodies, (int)perimeter);
+    if (!ok) {
+        UnmapFile(data, size);
+        return false;
+    }
+
+    const char *cursor = data + sizeof(SnapshotHeader);
+    const float *filePosX = NextSnapshotArray(&cursor, n, sizeof(float));
+    const float *filePosY = NextSnapshotArray(&cursor, n, sizeof(float));
+    const float *fileOldX = NextSnapshotArray(&cursor, n, sizeof(float));
+    const float *fileOldY = NextSnapshotArray(&cursor, n, sizeof(float));
+    const float *fileRadii = NextSnapshotArray(&cursor, n, sizeof(float));
+    const Color *fileColors = NextSnapshotArray(&cursor, n, sizeof(Color));
+    const uint32_t *fileStatic = NextSnapshotArray(&cursor, words, sizeof(uint32_t));
+    const uint32_t *fileColliding = NextSnapshotArray(&cursor, words, sizeof(uint32_t));
+    const int *fileObject1 = NextSnapshotArray(&cursor, links, sizeof(int));
+    const int *fileObject2 = NextSnapshotArray(&cursor, links, sizeof(int));
+    const float *fileDistance = NextSnapshotArray(&cursor, links, sizeof(float));
+    const float *fileCompliance = NextSnapshotArray(&cursor, links, sizeof(float));
+    const int *fileMode = NextSnapshotArray(&cursor, links, sizeof(int));
+    const int *fileBodyStart = NextSnapshotArray(&cursor, bodies, sizeof(int));
+    const int *fileBodyCount = NextSnapshotArray(&cursor, bodies, sizeof(int));
+    const float *fileRestArea = NextSnapshotArray(&cursor, bodies, sizeof(float));
+    const float *filePressure = NextSnapshotArray(&cursor, bodies, sizeof(float));
+    const int *fileBodyObjects = NextSnapshotArray(&cursor, perimeter, sizeof(int));
+
+    for (size_t l = 0; ok && l < links; l++) {
+        ok = fileObject1[l] >= 0 && (size_t)fileObject1[l] < n &&
+            fileObject2[l] >= 0 && (size_t)fileObject2[l] < n &&
+            fileCompliance[l] >= 0 && fileMode[l] >= LINK_TENSION && fileMode[l] <= LINK_BOTH;
+    }
+    for (size_t b = 0; ok && b < bodies; b++) {
+        ok = fileBodyStart[b] >= 0 && fileBodyCount[b] >= 3 &&
+            (size_t)fileBodyStart[b] <= perimeter && (size_t)fileBodyCount[b] <= perimeter - fileBodyStart[b];
+    }
+    for (size_t k = 0; ok && k < perimeter; k++) {
+        ok = fileBodyObjects[k] >= 0 && (size_t)fileBodyObjects[k] < n;
+    }
+    if (!ok) {
+        UnmapFile(data, size);
+        return false;
+    }
+
+    // empty sections have nothing to copy, and maybe no arrays to copy into
+    if (n > 0) {
+        memcpy(world->posX, filePosX, sizeof(float)*n);
+        memcpy(world->posY, filePosY, sizeof(float)*n);
+        memcpy(world->oldX, fileOldX, sizeof(float)*n);
+        memcpy(world->oldY, fileOldY, sizeof(float)*n);
+        memcpy(world->stepStartX, filePosX, sizeof(float)*n);
+        memcpy(world->stepStartY, filePosY, sizeof(float)*n);
+        memset(world->accX, 0, sizeof(float)*n);
+        memset(world->accY, 0, sizeof(float)*n);
+        memcpy(world->radii, fileRadii, sizeof(float)*n);
+        memcpy(world->colors, fileColors, sizeof(Color)*n);
+        memcpy(world->staticBits, fileStatic, sizeof(uint32_t)*words);
+        memcpy(world->collidingBits, fileColliding, sizeof(uint32_t)*words);
+        memset(world->removedBits, 0, sizeof(uint32_t)*words);
+        memset(world->sleepingBits, 0, sizeof(uint32_t)*words);
+        memset(world->quietFrames, 0, n);
+    }
+    if (links > 0) {
+        memcpy(world->linkObject1, fileObject1, sizeof(int)*links);
+        memcpy(world->linkObject2, fileObject2, sizeof(int)*links);
+        memcpy(world->linkDistance, fileDistance, sizeof(float)*links);
+        memcpy(world->linkCompliance, fileCompliance, sizeof(float)*links);
+        memcpy(world->linkMode, fileMode, sizeof(int)*links);
+    }
+    if (bodies > 0) {
+        memcpy(world->bodyStart, fileBodyStart, sizeof(int)*bodies);
+        memcpy(world->bodyCount, fileBodyCount, sizeof(int)*bodies);
+        memcpy(world->bodyRestArea, fileRestArea, sizeof(float)*bodies);
+        memcpy(world->bodyPressure, filePressure, sizeof(float)*bodies);
+    }
+    if (perimeter > 0) {
+        memcpy(world->bodyObjects, fileBodyObjects, sizeof(int)*perimeter);
+    }
+    world->numObjects = (int)n;
+    world->numRemoved = 0;
+    world->numSleeping = 0;
+    world->sortStage = 0;
+    world->neighboursValid = false;
+    world->numLinks = (int)links;
+    world->linksDirty = true;
+    world->numBodies = (int)bodies;
+    world->numBodyObjects = (int)perimeter;
+    for (int b = 0; b < world->numBodies; b++) {
+        world->bodyArea[b] = MeasureBodyArea(world, b);
+    }
+
+    world->gravity = (Vector2){ header->gravityX, header->gravityY };
+    world->constraintEnabled = header->constraintEnabled != 0;
+    world->constraintCenter = (Vector2){ header->constraintCenterX, header->constraintCenterY };
+    world->constraintRadius = header->constraintRadius;
+    // the next UpdateVerlet(world) rescales the velocities if its step differs
+    world->lastStepTime = header->stepTime;
+
+    UnmapFile(data, size);
+    return true;
+}
+
+// cell index along one axis of a state's draw grid, NaN lands in cell 0
+int DrawGridCoordinate(const PhysicsState *state, float position, float origin, int numCells) {
+    float cell = (position - origin)/state->gridCellSize;
+    if (!(cell > 0)) return 0;
+    if (cell >= numCells - 1) return numCells - 1;
+    return (int)cell;
+}
+
+// the cell a position is binned in. The cell size is a power of two, so
+// multiplying by its inverse bins exactly like DrawGridCoordinate
+static inline int DrawGridCell(const PhysicsState *state, float posX, float posY, float invCellSize) {
+    float x = (posX - state->gridOrigin.x)*invCellSize;
+    float y = (posY - state->gridOrigin.y)*invCellSize;
+    int cx = x > 0? (x < state->gridWidth - 1? (int)x: state->gridWidth - 1): 0;
+    int cy = y > 0? (y < state->gridHeight - 1? (int)y: state->gridHeight - 1): 0;
+    return cy*state->gridWidth + cx;
+}
+
+// Bin the state's objects into the draw grid by their current position,
+// with a counting sort like the collision grid's. Objects that fell far
+// out of the world only make the cells coarser
+void BuildDrawGrid(PhysicsState *state) {
+    state->gridWidth = 0;
+    state->gridHeight = 0;
+    state->drawReach = 0;
+    Vector2 min = { FLT_MAX, FLT_MAX };
+    Vector2 max = { -FLT_MAX, -FLT_MAX };
+    float reach = 0;
+    for (int i = 0; i < state->numObjects; i++) {
+        if (state->x[i] < min.x) min.x = state->x[i];
+        if (state->y[i] < min.y) min.y = state->y[i];
+        if (state->x[i] > max.x) max.x = state->x[i];
+        if (state->y[i] > max.y) max.y = state->y[i];
+        float moveX = fabsf(state->x[i] - state->oldX[i]);
+        float moveY = fabsf(state->y[i] - state->oldY[i]);
+        float objectReach = state->radius[i] + (moveX > moveY? moveX: moveY);
+        if (objectReach > reach) reach = objectReach;
+    }
+    state->drawReach = reach;
+    // no objects, or some at infinity
+    if (!(max.x >= min.x && max.x - min.x <= FLT_MAX && max.y - min.y <= FLT_MAX)) return;
+
+    float cellSize = DRAW_CELL_SIZE;
+    int width;
+    int height;
+    for (;;) {
+        width = (int)fminf((max.x - min.x)/cellSize, MAX_DRAW_CELLS) + 1;
+        height = (int)fminf((max.y - min.y)/cellSize, MAX_DRAW_CELLS) + 1;
+        if ((long)width*height <= MAX_DRAW_CELLS) break;
+        cellSize *= 2;
+    }
+    int numCells = width*height;
+    if (numCells > state->cellCapacity) {
+        bool ok =
+            GrowArray((void **)&state->cellStart, sizeof(int), state->cellCapacity + 1, MAX_DRAW_CELLS + 1) &&
+            GrowArray((void **)&state->linkCellStart, sizeof(int), state->cellCapacity + 1, MAX_DRAW_CELLS + 1);
+        if (!ok) return;
+        state->cellCapacity = MAX_DRAW_CELLS;
+    }
+    state->gridWidth = width;
+    state->gridHeight = height;
+    state->gridCellSize = cellSize;
+    state->gridOrigin = min;
+    float invCellSize = 1/cellSize;
+    memset(state->cellStart, 0, sizeof(int)*(numCells + 1));
+    for (int i = 0; i < state->numObjects; i++) {
+        state->cellStart[DrawGridCell(state, state->x[i], state->y[i], invCellSize)]++;
+    }
+    for (int c = 1; c <= numCells; c++) {
+        state->cellStart[c] += state->cellStart[c - 1];
+    }
+    for (int i = state->numObjects - 1; i >= 0; i--) {
+        state->cellObjects[--state->cellStart[DrawGridCell(state, state->x[i], state->y[i], invCellSize)]] = i;
+    }
+}
+
+// Copy the links whose objects made it into the state, counting sorted by
+// the draw cell of their midpoint so drawing visits the links in view the
+// way it does the objects, reaching out half the longest link further.
+// Without a grid they keep their order
+void CopyStateLinks(VerletWorld *world, PhysicsState *state) {
+    int count = state->numObjects;
+    int numCells = state->gridWidth*state->gridHeight;
+    state->numLinks = 0;
+    state->linkReach = state->drawReach;
+    if (numCells == 0) {
+        for (int l = 0; l < world->numLinks && state->numLinks < state->linkCapacity; l++) {
+            if (world->linkObject1[l] >= count || world->linkObject2[l] >= count) continue;
+            state->link1[state->numLinks] = world->linkObject1[l];
+            state->link2[state->numLinks] = world->linkObject2[l];
+            state->numLinks++;
+        }
+        return;
+    }
+
+    float invCellSize = 1/state->gridCellSize;
+    float longest = 0;
+    memset(state->linkCellStart, 0, sizeof(int)*(numCells + 1));
+    for (int l = 0; l < world->numLinks && state->numLinks < state->linkCapacity; l++) {
+        int obj1 = world->linkObject1[l];
+        int obj2 = world->linkObject2[l];
+        if (obj1 >= count || obj2 >= count) continue;
+        float midX = 0.5f*(state->x[obj1] + state->x[obj2]);
+        float midY = 0.5f*(state->y[obj1] + state->y[obj2]);
+        int cell = DrawGridCell(state, midX, midY, invCellSize);
+        state->linkCells[state->numLinks++] = cell;
+        state->linkCellStart[cell]++;
+        float dx = fabsf(state->x[obj1] - state->x[obj2]);
+        float dy = fabsf(state->y[obj1] - state->y[obj2]);
+        float extent = dx > dy? dx: dy;
+        if (extent > longest) longest = extent;
+    }
+    state->linkReach += 0.5f*longest;
+    for (int c = 1; c <= numCells; c++) {
+        state->linkCellStart[c] += state->linkCellStart[c - 1];
+    }
+    // the same links as above, each placed at the end of its cell's range
+    int placed = 0;
+    for (int l = 0; l < world->numLinks && placed < state->numLinks; l++) {
+        int obj1 = world->linkObject1[l];
+        int obj2 = world->linkObject2[l];
+        if (obj1 >= count || obj2 >= count) continue;
+        int k = --state->linkCellStart[state->linkCells[placed++]];
+        state->link1[k] = obj1;
+        state->link2[k] = obj2;
+    }
+}
+
+// Copy the objects, links and solver stats into a state another thread can
+// draw from. The state's arrays grow as needed, if they can't only the
+// objects and links that fit are copied
+void CopyVerletState(VerletWorld *world, PhysicsState *state) {
+    if (world->numObjects > state->objectCapacity) {
+        int capacity = state->objectCapacity;
+        bool ok =
+            GrowArray((void **)&state->x, sizeof(float), capacity, world->objectCapacity) &&
+            GrowArray((void **)&state->y, sizeof(float), capacity, world->objectCapacity) &&
+            GrowArray((void **)&state->oldX, sizeof(float), capacity, world->objectCapacity) &&
+            GrowArray((void **)&state->oldY, sizeof(float), capacity, world->objectCapacity) &&
+            GrowArray((void **)&state->radius, sizeof(float), capacity, world->objectCapacity) &&
+            GrowArray((void **)&state->colors, sizeof(Color), capacity, world->objectCapacity) &&
+            GrowArray((void **)&state->cellObjects, sizeof(int), capacity, world->objectCapacity);
+        if (ok) state->objectCapacity = world->objectCapacity;
+    }
+    if (world->numLinks > state->linkCapacity) {
+        int capacity = state->linkCapacity;
+        bool ok =
+            GrowArray((void **)&state->link1, sizeof(int), capacity, world->linkCapacity) &&
+            GrowArray((void **)&state->link2, sizeof(int), capacity, world->linkCapacity) &&
+            GrowArray((void **)&state->linkCells, sizeof(int), capacity, world->linkCapacity);
+        if (ok) state->linkCapacity = world->linkCapacity;
+    }
+    int count = world->numObjects < state->objectCapacity? world->numObjects: state->objectCapacity;
+    if (count > 0) {
+        memcpy(state->x, world->posX, sizeof(float)*count);
+        memcpy(state->y, world->posY, sizeof(float)*count);
+        memcpy(state->oldX, world->stepStartX, sizeof(float)*count);
+        memcpy(state->oldY, world->stepStartY, sizeof(float)*count);
+        memcpy(state->radius, world->radii, sizeof(float)*count);
+        memcpy(state->colors, world->colors, sizeof(Color)*count);
+    }
+    state->numObjects = count;
+    BuildDrawGrid(state);
+    CopyStateLinks(world, state);
+
+    state->numSleeping = world->numSleeping;
+    state->substeps = world->stepSubsteps;
+    state->iterations = world->stepIterations;
+    state->gravity = world->gravity;
+    state->constraint = world->constraintEnabled;
+}
+
+#if !defined(VERLET_HEADLESS)
+// position of an object alpha of the way from its previous step to its
+// current one
+static Vector2 GetDrawPosition(const PhysicsState *state, int i, float alpha) {
+    return (Vector2){
+        state->oldX[i] + (state->x[i] - state->oldX[i])*alpha,
+        state->oldY[i] + (state->y[i] - state->oldY[i])*alpha
+    };
+}
+
+// the part of the world the camera shows
+static Rectangle GetCameraView(Camera2D camera) {
+    Vector2 corners[4] = {
+        GetScreenToWorld2D((Vector2){ 0, 0 }, camera),
+        GetScreenToWorld2D((Vector2){ g_screenWidth, 0 }, camera),
+        GetScreenToWorld2D((Vector2){ 0, g_screenHeight }, camera),
+        GetScreenToWorld2D((Vector2){ g_screenWidth, g_screenHeight }, camera)
+    };
+    Vector2 min = corners[0];
+    Vector2 max = corners[0];
+    for (int c = 1; c < 4; c++) {
+        min = (Vector2){ fminf(min.x, corners[c].x), fminf(min.y, corners[c].y) };
+        max = (Vector2){ fmaxf(max.x, corners[c].x), fmaxf(max.y, corners[c].y) };
+    }
+    return (Rectangle){ min.x, min.y, max.x - min.x, max.y - min.y };
+}
+
+// Draw object i if it is in view: as a circle, or into the density tiles
+// if it is less than a pixel across
+static void DrawStateObject(const PhysicsState *state, int i, float alpha, Rectangle view, float zoom,
+        bool batched, bool tiled) {
+    Vector2 pos = GetDrawPosition(state, i, alpha);
+    float radius = state->radius[i];
+    if (pos.x + radius < view.x || pos.x - radius > view.x + view.width ||
+            pos.y + radius < view.y || pos.y - radius > view.y + view.height) {
+        return;
+    }
+    if (tiled && 2*radius*zoom < 1) AddToDensityTiles(pos, radius, state->colors[i]);
+    else if (batched) AddCircleToBatch(pos, radius, state->colors[i]);
+    else DrawCircleV(pos, radius, state->colors[i]);
+}
+
+// Draw link l if it crosses the view and is at least a pixel long, the
+// ends of shorter ones already show as density tiles
+static void DrawStateLink(const PhysicsState *state, int l, float alpha, Rectangle view, float pixel,
+        float thick, bool batched, Color color) {
+    Vector2 a = GetDrawPosition(state, state->link1[l], alpha);
+    Vector2 b = GetDrawPosition(state, state->link2[l], alpha);
+    if (fmaxf(a.x, b.x) + thick < view.x || fminf(a.x, b.x) - thick > view.x + view.width ||
+            fmaxf(a.y, b.y) + thick < view.y || fminf(a.y, b.y) - thick > view.y + view.height) {
+        return;
+    }
+    if (fabsf(b.x - a.x) + fabsf(b.y - a.y) < pixel) return;
+    if (batched) AddLineToBatch(a, b, thick);
+    else DrawLineEx(a, b, thick, color);
+}
+
+// Only the objects and links in the cells around the view are visited.
+// alpha is how far the renderer is between the last two physics steps
+void DrawVerletState(const PhysicsState *state, float alpha, Camera2D camera) {
+    Rectangle view = GetCameraView(camera);
+    float pixel = 1/camera.zoom;
+    float thick = 2.0f;
+
+    Color linkColor = { g_red, g_green, g_blue, 255 };
+    bool batched = g_batchRendering && BeginLineBatch(state->numLinks);
+    if (state->gridWidth == 0) {
+        for (int l = 0; l < state->numLinks; l++) {
+            DrawStateLink(state, l, alpha, view, pixel, thick, batched, linkColor);
+        }
+    }
+    else {
+        float reach = state->linkReach + thick;
+        int x0 = DrawGridCoordinate(state, view.x - reach, state->gridOrigin.x, state->gridWidth);
+        int x1 = DrawGridCoordinate(state, view.x + view.width + reach, state->gridOrigin.x, state->gridWidth);
+        int y0 = DrawGridCoordinate(state, view.y - reach, state->gridOrigin.y, state->gridHeight);
+        int y1 = DrawGridCoordinate(state, view.y + view.height + reach, state->gridOrigin.y, state->gridHeight);
+        for (int y = y0; y <= y1; y++) {
+            int end = state->linkCellStart[y*state->gridWidth + x1 + 1];
+            for (int l = state->linkCellStart[y*state->gridWidth + x0]; l < end; l++) {
+                DrawStateLink(state, l, alpha, view, pixel, thick, batched, linkColor);
+            }
+        }
+    }
+    if (batched) EndLineBatch(linkColor);
+
+    batched = g_batchRendering && BeginCircleBatch(state->numObjects);
+    bool tiled = BeginDensityTiles(camera);
+    if (state->gridWidth == 0) {
+        for (int i = 0; i < state->numObjects; i++) {
+            DrawStateObject(state, i, alpha, view, camera.zoom, batched, tiled);
+        }
+    }
+    else {
+        // the cells of a row in view are next to each other in cellObjects
+        float reach = state->drawReach;
+        int x0 = DrawGridCoordinate(state, view.x - reach, state->gridOrigin.x, state->gridWidth);
+        int x1 = DrawGridCoordinate(state, view.x + view.width + reach, state->gridOrigin.x, state->gridWidth);
+        int y0 = DrawGridCoordinate(state, view.y - reach, state->gridOrigin.y, state->gridHeight);
+        int y1 = DrawGridCoordinate(state, view.y + view.height + reach, state->gridOrigin.y, state->gridHeight);
+        for (int y = y0; y <= y1; y++) {
+            int end = state->cellStart[y*state->gridWidth + x1 + 1];
+            for (int k = state->cellStart[y*state->gridWidth + x0]; k < end; k++) {
+                DrawStateObject(state, state->cellObjects[k], alpha, view, camera.zoom, batched, tiled);
+            }
+        }
+    }
+    if (batched) EndCircleBatch();
+    if (tiled) EndDensityTiles();
+}
+
+#endif // VERLET_HEADLESS
+
+int GetNumObjects(VerletWorld *world) {
+    return world->numObjects;
+}
+
+int GetNumSleeping(VerletWorld *world) {
+    return world->numSleeping;
+}
+
+double GetVerletPassTime(VerletWorld *world, SolverPass pass) {
+    return world->passTimes[pass];
+}
+
+int GetVerletSubsteps(VerletWorld *world) {
+    return world->numSubsteps;
+}
+
+// clamp the counts the next step starts from into the new ranges
+void SetVerletSubsteps(VerletWorld *world, int minCount, int maxCount) {
+    world->minSubsteps = minCount > 1? minCount: 1;
+    world->maxSubsteps = maxCount > world->minSubsteps? maxCount: world->minSubsteps;
+    if (world->stepSubsteps < world->minSubsteps) world->stepSubsteps = world->minSubsteps;
+    if (world->stepSubsteps > world->maxSubsteps) world->stepSubsteps = world->maxSubsteps;
+}
+
+void SetVerletIterations(VerletWorld *world, int minCount, int maxCount) {
+    world->minIterations = minCount > 1? minCount: 1;
+    world->maxIterations = maxCount > world->minIterations? maxCount: world->minIterations;
+    if (world->stepIterations < world->minIterations) world->stepIterations = world->minIterations;
+    if (world->stepIterations > world->maxIterations) world->stepIterations = world->maxIterations;
+}
+
+void SetVerletNeighbourSkin(VerletWorld *world, float fraction) {
+    world->neighbourSkin = fraction > 0? fraction: 0;
+    world->neighboursValid = false;
+}
+
+int GetVerletNeighbourRebuilds(VerletWorld *world) {
+    return world->numRebuilds;
+}
+
+int GetVerletCollisionPasses(VerletWorld *world) {
+    return world->numCollisionPasses;
+}
+
+void SetVerletStepBudget(VerletWorld *world, double seconds) {
+    world->stepBudget = seconds;
+}
+
+int GetVerletStepSubsteps(VerletWorld *world) {
+    return world->stepSubsteps;
+}
+
+int GetVerletStepIterations(VerletWorld *world) {
+    return world->stepIterations;
+}
+
+float GetVerletStepError(VerletWorld *world) {
+    return world->stepError;
+}
+
+void ResetVerletPassTimes(VerletWorld *world) {
+    for (int i = 0; i < NUM_SOLVER_PASSES; i++) {
+        world->passTimes[i] = 0;
+    }
+    world->numSubsteps = 0;
+    world->numRebuilds = 0;
+    world->numCollisionPasses = 0;
+}
+
+void SetVerletProfiled(VerletWorld *world, bool enabled) {
+    world->profiled = enabled;
+}
+
+void SetVerletRecorded(VerletWorld *world, bool enabled) {
+    world->recorded = enabled;
+}
+
+void SetVerletDeterministic(VerletWorld *world, bool enabled) {
+    world->deterministic = enabled;
+}
+
+uint64_t GetVerletStateHash(VerletWorld *world) {
+    return world->stateHash;
+}
+
+void ResetVerletStateHash(VerletWorld *world) {
+    world->stateHash = STATE_HASH_BASIS;
+}
+
+void SetVerletSweeping(VerletWorld *world, bool enabled) {
+    world->sweepEnabled = enabled;
+}
+
+// Wake the sleeping islands with an object within reach of one of the
+// areas, the grid spreads a field's pull up to a cell beyond its bounds.
+// Islands elsewhere keep sleeping, so a field moved every frame costs the
+// rest of the world nothing
+void WakeObjectsInAreas(VerletWorld *world, const Rectangle *areas, int count) {
+    if (world->numSleeping == 0) return;
+    float pad = fmaxf(world->fieldCellSize, FIELD_CELL_SIZE);
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->sleepingBits, i)) world->islandFlags[world->islandId[i]] &= ~ISLAND_WAKE;
+    }
+    for (int i = 0; i < world->numObjects; i++) {
+        if (!TEST_BIT(world->sleepingBits, i)) continue;
+        float reach = world->radii[i] + pad;
+        for (int a = 0; a < count; a++) {
+            Rectangle area = areas[a];
+            bool inside =
+                world->posX[i] >= area.x - reach && world->posX[i] <= area.x + area.width + reach &&
+                world->posY[i] >= area.y - reach && world->posY[i] <= area.y + area.height + reach;
+            if (inside) world->islandFlags[world->islandId[i]] |= ISLAND_WAKE;
+        }
+    }
+    for (int i = 0; i < world->numObjects; i++) {
+        if (TEST_BIT(world->sleepingBits, i) && (world->islandFlags[world->islandId[i]] & ISLAND_WAKE)) {
+            WakeObject(world, i);
+        }
+    }
+}
+
+int AddVerletForceField(VerletWorld *world, ForceField field) {
+    int id = 0;
+    while (id < world->numFieldSlots && world->fieldUsed[id]) id++;
+    if (id == world->fieldCapacity) {
+        int capacity = world->fieldCapacity > 0? 2*world->fieldCapacity: 16;
+        bool ok =
+            GrowArray((void **)&world->fields, sizeof(ForceField), world->fieldCapacity, capacity) &&
+            GrowArray((void **)&world->fieldUsed, sizeof(bool), world->fieldCapacity, capacity);
+        if (!ok) return -1;
+        world->fieldCapacity = capacity;
+    }
+    if (id == world->numFieldSlots) world->numFieldSlots++;
+    world->fields[id] = field;
+    world->fieldUsed[id] = true;
+    world->numFields++;
+    world->fieldsDirty = true;
+    Rectangle bounds = GetFieldBounds(&field);
+    WakeObjectsInAreas(world, &bounds, 1);
+    return id;
+}
+
+void SetVerletForceField(VerletWorld *world, int id, ForceField field) {
+    if (id < 0 || id >= world->numFieldSlots || !world->fieldUsed[id]) return;
+    // what the field leaves and what it reaches both feel the change
+    Rectangle bounds[2] = { GetFieldBounds(&world->fields[id]), GetFieldBounds(&field) };
+    world->fields[id] = field;
+    world->fieldsDirty = true;
+    WakeObjectsInAreas(world, bounds, 2);
+}
+
+void RemoveVerletForceField(VerletWorld *world, int id) {
+    if (id < 0 || id >= world->numFieldSlots || !world->fieldUsed[id]) return;
+    world->fieldUsed[id] = false;
+    world->numFields--;
+    while (world->numFieldSlots > 0 && !world->fieldUsed[world->numFieldSlots - 1]) world->numFieldSlots--;
+    world->fieldsDirty = true;
+    Rectangle bounds = GetFieldBounds(&world->fields[id]);
+    WakeObjectsInAreas(world, &bounds, 1);
+}
+
+void ClearVerletForceFields(VerletWorld *world) {
+    if (world->numFields > 0) world->wakeAll = true;
+    for (int f = 0; f < world->numFieldSlots; f++) {
+        world->fieldUsed[f] = false;
     }
+    world->numFieldSlots = 0;
+    world->numFields = 0;
+    world->fieldsDirty = true;
 }
 
-int GetNumObjects(void) {
-    return numObjects;
+int GetNumForceFields(VerletWorld *world) {
+    return world->numFields;
 }